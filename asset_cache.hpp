@@ -0,0 +1,191 @@
+#ifndef _ASSET_CACHE_HPP
+#define _ASSET_CACHE_HPP
+
+#include <cassert>
+#include <cstdio>
+
+#include <stdint.h>
+
+#include "hash_table.hpp"
+#include "pool.hpp"
+
+// caches loaded assets (art, gumps, animations, multis, ...) keyed by an
+// integer id. entries go through two states: FETCHING while the asset is
+// being loaded, and READY once set_ready has been called with its size.
+//
+// the cache keeps track of how much gpu (atlas) and cpu memory the ready
+// entries use, and trim() throws out least recently used entries until both
+// are within budget again. entries that are still being fetched, or that
+// were used since the last trim, are never thrown out: pointers into them
+// may still be in use, e.g. by render commands that haven't been flushed
+// yet. so call trim() once per frame, after the last gfx_flush.
+//
+// K must convert to a 64 bit integer, V must be a plain old data type.
+const int ASSET_FETCHING = 0;
+const int ASSET_READY    = 1;
+
+template <typename K, typename V>
+struct asset_cache_t
+{
+    struct entry_t
+    {
+        K key;
+        int state;
+        long last_used;
+        long gpu_bytes;
+        long cpu_bytes;
+        bool prefetched; // loading was started ahead of time, with low priority
+        // least recently used first
+        entry_t *lru_prev, *lru_next;
+        V value;
+    };
+
+    const char *name;
+    // frees whatever the value holds on to
+    void (*release)(V *value);
+
+    hash_table_t<entry_t *> index;
+    object_pool_t<entry_t> pool;
+    entry_t *lru_first, *lru_last;
+
+    long gpu_budget, cpu_budget;
+    long gpu_bytes, cpu_bytes;
+
+    // bumped by every trim
+    long frame;
+
+    // statistics
+    int hits;
+    int misses;
+    int evictions;
+    int loads; // entries that became ready
+
+    void init(const char *cache_name, void (*release_value)(V *value), long gpu_budget_bytes, long cpu_budget_bytes)
+    {
+        name = cache_name;
+        release = release_value;
+        index.init(1024);
+        pool.init(256);
+        lru_first = lru_last = NULL;
+        gpu_budget = gpu_budget_bytes;
+        cpu_budget = cpu_budget_bytes;
+        gpu_bytes = cpu_bytes = 0;
+        frame = 0;
+        hits = misses = evictions = loads = 0;
+    }
+
+    void lru_unlink(entry_t *e)
+    {
+        if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+        else lru_first = e->lru_next;
+        if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+        else lru_last = e->lru_prev;
+        e->lru_prev = e->lru_next = NULL;
+    }
+
+    void lru_append(entry_t *e)
+    {
+        e->lru_prev = lru_last;
+        e->lru_next = NULL;
+        if (lru_last) lru_last->lru_next = e;
+        else lru_first = e;
+        lru_last = e;
+    }
+
+    entry_t *find(K key)
+    {
+        entry_t **e = index.find((uint64_t)key);
+        return e ? *e : NULL;
+    }
+
+    // marks the entry as used this frame, for holders of entry pointers that skip lookup
+    void touch(entry_t *e)
+    {
+        // only the first use in a frame has to move it, the rest find it at the end already
+        if (e->last_used != frame)
+        {
+            e->last_used = frame;
+            lru_unlink(e);
+            lru_append(e);
+        }
+    }
+
+    // returns the entry for key, or a fresh FETCHING one that the caller must start loading
+    entry_t *lookup(K key, bool *miss)
+    {
+        entry_t *e = find(key);
+        if (e)
+        {
+            hits += 1;
+            touch(e);
+            *miss = false;
+            return e;
+        }
+
+        misses += 1;
+        *miss = true;
+
+        e = pool.alloc();
+        e->key = key;
+        e->state = ASSET_FETCHING;
+        e->prefetched = false;
+        e->last_used = frame;
+        lru_append(e);
+        *index.insert((uint64_t)key) = e;
+
+        return e;
+    }
+
+    // the asset has arrived, and takes up this much memory
+    void set_ready(entry_t *e, long entry_gpu_bytes, long entry_cpu_bytes)
+    {
+        assert(e->state == ASSET_FETCHING);
+        e->state = ASSET_READY;
+        e->gpu_bytes = entry_gpu_bytes;
+        e->cpu_bytes = entry_cpu_bytes;
+        gpu_bytes += entry_gpu_bytes;
+        cpu_bytes += entry_cpu_bytes;
+        loads += 1;
+    }
+
+    void evict(entry_t *e)
+    {
+        assert(e->state == ASSET_READY);
+        lru_unlink(e);
+        index.remove((uint64_t)e->key);
+        gpu_bytes -= e->gpu_bytes;
+        cpu_bytes -= e->cpu_bytes;
+        release(&e->value);
+        pool.free(e);
+        evictions += 1;
+    }
+
+    void trim()
+    {
+        entry_t *e = lru_first;
+        while ((gpu_bytes > gpu_budget || cpu_bytes > cpu_budget) && e != NULL)
+        {
+            // everything from here on was used this frame
+            if (e->last_used == frame)
+            {
+                break;
+            }
+            entry_t *next = e->lru_next;
+            if (e->state == ASSET_READY)
+            {
+                evict(e);
+            }
+            e = next;
+        }
+        frame += 1;
+    }
+
+    void report()
+    {
+        printf("%s: %d entries, gpu %ld/%ld KiB, cpu %ld/%ld KiB, hits: %d, misses: %d, evictions: %d\n",
+            name, index.count, gpu_bytes / 1024, gpu_budget / 1024, cpu_bytes / 1024, cpu_budget / 1024, hits, misses, evictions);
+    }
+};
+
+#endif
+
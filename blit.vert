@@ -0,0 +1,52 @@
+#version 130
+
+// per vertex: which corner of the sprite this is
+in float corner;
+
+// per instance, see sprite_instance_t
+in vec4 corners01;
+in vec4 corners23;
+in vec4 tex_rect;
+in float depth;
+in vec4 param;
+
+uniform vec2 screen_size;
+// meshes are drawn moved by xy, with their depths scaled by w and moved by z
+uniform vec4 offset;
+
+out vec2 texCoord;
+out vec3 normal;
+flat out float texLayer;
+
+void main()
+{
+    vec2 pos;
+    if (corner < 0.5)
+    {
+        pos = corners01.xy;
+        texCoord = tex_rect.xy;
+    }
+    else if (corner < 1.5)
+    {
+        pos = corners01.zw;
+        texCoord = tex_rect.zy;
+    }
+    else if (corner < 2.5)
+    {
+        pos = corners23.xy;
+        texCoord = tex_rect.zw;
+    }
+    else
+    {
+        pos = corners23.zw;
+        texCoord = tex_rect.xw;
+    }
+    normal = param.xyz;
+    // param.w is the unnormalized layer of the land texture array
+    texLayer = floor(param.w * 65535.0 + 0.5);
+
+    // same mapping as glOrtho(0, width, height, 0, -1, 1)
+    pos += offset.xy;
+    float d = depth * offset.w + offset.z;
+    gl_Position = vec4(pos.x / screen_size.x * 2.0 - 1.0, 1.0 - pos.y / screen_size.y * 2.0, -d, 1.0);
+}
@@ -0,0 +1,12 @@
+#version 130
+
+uniform sampler2D tex;
+uniform sampler2D tex_depth;
+
+in vec2 texCoord;
+
+void main()
+{
+    gl_FragColor = texture(tex, texCoord);
+    gl_FragDepth = texture(tex_depth, texCoord).r;
+}
@@ -0,0 +1,10 @@
+#version 130
+
+// a window sized quad, given in clip space by glVertex
+out vec2 texCoord;
+
+void main()
+{
+    texCoord = gl_MultiTexCoord0.xy;
+    gl_Position = gl_Vertex;
+}
@@ -17,6 +17,20 @@ static long filesize(const char *filename)
     return end-beg;
 }
 
+bool file_exists(const char *filename)
+{
+    return access(filename, R_OK) == 0;
+}
+
+long file_size(const char *filename)
+{
+    if (!file_exists(filename))
+    {
+        return -1;
+    }
+    return filesize(filename);
+}
+
 const char *file_map(const char *filename, const char **end)
 {
     long size = filesize(filename);
@@ -1,6 +1,9 @@
 #ifndef _FILE_HPP
 #define _FILE_HPP
 
+bool file_exists(const char *filename);
+// -1 if the file can't be opened
+long file_size(const char *filename);
 const char *file_map(const char *filename, const char **end);
 void file_unmap(const char *p, const char *end);
 
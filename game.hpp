@@ -56,6 +56,10 @@ struct mobile_t
     int anim_action_id;
     int anim_frame_count;
     int anim_total_frames;
+
+    // links in the spatial grid cell the mobile is in
+    bool in_grid;
+    struct mobile_t *grid_prev, *grid_next;
 };
 
 // items can live in several places:
@@ -68,6 +72,7 @@ const int SPACETYPE_WORLD = 0;
 const int SPACETYPE_CONTAINER = 1;
 const int SPACETYPE_EQUIPPED = 2;
 const int SPACETYPE_DRAG = 3;
+const int SPACETYPE_NONE = 4; // not placed anywhere yet, e.g. known only by serial
 struct item_t
 {
     uint32_t serial;
@@ -81,6 +86,8 @@ struct item_t
         struct
         {
             int x, y, z;
+            // links in the spatial grid cell the item is in
+            item_t *grid_prev, *grid_next;
         } world;
         struct
         {
@@ -90,6 +97,8 @@ struct item_t
         {
             gump_t *container;
             int x, y;
+            // intrusive list of the items in the container
+            item_t *prev, *next;
         } container;
     } loc;
 };
@@ -161,7 +170,8 @@ struct gump_t
         {
             int gump_id;
             item_t *item;
-            std::list<item_t *> *items;
+            item_t *first_item, *last_item;
+            int item_count;
         } container;
         struct
         {
@@ -183,11 +193,16 @@ struct multi_t
     uint32_t serial;
     int x, y, z;
     int multi_id;
+
+    // links in the spatial grid cell the multi is in
+    bool in_grid;
+    multi_t *grid_prev, *grid_next;
 };
 
 
 void game_set_player_serial(uint32_t serial);
 uint32_t game_get_player_serial();
+void game_set_map(int map);
 void game_equip(mobile_t *m, uint32_t serial, int item_id, int layer, int hue);
 item_t *game_get_item(uint32_t serial);
 multi_t *game_get_multi(uint32_t serial);
@@ -198,9 +213,20 @@ void game_show_container(uint32_t item_serial, int gump_id);
 void game_show_paperdoll(mobile_t *m, std::wstring name);
 gump_t *game_create_generic_gump(uint32_t gump_serial, uint32_t gump_type_id, int x, int y);
 gump_t *game_get_container(uint32_t item_serial);
+void game_container_add(gump_t *container, item_t *item, int x, int y);
+void game_reserve_items(int n);
+void game_place_item(item_t *item, int x, int y, int z);
+void game_place_mobile(mobile_t *m, int x, int y, int z);
+void game_place_multi(multi_t *multi, int x, int y, int z);
+void game_set_update_range(int range);
 void game_pick_up_rejected();
 void game_do_action(uint32_t mob_serial, int action_id, int frame_count, int repeat_count, bool forward, bool do_repeat, int frame_delay);
 void game_move_rejected(int seq, int x, int y, int z, int dir);
 void game_move_ack(int seq, int flags);
 void game_speech(uint32_t serial, int font_id, std::wstring name, std::wstring s);
+// hints that these are about to be drawn, so their assets get loaded ahead of time
+void game_prefetch_mobile(mobile_t *m);
+void game_prefetch_item(int item_id);
+void game_prefetch_gump(int gump_id);
+void game_prefetch_generic_gump(gump_t *gump);
 
@@ -1,13 +1,20 @@
 #include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
 
 #include <stdint.h>
 
+#include <pthread.h>
+
 #include <algorithm>
-#include <list>
+#include <deque>
 #include <vector>
 
 #include "file.hpp"
 #include "gfx.hpp"
+#include "hash_table.hpp"
 
 #ifdef _LINUX
 
@@ -23,19 +30,32 @@
 
  #define GL3_PROTOTYPES 1
  #include <OpenGL/gl.h>
+ #include <OpenGL/glext.h>
  #include <OpenGL/glu.h>
+
+ // instancing is only exposed through the ARB extension in legacy contexts
+ #define glDrawArraysInstanced glDrawArraysInstancedARB
+ #define glVertexAttribDivisor glVertexAttribDivisorARB
  
  #include <SDL2/SDL.h>
 
 #endif
 
-extern int prg_blit_picking;
-extern int prg_blit_hue;
+extern int prg_blit;
+extern int prg_land;
+extern int prg_tiled;
+extern int prg_composite;
 
-extern const int window_width;
-extern const int window_height;
+extern int window_width;
+extern int window_height;
 
-pixel_storage_t get_hue_tex(int hue_id);
+// attribute locations, bound the same for every program before linking
+const int ATTRIB_CORNER    = 0;
+const int ATTRIB_CORNERS01 = 1;
+const int ATTRIB_CORNERS23 = 2;
+const int ATTRIB_TEX_RECT  = 3;
+const int ATTRIB_DEPTH     = 4;
+const int ATTRIB_PARAM     = 5;
 
 
 static bool check_gl_error(int line = -1)
@@ -52,6 +72,12 @@ static bool check_gl_error(int line = -1)
     return found_error;
 }
 
+static bool has_extension(const char *name)
+{
+    const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+    return extensions != NULL && strstr(extensions, name) != NULL;
+}
+
 static bool is_2pot(int n)
 {
     return n && ((n & (n - 1)) == 0);
@@ -88,467 +114,1874 @@ static int round_up_to_2pot(int n)
 }
 
 
-struct atlas_slot_t
+// staging memory for pixel uploads. with GL_ARB_buffer_storage this is a ring
+// inside one persistently mapped pixel unpack buffer: gfx_prepare_pixels on
+// the worker threads copies the visible pixels into it, and gfx_upload_tex2d
+// only queues a transfer from it into the atlas. the queued transfers go out
+// in one batch at the start of the next gfx_flush, followed by a fence. a
+// block freed by its owner is reused once the fence of the batch it was freed
+// in signals. the ring is only ever written to, so it is mapped write only:
+// everything that has to look at the pixels is done before they go in.
+//
+// the decoders still write into their own buffer first: trimming and hashing
+// need the whole sprite, and the ring only takes the visible part of it.
+//
+// blocks are handed out and reclaimed in order. a block its owner holds on to
+// for too long is skipped by the tail and left where it is, and the head
+// takes it back in when it gets there, so one block never stalls the ring.
+// when the ring is full (or unavailable) staging memory simply comes from
+// malloc and is uploaded right away.
+static const int staging_size = 32 << 20;
+static const int staging_alignment = 16;
+// bigger things would block too much of the ring at once
+static const int staging_max_alloc = staging_size / 8;
+// batches (about one a frame) a block may hold up the tail for
+static const uint32_t staging_stuck_batches = 300;
+
+struct staging_block_t
 {
-    bool valid;
+    int size;       // including alignment padding
+    bool freed;     // by its owner
+    uint32_t batch; // the batch it was freed in
+    uint32_t alloc_batch; // the batch it was allocated in
 };
 
-struct atlas_t
+struct staging_upload_t
 {
     unsigned int tex;
-    int width, height;
-    int slot_width, slot_height;
-    int slots_x, slots_y;
-    int slot_count;
-
-    atlas_slot_t slots[];
+    int layer; // in a texture array, -1 for 2d textures
+    int x, y, width, height;
+    int offset; // of the pixels in the ring, packed tightly
 };
 
-atlas_t *create_empty_atlas(int width, int height, int slot_width, int slot_height)
+struct staging_batch_t
 {
-    // make sure proper dimensions are specified
-    assert((width % slot_width) == 0);
-    assert((height % slot_height) == 0);
+    uint32_t batch;
+    GLsync fence;
+};
 
-    unsigned int tex;
-    glGenTextures(1, &tex);
-    glBindTexture(GL_TEXTURE_2D, tex);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, width, 0, GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, 0);
-    glBindTexture(GL_TEXTURE_2D, 0);
+static pthread_mutex_t staging_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct
+{
+    unsigned int pbo;
+    char *mapped; // NULL if there is no ring
+    // everything below is guarded by staging_mutex
+    hash_table_t<staging_block_t> blocks; // by offset in the ring
+    int head; // where the next block goes
+    int tail; // oldest block still in use
+    int used; // bytes from tail to head
+    std::vector<int> skipped; // blocks the tail went past, still in blocks
+    uint32_t batch;     // batch currently being collected
+    bool batch_used;    // anything was queued or freed in it
+    int ring_allocs;
+    int fallback_allocs;
+    int skipped_blocks;
+    // only touched by the main thread
+    uint32_t completed_batch; // all batches before this are done
+    std::vector<staging_upload_t> uploads;
+    std::deque<staging_batch_t> in_flight;
+} staging;
+
+static void staging_init()
+{
+    staging.mapped = NULL;
+    staging.blocks.init(1024);
+    staging.head = staging.tail = staging.used = 0;
+    staging.batch = 0;
+    staging.batch_used = false;
+    staging.completed_batch = 0;
+    staging.ring_allocs = staging.fallback_allocs = staging.skipped_blocks = 0;
+
+#ifdef GL_MAP_PERSISTENT_BIT
+    if (has_extension("GL_ARB_buffer_storage"))
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &staging.pbo);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.pbo);
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, staging_size, NULL, flags);
+        staging.mapped = (char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, staging_size, flags);
+        assert(staging.mapped != NULL);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+#endif
 
+    printf("[GFX] upload staging: %s\n", staging.mapped ? "persistently mapped ring" : "malloc");
     check_gl_error(__LINE__);
+}
 
-    int slots_x = width / slot_width;
-    int slots_y = height / slot_height;
+static bool in_staging_ring(const void *p)
+{
+    return staging.mapped != NULL && (const char *)p >= staging.mapped && (const char *)p < staging.mapped + staging_size;
+}
 
-    int slot_count = slots_x * slots_y;
+// fills size bytes at head with a block that is free right away
+static void staging_pad(int size)
+{
+    staging_block_t *pad = staging.blocks.insert(staging.head);
+    pad->size = size;
+    pad->freed = true;
+    pad->batch = 0;
+    pad->alloc_batch = staging.batch;
+    staging.used += size;
+    staging.head = (staging.head + size) % staging_size;
+}
 
-    atlas_t *atlas = (atlas_t *)malloc(sizeof(atlas_t) + slot_count * sizeof(atlas_slot_t));
+static void *staging_alloc(int size)
+{
+    int bytes = (size + staging_alignment - 1) & ~(staging_alignment - 1);
+    if (staging.mapped != NULL && bytes <= staging_max_alloc)
+    {
+        pthread_mutex_lock(&staging_mutex);
 
-    atlas->tex = tex;
-    atlas->width = width;
-    atlas->height = height;
-    atlas->slot_width = slot_width;
-    atlas->slot_height = slot_height;
-    atlas->slots_x = slots_x;
-    atlas->slots_y = slots_y;
-    atlas->slot_count = slot_count;
+        if (staging.used == 0)
+        {
+            staging.head = staging.tail = 0;
+        }
 
-    for (int i = 0; i < slot_count; i++)
-    {
-        atlas->slots[i].valid = false;
+        int offset;
+        for (;;)
+        {
+            offset = -1;
+            bool wrap = false;
+            if (staging.head >= staging.tail && staging.used < staging_size)
+            {
+                // free space is from head to the end, and from the start to tail
+                if (staging.head + bytes <= staging_size)
+                {
+                    offset = staging.head;
+                }
+                else if (bytes <= staging.tail)
+                {
+                    offset = 0;
+                    wrap = true;
+                }
+            }
+            else if (staging.head + bytes <= staging.tail)
+            {
+                offset = staging.head;
+            }
+            if (offset == -1)
+            {
+                break;
+            }
+
+            // the nearest skipped block in the way, if any
+            int consumed = wrap ? staging_size - staging.head + bytes : bytes;
+            int in_way = -1;
+            int in_way_distance = consumed;
+            for (int i = 0; i < (int)staging.skipped.size(); i++)
+            {
+                int distance = (staging.skipped[i] - staging.head + staging_size) % staging_size;
+                if (distance < in_way_distance)
+                {
+                    in_way = i;
+                    in_way_distance = distance;
+                }
+            }
+            if (in_way == -1)
+            {
+                if (wrap)
+                {
+                    // the rest of the ring goes into a block that is free right away
+                    staging_pad(staging_size - staging.head);
+                }
+                break;
+            }
+
+            // take it back in, with the space before it padded, and try again after it
+            int skipped = staging.skipped[in_way];
+            staging.skipped[in_way] = staging.skipped.back();
+            staging.skipped.pop_back();
+            if (skipped < staging.head)
+            {
+                staging_pad(staging_size - staging.head);
+            }
+            if (skipped > staging.head)
+            {
+                staging_pad(skipped - staging.head);
+            }
+            int skipped_size = staging.blocks.find(skipped)->size;
+            staging.used += skipped_size;
+            staging.head = (skipped + skipped_size) % staging_size;
+        }
+
+        if (offset != -1)
+        {
+            staging_block_t *block = staging.blocks.insert(offset);
+            block->size = bytes;
+            block->freed = false;
+            block->batch = 0;
+            block->alloc_batch = staging.batch;
+            staging.used += bytes;
+            staging.head = (offset + bytes) % staging_size;
+            staging.ring_allocs += 1;
+            pthread_mutex_unlock(&staging_mutex);
+            return staging.mapped + offset;
+        }
+
+        staging.fallback_allocs += 1;
+        pthread_mutex_unlock(&staging_mutex);
     }
 
-    return atlas;
+    return malloc(size);
 }
 
-std::list<atlas_t *> atlases;
+static void staging_free(void *p)
+{
+    if (!in_staging_ring(p))
+    {
+        free(p);
+        return;
+    }
 
-void dump_tga(const char *filename, int width, int height, void *argb1555_data);
+    pthread_mutex_lock(&staging_mutex);
+    staging_block_t *block = staging.blocks.find((char *)p - staging.mapped);
+    assert(block != NULL && !block->freed);
+    // transfers from it may still be queued, or in flight
+    block->freed = true;
+    block->batch = staging.batch;
+    staging.batch_used = true;
+    pthread_mutex_unlock(&staging_mutex);
+}
 
-void find_atlas_slot(int req_width, int req_height, atlas_t **atlas, int *slot_x, int *slot_y)
+// checks which batches are done and reclaims their blocks
+static void staging_reclaim()
 {
-    int slot_width  = round_up_to_2pot(req_width);
-    int slot_height = round_up_to_2pot(req_height);
+#ifdef GL_MAP_PERSISTENT_BIT
+    while (!staging.in_flight.empty())
+    {
+        staging_batch_t *b = &staging.in_flight.front();
+        GLenum status = glClientWaitSync(b->fence, 0, 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+        {
+            break;
+        }
+        glDeleteSync(b->fence);
+        staging.completed_batch = b->batch + 1;
+        staging.in_flight.pop_front();
+    }
+#endif
 
-    // make tiny things use a 32x32 slot, hopefully this improves atlas utilization
-    if (slot_width < 32)
+    pthread_mutex_lock(&staging_mutex);
+    while (staging.used > 0)
     {
-        slot_width = 32;
+        staging_block_t *block = staging.blocks.find(staging.tail);
+        assert(block != NULL);
+        int size = block->size;
+        if (!block->freed && staging.batch - block->alloc_batch > staging_stuck_batches)
+        {
+            // held for long, leave it be and go on past it
+            staging.skipped.push_back(staging.tail);
+            staging.skipped_blocks += 1;
+        }
+        else if (!block->freed || block->batch >= staging.completed_batch)
+        {
+            break;
+        }
+        else
+        {
+            staging.blocks.remove(staging.tail);
+        }
+        staging.used -= size;
+        staging.tail = (staging.tail + size) % staging_size;
     }
-    if (slot_height < 32 && slot_height != 1)
+    pthread_mutex_unlock(&staging_mutex);
+}
+
+// issues the queued transfers, and closes the current batch
+static void staging_flush_uploads()
+{
+    if (staging.mapped == NULL)
     {
-        slot_height = 32;
+        return;
     }
 
-    //printf("slot_width, slot_height: %d %d\n", slot_width, slot_height);
+    staging_reclaim();
 
-    // first look for an empty slot in existing atlases
-    for (std::list<atlas_t *>::iterator it = atlases.begin(); it != atlases.end(); ++it)
+#ifdef GL_MAP_PERSISTENT_BIT
+    if (!staging.uploads.empty())
     {
-        atlas_t *a = *it;
-
-        if (a->slot_width == slot_width && a->slot_height == slot_height)
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, staging.pbo);
+        unsigned int bound_tex = 0;
+        for (int i = 0; i < (int)staging.uploads.size(); i++)
         {
-            int slot_count = a->slot_count;
-
-            for (int i = 0; i < slot_count; i++)
+            staging_upload_t *u = &staging.uploads[i];
+            const char *pixels = (const char *)0 + u->offset;
+            if (u->layer >= 0)
             {
-                if (!a->slots[i].valid)
-                {
-                    // found one!
-                    *atlas = a;
-                    *slot_x = i % a->slots_x;
-                    *slot_y = i / a->slots_x;
-                    a->slots[i].valid = true;
-                    //printf("found a slot in an atlas: %d %d\n", *slot_x, *slot_y);
-                    return;
-                }
+                glBindTexture(GL_TEXTURE_2D_ARRAY, u->tex);
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, u->x, u->y, u->layer, u->width, u->height, 1, GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, pixels);
+                glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+                continue;
             }
+            if (u->tex != bound_tex)
+            {
+                glBindTexture(GL_TEXTURE_2D, u->tex);
+                bound_tex = u->tex;
+            }
+            glTexSubImage2D(GL_TEXTURE_2D, 0, u->x, u->y, u->width, u->height, GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, pixels);
         }
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        staging.uploads.clear();
+        check_gl_error(__LINE__);
     }
 
-    // no free slot found, create a new atlas!
-    {
-        int width = 1024;
-        int height = 1024;
-        assert(slot_width < width);
-        assert(slot_height < height);
-        atlas_t *a = create_empty_atlas(width, height, slot_width, slot_height);
-        atlases.push_back(a);
+    pthread_mutex_lock(&staging_mutex);
+    uint32_t batch = staging.batch;
+    bool batch_used = staging.batch_used;
+    staging.batch += 1;
+    staging.batch_used = false;
+    pthread_mutex_unlock(&staging_mutex);
 
-        *atlas = a;
-        *slot_x = 0;
-        *slot_y = 0;
-        a->slots[0].valid = true;
-        //printf("no slot found, created an atlas for slot size %d %d, w, h: %d %d, slots: %d\n", slot_width, slot_height, a->width, a->height, a->slot_count);
+    if (batch_used)
+    {
+        staging_batch_t b;
+        b.batch = batch;
+        b.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        staging.in_flight.push_back(b);
+    }
+    else if (staging.in_flight.empty())
+    {
+        // nothing to wait for
+        staging.completed_batch = batch + 1;
     }
+#endif
 }
 
-pixel_storage_t gfx_upload_tex2d(int width, int height, void *data)
+// atlases are packed in shelves: horizontal strips as high as the sprites in
+// them (rounded up a little, so similar sizes share a shelf), filled left to
+// right. freed regions go into a free list per rounded size, and are handed
+// out again to the next sprite of that size. when there is none, and the
+// sprite would need a new shelf, the smallest free region it fits in is
+// used instead, so churn across sizes doesn't keep opening shelves.
+struct atlas_t
+{
+    unsigned int tex;
+    int width, height;
+    int next_shelf_y;   // everything below this is still unused
+    long used_pixels;   // sum of the live sprites' real sizes
+    long region_pixels; // sum of the live regions' rounded sizes
+};
+
+struct shelf_t
+{
+    int atlas;
+    int y, height;
+    int next_x;
+};
+
+struct atlas_region_t
 {
-    atlas_t *atlas;
-    int slot_x, slot_y;
+    int atlas;
+    int x, y;
+    int width, height; // rounded size, the sprite uses the top left part
+    int used_width, used_height;
+    bool live;
+    int next_free;
+    uint8_t *alpha_mask; // 1 bit per used pixel, row by row. NULL if all are opaque
+    int refs; // uploads of identical pixels share the region, see gfx_upload_tex2d
+    uint64_t content_hash;
+    uint64_t content_check;
+};
 
-    find_atlas_slot(width, height, &atlas, &slot_x, &slot_y);
+static const int atlas_size = 1024;
 
-    check_gl_error(__LINE__);
+static std::vector<atlas_t> atlases;
+static std::vector<shelf_t> shelves;
+static std::vector<atlas_region_t> regions;
+
+// shelf currently being filled for each rounded height, -1 if none
+static int open_shelves[atlas_size + 1];
+static bool open_shelves_inited = false;
 
-    //unsigned int tex;
+// freed regions by rounded size, (width << 16 | height) -> first region index
+static hash_table_t<int> free_regions;
+// free regions handed out to smaller sprites than they were made for
+static int best_fit_reuses;
 
-    /*glGenTextures(1, &tex);
+static struct
+{
+    int uploads;
+    long trimmed_bytes; // transparent borders that weren't stored
+} trim_stats;
+
+#ifdef GFX_CHECK_TRIM
+static pthread_mutex_t trim_check_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int trim_checks, trim_check_failures;
+#endif
+
+// live regions by the hash of their pixels -> region index
+static hash_table_t<int> regions_by_content;
+static struct
+{
+    int shared_uploads; // uploads that got an existing region
+    long shared_bytes;  // what those would have taken up
+    long live_shared_bytes; // same, for the ones not freed yet
+} dedup;
+
+static int create_empty_atlas(int width, int height)
+{
+    unsigned int tex;
+    glGenTextures(1, &tex);
     glBindTexture(GL_TEXTURE_2D, tex);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture_width, texture_height, 0, GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, 0);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, data);
-    glBindTexture(GL_TEXTURE_2D, 0);*/
-
-    check_gl_error(__LINE__);
-
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
-    glBindTexture(GL_TEXTURE_2D, atlas->tex);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, slot_x * atlas->slot_width, slot_y * atlas->slot_height, width, height, GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, data);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, 0);
     glBindTexture(GL_TEXTURE_2D, 0);
 
-    if (check_gl_error(__LINE__))
-    {
-        printf("error uploading 2d texture w, h: %d, %d\n", width, height);
-    }
+    check_gl_error(__LINE__);
 
-    pixel_storage_t ps;
-    ps.width = width;
-    ps.height = height;
-    ps.tex = atlas->tex;
-    // the small tex offsets are necessary to prevent sampling outside of this atlas slot
-    ps.tcxs[0] = (slot_x * atlas->slot_width  +      0 + 0.1f) / (float)atlas->width ;
-    ps.tcxs[1] = (slot_x * atlas->slot_width  +  width - 0.1f) / (float)atlas->width ;
-    ps.tcxs[2] = (slot_x * atlas->slot_width  +  width - 0.1f) / (float)atlas->width ;
-    ps.tcxs[3] = (slot_x * atlas->slot_width  +      0 + 0.1f) / (float)atlas->width ;
-    ps.tcys[0] = (slot_y * atlas->slot_height +      0 + 0.1f) / (float)atlas->height;
-    ps.tcys[1] = (slot_y * atlas->slot_height +      0 + 0.1f) / (float)atlas->height;
-    ps.tcys[2] = (slot_y * atlas->slot_height + height - 0.1f) / (float)atlas->height;
-    ps.tcys[3] = (slot_y * atlas->slot_height + height - 0.1f) / (float)atlas->height;
-    /*ps.tcxs[0] = 0.0f;
-    ps.tcxs[1] = width / (float)texture_width;
-    ps.tcxs[2] = width / (float)texture_width;
-    ps.tcxs[3] = 0.0f;
-    ps.tcys[0] = 0.0f;
-    ps.tcys[1] = 0.0f;
-    ps.tcys[2] = height / (float)texture_height;
-    ps.tcys[3] = height / (float)texture_height;*/
+    atlas_t atlas;
+    atlas.tex = tex;
+    atlas.width = width;
+    atlas.height = height;
+    atlas.next_shelf_y = 0;
+    atlas.used_pixels = 0;
+    atlas.region_pixels = 0;
+    atlases.push_back(atlas);
 
-    return ps;
+    return (int)atlases.size() - 1;
 }
 
-static int compile_shader(const char *name, int type, const char *src, const char *end)
+static int round_up_width(int width)
 {
-    int shader = glCreateShader(type);
-    int length = end - src;
-    glShaderSource(shader, 1, &src, &length);
-    check_gl_error(__LINE__);
-    glCompileShader(shader);
+    return (width + 3) & ~3;
+}
 
-    int compiled_ok;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled_ok);
-    if (!compiled_ok)
+static int round_up_height(int height)
+{
+    // tiny things get tiny shelves, the rest share shelves in steps of 8
+    if (height <= 8)
     {
-        int log_length;
-        glGetShaderiv(shader, GL_INFO_LOG_LENGTH , &log_length);
-        if (log_length > 0)
-        {
-            char *log = (char *)malloc(log_length);
-            int hmz;
-            glGetShaderInfoLog(shader, log_length, &hmz, log);
-            printf("%d %d\n", hmz, log_length);
-            printf("Error compiling '%s':\n%s", name, log);
-            // TODO: more graceful?
-            exit(-1);
-            free(log);
-        }
-
-        return -1;
+        return round_up_to_2pot(height);
     }
-    return shader;
+    return (height + 7) & ~7;
 }
 
-static int link_program(const char *name, int shader0, int shader1)
+static int open_shelf(int height)
 {
-    int program = glCreateProgram();
-    glAttachShader(program, shader0);
-    glAttachShader(program, shader1);
-    glLinkProgram(program);
-
-    int linked_ok;
-    glGetProgramiv(program, GL_LINK_STATUS, &linked_ok);
-    if (!linked_ok)
+    int atlas = -1;
+    for (int i = 0; i < (int)atlases.size(); i++)
     {
-        int log_length;
-        glGetProgramiv(program, GL_INFO_LOG_LENGTH , &log_length);
-        if (log_length > 0)
+        if (atlases[i].next_shelf_y + height <= atlases[i].height)
         {
-            char *log = (char *)malloc(log_length+1);
-            int hmz;
-            glGetProgramInfoLog(program, log_length, &hmz, log);
-            assert(hmz == log_length);
-            printf("Error linking '%s':\n%s\n", name, log);
-            // TODO: more graceful?
-            exit(-1);
-            free(log);
+            atlas = i;
+            break;
         }
-
-        return -1;
     }
-    return program;
-}
-
-int gfx_upload_program(const char *vert_filename, const char *frag_filename)
-{
-    const char *vert_src_end;
-    const char *vert_src = file_map(vert_filename, &vert_src_end);
-    const char *frag_src_end;
-    const char *frag_src = file_map(frag_filename, &frag_src_end);
-
-    int s0 = compile_shader(vert_filename, GL_VERTEX_SHADER, vert_src, vert_src_end);
-    int s1 = compile_shader(frag_filename, GL_FRAGMENT_SHADER, frag_src, frag_src_end);
-
-    file_unmap(vert_src, vert_src_end);
-    file_unmap(frag_src, frag_src_end);
+    if (atlas == -1)
+    {
+        atlas = create_empty_atlas(atlas_size, atlas_size);
+    }
 
-    char program_name[1024];
-    sprintf(program_name, "program <%s> <%s>", vert_filename, frag_filename);
+    shelf_t shelf;
+    shelf.atlas = atlas;
+    shelf.y = atlases[atlas].next_shelf_y;
+    shelf.height = height;
+    shelf.next_x = 0;
+    shelves.push_back(shelf);
+    atlases[atlas].next_shelf_y += height;
 
-    return link_program(program_name, s0, s1);
+    return (int)shelves.size() - 1;
 }
 
-struct render_command_t
-{
-    //int xs[4];
-    //int ys[4];
-    //float tcxs[4];
-    //float tcys[4];
-
-    float pos[4][3];
-    float tex_coords[4][2];
-    float normal[4][3];
-    //int draw_prio;
-
-    unsigned int tex0;
-    unsigned int tex1;
-
-    int program;
-    int uniform1i0_loc;
-    int uniform1i0;
-    int uniform1i1_loc;
-    int uniform1i1;
-    //int uniform3f0_loc;
-    //float uniform3f0[3];
-};
-
-int cnt_render_commands = 0;
-int cnt_use_program = 0;
-int cnt_bind_tex0 = 0;
-int cnt_bind_tex1 = 0;
-int cnt_glbegin = 0;
-int cnt_glend = 0;
-
-int bound_program = 0;
-int bound_tex0 = 0;
-int bound_tex1 = 0;
-bool did_begin = false;
-
-static void render_command(render_command_t *cmd)
+// pops a region off the free list for this rounded size, -1 if it's empty
+static int take_free_region(uint64_t size_key)
 {
-    cnt_render_commands += 1;
-    if (cmd->program != bound_program)
+    int *free_head = free_regions.find(size_key);
+    if (free_head == NULL)
     {
-        if (did_begin)
-        {
-            glEnd();
-            did_begin = false;
-            cnt_glend += 1;
-        }
-        glUseProgram(cmd->program);
-        bound_program = cmd->program;
-        cnt_use_program += 1;
+        return -1;
+    }
+    int region = *free_head;
+    if (regions[region].next_free == -1)
+    {
+        free_regions.remove(size_key);
+    }
+    else
+    {
+        *free_head = regions[region].next_free;
     }
+    return region;
+}
 
-    if (cmd->program != 0)
+// the smallest free region a width x height sprite fits in, -1 if there is
+// none. regions much bigger than the sprite are left for bigger sprites.
+static int take_best_fit_region(int width, int height)
+{
+    uint64_t best_key = 0;
+    long best_area = 0;
+    for (int i = 0; i < free_regions.capacity; i++)
     {
-        if (did_begin)
+        if (!free_regions.slots[i].used)
         {
-            glEnd();
-            did_begin = false;
-            cnt_glend += 1;
+            continue;
         }
-        if (cmd->uniform1i0_loc != -1)
+        uint64_t key = free_regions.slots[i].key;
+        int free_width = (int)(key >> 16);
+        int free_height = (int)(key & 0xffff);
+        long area = (long)free_width * free_height;
+        if (free_width >= width && free_height >= height && area <= 4L * width * height &&
+            (best_area == 0 || area < best_area))
         {
-            glUniform1i(cmd->uniform1i0_loc, cmd->uniform1i0);
+            best_key = key;
+            best_area = area;
         }
-        if (cmd->uniform1i1_loc != -1)
-        {
-            glUniform1i(cmd->uniform1i1_loc, cmd->uniform1i1);
-        }
-        /*if (cmd->uniform3f0_loc != -1)
-        {
-            glUniform3fv(cmd->uniform3f0_loc, 1, cmd->uniform3f0);
-        }*/
     }
-    if (cmd->tex0 != bound_tex0)
+    if (best_area == 0)
     {
-        if (did_begin)
-        {
-            glEnd();
-            did_begin = false;
-            cnt_glend += 1;
-        }
-        glBindTexture(GL_TEXTURE_2D, cmd->tex0);
-        bound_tex0 = cmd->tex0;
-        cnt_bind_tex0 += 1;
+        return -1;
     }
-    if (cmd->tex1 != bound_tex1)
+    best_fit_reuses += 1;
+    return take_free_region(best_key);
+}
+
+static int alloc_atlas_region(int req_width, int req_height)
+{
+    if (!open_shelves_inited)
     {
-        if (did_begin)
+        for (int i = 0; i <= atlas_size; i++)
         {
-            glEnd();
-            did_begin = false;
-            cnt_glend += 1;
+            open_shelves[i] = -1;
         }
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, cmd->tex1);
-        glActiveTexture(GL_TEXTURE0);
-        bound_tex1 = cmd->tex1;
-        cnt_bind_tex1 += 1;
+        free_regions.init(256);
+        regions_by_content.init(1024);
+        open_shelves_inited = true;
     }
 
-    //check_gl_error(__LINE__);
+    int width = round_up_width(req_width);
+    int height = round_up_height(req_height);
+    assert(width <= atlas_size && height <= atlas_size);
 
-    if (!did_begin)
+    // reuse a freed region of the same size
+    uint64_t size_key = ((uint64_t)width << 16) | height;
+    int region = take_free_region(size_key);
+    if (region == -1)
     {
-        glBegin(GL_QUADS);
-        did_begin = true;
-        cnt_glbegin += 1;
+        // rather a bigger free region than a new shelf
+        int shelf = open_shelves[height];
+        if (shelf == -1 || shelves[shelf].next_x + width > atlases[shelves[shelf].atlas].width)
+        {
+            region = take_best_fit_region(width, height);
+        }
     }
-    for (int i = 0; i < 4; i++)
+    if (region == -1)
     {
-        glTexCoord2f(cmd->tex_coords[i][0], cmd->tex_coords[i][1]);
-        glNormal3f(cmd->normal[i][0], cmd->normal[i][1], cmd->normal[i][2]);
-        //printf("%f %f %f\n", cmd->normal[i][0], cmd->normal[i][1], cmd->normal[i][2]);
-
-        glVertex3f(cmd->pos[i][0], cmd->pos[i][1], cmd->pos[i][2]);
+        int shelf = open_shelves[height];
+        if (shelf == -1 || shelves[shelf].next_x + width > atlases[shelves[shelf].atlas].width)
+        {
+            shelf = open_shelf(height);
+            open_shelves[height] = shelf;
+        }
 
-        //glTexCoord2f(cmd->tcxs[i], cmd->tcys[i]);
-        //glVertex3f(cmd->xs[i], cmd->ys[i], cmd->draw_prio / 5000000.0f);
+        atlas_region_t r;
+        r.atlas = shelves[shelf].atlas;
+        r.x = shelves[shelf].next_x;
+        r.y = shelves[shelf].y;
+        r.width = width;
+        r.height = height;
+        shelves[shelf].next_x += width;
+        regions.push_back(r);
+        region = (int)regions.size() - 1;
     }
-    if (did_begin)
-    {
-        glEnd();
-        did_begin = false;
-        cnt_glend += 1;
-    }
-}
 
-//std::vector<render_command_t> cmds;
-std::vector<render_command_t> cmds[30];
+    atlas_region_t *r = &regions[region];
+    r->used_width = req_width;
+    r->used_height = req_height;
+    r->live = true;
+    r->next_free = -1;
+    r->alpha_mask = NULL;
+    atlases[r->atlas].used_pixels += req_width * req_height;
+    atlases[r->atlas].region_pixels += r->width * r->height;
 
-bool compare_program(const render_command_t &a, const render_command_t &b)
-{
-    return a.program < b.program;
+    return region;
 }
 
-bool compare_tex0(const render_command_t &a, const render_command_t &b)
+// land tiles all have the same size, so instead of the atlases they go into
+// one texture array, a layer each. all terrain then draws from one texture.
+static struct
 {
-    return a.tex0 < b.tex0;
-}
-
-/*bool myfunction (int i,int j) { return (i<j); }
-
-struct myclass {
-  bool operator() (int i,int j) { return (i<j);}
-} myobject;
-*/
-
-struct myclass {
-  bool operator() (const render_command_t &a, const render_command_t &b) { return a.tex0 < b.tex1; }
-} mysorter;
+    unsigned int tex;
+    int tile_width, tile_height;
+    int layer_count;
+    long max_bytes;
+    std::vector<int> free_layers;
+} land_array;
 
-void gfx_flush()
+void gfx_set_land_array_bytes(long bytes)
 {
-    //std::sort(cmds.begin(), cmds.end(), compare_tex0);
-    //std::sort(cmds.begin(), cmds.end(), compare_program);
+    land_array.max_bytes = bytes;
+}
 
-    // prepare a good state
+static void create_land_array(int tile_width, int tile_height)
+{
+    // as many layers as fit the budget, there are no more land ids than 0x4000.
+    // layers are handed out as tiles arrive, when they run out tiles go into
+    // the atlases.
+    int max_layers = 0;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+    long budget_layers = land_array.max_bytes / (2 * tile_width * tile_height);
+    land_array.layer_count = (int)std::max(1L, std::min((long)std::min(max_layers, 0x4000), budget_layers));
+    land_array.tile_width = tile_width;
+    land_array.tile_height = tile_height;
+
+    glGenTextures(1, &land_array.tex);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, land_array.tex);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB5_A1, tile_width, tile_height, land_array.layer_count, 0, GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, 0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+    // hand out low layers first
+    for (int i = land_array.layer_count - 1; i >= 0; i--)
+    {
+        land_array.free_layers.push_back(i);
+    }
+
+    if (check_gl_error(__LINE__))
+    {
+        printf("error creating land texture array, %d layers of %dx%d\n", land_array.layer_count, tile_width, tile_height);
+    }
+    printf("[GFX] land texture array: %d layers of %dx%d, %ld KiB\n", land_array.layer_count, tile_width, tile_height,
+        2L * land_array.layer_count * tile_width * tile_height / 1024);
+}
+
+void gfx_free_tex2d(pixel_storage_t *ps)
+{
+    if (ps->layer >= 0)
+    {
+        land_array.free_layers.push_back(ps->layer);
+        ps->layer = -1;
+        return;
+    }
+
+    int region = ps->region;
+    assert(region >= 0 && region < (int)regions.size());
+    atlas_region_t *r = &regions[region];
+    assert(r->live);
+    ps->region = -1;
+    r->refs -= 1;
+    if (r->refs > 0)
+    {
+        dedup.live_shared_bytes -= 2 * r->used_width * r->used_height;
+        return;
+    }
+    int *same_content = regions_by_content.find(r->content_hash);
+    if (same_content != NULL && *same_content == region)
+    {
+        regions_by_content.remove(r->content_hash);
+    }
+    r->live = false;
+    free(r->alpha_mask);
+    r->alpha_mask = NULL;
+    atlases[r->atlas].used_pixels -= r->used_width * r->used_height;
+    atlases[r->atlas].region_pixels -= r->width * r->height;
+
+    uint64_t size_key = ((uint64_t)r->width << 16) | r->height;
+    bool existed;
+    int *free_head = free_regions.insert(size_key, &existed);
+    r->next_free = existed ? *free_head : -1;
+    *free_head = region;
+}
+
+void gfx_report_atlas_occupancy()
+{
+    printf("[GFX] atlases: %d, shelves: %d, regions: %d\n", (int)atlases.size(), (int)shelves.size(), (int)regions.size());
+    for (int i = 0; i < (int)atlases.size(); i++)
+    {
+        atlas_t *a = &atlases[i];
+        double total = (double)a->width * a->height;
+        printf("[GFX]  atlas %d (%dx%d): shelves up to %.1f%%, regions %.1f%%, sprites %.1f%%\n", i, a->width, a->height,
+            100.0 * a->next_shelf_y / a->height,
+            100.0 * a->region_pixels / total,
+            100.0 * a->used_pixels / total);
+    }
+    printf("[GFX] free regions reused for smaller sprites: %d\n", best_fit_reuses);
+    printf("[GFX] upload staging: %d from the ring, %d from malloc, %d held too long and skipped\n",
+        staging.ring_allocs, staging.fallback_allocs, staging.skipped_blocks);
+    printf("[GFX] identical uploads: %d shared a region, saving %ld KiB (%ld KiB now)\n",
+        dedup.shared_uploads, dedup.shared_bytes / 1024, dedup.live_shared_bytes / 1024);
+    printf("[GFX] transparent borders: %ld KiB trimmed off %d uploads\n", trim_stats.trimmed_bytes / 1024, trim_stats.uploads);
+#ifdef GFX_CHECK_TRIM
+    printf("[GFX] trim check: %d sprites checked, %d misplaced\n", trim_checks, trim_check_failures);
+#endif
+}
+
+// the decoders set the top (alpha) bit of every visible argb1555 pixel.
+// with only one bit of alpha nothing can be partially transparent, so
+// sprites are either GFX_OPAQUE or GFX_ALPHA_TESTED, never GFX_TRANSLUCENT.
+// alpha tested ones keep their alpha bits around for picking.
+// pixels are width x height out of rows row_length pixels apart
+static uint8_t *build_alpha_mask(int width, int height, int row_length, uint16_t *pixels)
+{
+    bool all_opaque = true;
+    for (int y = 0; y < height && all_opaque; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            if ((pixels[y * row_length + x] & 0x8000) == 0)
+            {
+                all_opaque = false;
+                break;
+            }
+        }
+    }
+    if (all_opaque)
+    {
+        return NULL;
+    }
+
+    int count = width * height;
+    uint8_t *mask = (uint8_t *)calloc((count + 7) / 8, 1);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int i = y * width + x;
+            if (pixels[y * row_length + x] & 0x8000)
+            {
+                mask[i >> 3] |= 1 << (i & 7);
+            }
+        }
+    }
+    return mask;
+}
+
+// two independent 64 bit hashes over the pixels, 4 at a time, seeded with the
+// size: a multiply-xorshift one to find identical sprites by, and a
+// multiply-rotate one to check a match with. the pixels can't be compared
+// byte by byte, they're in write only staging memory by then.
+static void hash_pixels(int width, int height, int row_length, uint16_t *pixels, uint64_t *hash, uint64_t *check)
+{
+    uint64_t seed = ((uint64_t)width << 32) | (uint32_t)height;
+    uint64_t h = seed * 0x9e3779b97f4a7c15ull;
+    uint64_t c = seed * 0xc2b2ae3d27d4eb4full + 0x165667b19e3779f9ull;
+    for (int y = 0; y < height; y++)
+    {
+        const char *p = (const char *)&pixels[y * row_length];
+        int size = 2 * width;
+        int i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64_t v;
+            memcpy(&v, p + i, 8);
+            h = (h ^ v) * 0xff51afd7ed558ccdull;
+            h ^= h >> 32;
+            c = (c + v) * 0x94d049bb133111ebull;
+            c = (c << 31) | (c >> 33);
+        }
+        for (; i < size; i += 2)
+        {
+            uint16_t v;
+            memcpy(&v, p + i, 2);
+            h = (h ^ v) * 0xff51afd7ed558ccdull;
+            h ^= h >> 32;
+            c = (c + v) * 0x94d049bb133111ebull;
+            c = (c << 31) | (c >> 33);
+        }
+    }
+    *hash = h;
+    *check = c;
+}
+
+// the smallest rectangle holding all visible pixels, 0 x 0 if there are none
+static void opaque_bounds(int width, int height, uint16_t *pixels, int *min_x, int *min_y, int *bounds_width, int *bounds_height)
+{
+    int x0 = width, y0 = height, x1 = 0, y1 = 0;
+    for (int y = 0; y < height; y++)
+    {
+        uint16_t *row = &pixels[y * width];
+        int left = 0;
+        while (left < width && (row[left] & 0x8000) == 0)
+        {
+            left += 1;
+        }
+        if (left == width)
+        {
+            continue;
+        }
+        int right = width;
+        while ((row[right - 1] & 0x8000) == 0)
+        {
+            right -= 1;
+        }
+        x0 = std::min(x0, left);
+        x1 = std::max(x1, right);
+        y0 = std::min(y0, y);
+        y1 = y + 1;
+    }
+    if (x0 >= x1)
+    {
+        x0 = y0 = x1 = y1 = 0;
+    }
+    *min_x = x0;
+    *min_y = y0;
+    *bounds_width = x1 - x0;
+    *bounds_height = y1 - y0;
+}
+
+static pixel_storage_t region_storage(int region)
+{
+    atlas_region_t *r = &regions[region];
+    atlas_t *atlas = &atlases[r->atlas];
+    int width = r->used_width;
+    int height = r->used_height;
+
+    pixel_storage_t ps;
+    ps.width = width;
+    ps.height = height;
+    ps.tex = atlas->tex;
+    ps.sprite_class = r->alpha_mask != NULL ? GFX_ALPHA_TESTED : GFX_OPAQUE;
+    ps.region = region;
+    ps.layer = -1;
+    ps.trim_x = 0;
+    ps.trim_y = 0;
+    ps.trim_width = width;
+    ps.trim_height = height;
+    // the small tex offsets are necessary to prevent sampling outside of this atlas region
+    ps.tcxs[0] = (r->x +      0 + 0.1f) / (float)atlas->width ;
+    ps.tcxs[1] = (r->x +  width - 0.1f) / (float)atlas->width ;
+    ps.tcxs[2] = (r->x +  width - 0.1f) / (float)atlas->width ;
+    ps.tcxs[3] = (r->x +      0 + 0.1f) / (float)atlas->width ;
+    ps.tcys[0] = (r->y +      0 + 0.1f) / (float)atlas->height;
+    ps.tcys[1] = (r->y +      0 + 0.1f) / (float)atlas->height;
+    ps.tcys[2] = (r->y + height - 0.1f) / (float)atlas->height;
+    ps.tcys[3] = (r->y + height - 0.1f) / (float)atlas->height;
+
+    return ps;
+}
+
+// the region's sprite, with the transparent border that was cut off around it
+static pixel_storage_t trimmed_storage(int region, int width, int height, int trim_x, int trim_y)
+{
+    pixel_storage_t ps = region_storage(region);
+    ps.width = width;
+    ps.height = height;
+    ps.trim_x = trim_x;
+    ps.trim_y = trim_y;
+    return ps;
+}
+
+// what gfx_upload_tex2d needs to know about a sprite, worked out by
+// gfx_prepare_pixels while the pixels are still in the decoding thread's cache
+struct gfx_pixels_t
+{
+    int width, height;
+    // the part of width x height with visible pixels in it
+    int trim_x, trim_y, trim_width, trim_height;
+    uint64_t content_hash, content_check;
+    uint8_t *alpha_mask; // of the visible part, NULL if it's all opaque
+    uint16_t *pixels;    // the visible part, trim_width x trim_height, in staging memory
+};
+
+#ifdef GFX_CHECK_TRIM
+// build with -DGFX_CHECK_TRIM to check every prepared sprite against its
+// untrimmed self: placed by trim_quad (plain and flipped), the stored pixels
+// must show up exactly where the whole sprite has them, with nothing but
+// transparency around them. the tally is in the atlas report.
+static void trim_quad(pixel_storage_t *ps, int xs[4], int ys[4], int trimmed_xs[4], int trimmed_ys[4]);
+
+static bool trim_placement_matches(int width, int height, uint16_t *data, gfx_pixels_t *p, bool flip)
+{
+    pixel_storage_t ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.width = width;
+    ps.height = height;
+    ps.trim_x = p->trim_x;
+    ps.trim_y = p->trim_y;
+    ps.trim_width = p->trim_width;
+    ps.trim_height = p->trim_height;
+
+    // anywhere on screen, flipped the way mirrored animation frames are
+    int x0 = 100, y0 = 50;
+    int xs[4] = { x0, x0 + width, x0 + width, x0 };
+    int ys[4] = { y0, y0, y0 + height, y0 + height };
+    if (flip)
+    {
+        std::swap(xs[0], xs[1]);
+        std::swap(xs[2], xs[3]);
+    }
+    bool visible = p->trim_width > 0 && p->trim_height > 0;
+    int txs[4], tys[4];
+    trim_quad(&ps, xs, ys, txs, tys);
+    if (visible && (txs[0] != txs[3] || txs[1] != txs[2] || tys[0] != tys[1] || tys[2] != tys[3]))
+    {
+        return false;
+    }
+    int left = std::min(txs[0], txs[1]);
+    int right = std::max(txs[0], txs[1]);
+
+    for (int sy = y0; sy < y0 + height; sy++)
+    for (int sx = x0; sx < x0 + width; sx++)
+    {
+        // what the untrimmed quad shows on this screen pixel
+        int ux = flip ? x0 + width - 1 - sx : sx - x0;
+        uint16_t expected = data[(sy - y0) * width + ux];
+
+        // and what the trimmed one samples there. the ring is write only, the
+        // stored pixels are read back from where they were copied from.
+        uint16_t got = 0;
+        if (visible && sx >= left && sx < right && sy >= tys[0] && sy < tys[2])
+        {
+            float fu = (sx + 0.5f - txs[0]) / (float)(txs[1] - txs[0]);
+            float fv = (sy + 0.5f - tys[0]) / (float)(tys[3] - tys[0]);
+            int tx = std::min((int)floorf(fu * p->trim_width), p->trim_width - 1);
+            int ty = std::min((int)floorf(fv * p->trim_height), p->trim_height - 1);
+            got = data[(p->trim_y + ty) * width + p->trim_x + tx];
+        }
+
+        bool expected_visible = (expected & 0x8000) != 0;
+        bool got_visible = (got & 0x8000) != 0;
+        if (expected_visible != got_visible || (expected_visible && expected != got))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void check_trim(int width, int height, uint16_t *data, gfx_pixels_t *p)
+{
+    bool ok = trim_placement_matches(width, height, data, p, false) &&
+              trim_placement_matches(width, height, data, p, true);
+    pthread_mutex_lock(&trim_check_mutex);
+    trim_checks += 1;
+    if (!ok)
+    {
+        trim_check_failures += 1;
+        printf("[GFX] trim check failed: %dx%d sprite trimmed to %dx%d at %d,%d\n",
+            width, height, p->trim_width, p->trim_height, p->trim_x, p->trim_y);
+    }
+    pthread_mutex_unlock(&trim_check_mutex);
+}
+#endif
+
+gfx_pixels_t *gfx_prepare_pixels(int width, int height, uint16_t *data)
+{
+    gfx_pixels_t *p = (gfx_pixels_t *)malloc(sizeof(gfx_pixels_t));
+    p->width = width;
+    p->height = height;
+
+    // lots of sprites have wide transparent borders, only what's inside them is stored
+    opaque_bounds(width, height, data, &p->trim_x, &p->trim_y, &p->trim_width, &p->trim_height);
+    uint16_t *visible = data + p->trim_y * width + p->trim_x;
+    hash_pixels(p->trim_width, p->trim_height, width, visible, &p->content_hash, &p->content_check);
+    p->alpha_mask = build_alpha_mask(p->trim_width, p->trim_height, width, visible);
+
+    // one pass of plain row copies, staging memory may be slow to write to any other way
+    p->pixels = (uint16_t *)staging_alloc(std::max(2, 2 * p->trim_width * p->trim_height));
+    for (int y = 0; y < p->trim_height; y++)
+    {
+        memcpy(&p->pixels[y * p->trim_width], &visible[y * width], 2 * p->trim_width);
+    }
+
+#ifdef GFX_CHECK_TRIM
+    check_trim(width, height, data, p);
+#endif
+    return p;
+}
+
+void gfx_free_pixels(gfx_pixels_t *p)
+{
+    staging_free(p->pixels);
+    free(p->alpha_mask);
+    free(p);
+}
+
+struct survey_entry_t
+{
+    uint64_t content_check;
+    int width, height;
+};
+
+static struct
+{
+    hash_table_t<survey_entry_t> seen; // by content hash
+    // since the last report, and in total
+    int sprites[2], shared_sprites[2];
+    long bytes[2], shared_bytes[2];
+} survey;
+
+void gfx_survey_pixels(gfx_pixels_t *p)
+{
+    if (survey.seen.slots == NULL)
+    {
+        survey.seen.init(1 << 16);
+    }
+
+    // what gfx_upload_tex2d would have to store, and whether it would share a region for it
+    long bytes = 2L * p->trim_width * p->trim_height;
+    bool shared = false;
+    bool existed;
+    survey_entry_t *e = survey.seen.insert(p->content_hash, &existed);
+    if (!existed)
+    {
+        e->content_check = p->content_check;
+        e->width = p->trim_width;
+        e->height = p->trim_height;
+    }
+    else
+    {
+        shared = e->content_check == p->content_check && e->width == p->trim_width && e->height == p->trim_height;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        survey.sprites[i] += 1;
+        survey.bytes[i] += bytes;
+        if (shared)
+        {
+            survey.shared_sprites[i] += 1;
+            survey.shared_bytes[i] += bytes;
+        }
+    }
+    gfx_free_pixels(p);
+}
+
+void gfx_report_survey(const char *what)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        printf("[GFX] %-12s %7d sprites, %7ld KiB, %7d identical to an earlier one: %7ld KiB (%.1f%%) saved\n",
+            i == 0 ? what : "so far", survey.sprites[i], survey.bytes[i] / 1024, survey.shared_sprites[i],
+            survey.shared_bytes[i] / 1024, survey.bytes[i] ? 100.0 * survey.shared_bytes[i] / survey.bytes[i] : 0.0);
+    }
+    survey.sprites[0] = survey.shared_sprites[0] = 0;
+    survey.bytes[0] = survey.shared_bytes[0] = 0;
+}
+
+pixel_storage_t gfx_upload_tex2d(gfx_pixels_t *p)
+{
+    int width = p->width;
+    int height = p->height;
+    int trim_x = p->trim_x;
+    int trim_y = p->trim_y;
+    int trim_width = p->trim_width;
+    int trim_height = p->trim_height;
+    trim_stats.uploads += 1;
+    trim_stats.trimmed_bytes += 2 * (width * height - trim_width * trim_height);
+
+    // lots of art, gumps and animation frames are exact copies of others,
+    // those all share the region of the first one
+    uint64_t content_hash = p->content_hash;
+    int *same_content = open_shelves_inited ? regions_by_content.find(content_hash) : NULL;
+    if (same_content != NULL)
+    {
+        atlas_region_t *r = &regions[*same_content];
+        // a hash collision would show the wrong sprite for as long as the region lives
+        if (r->used_width == trim_width && r->used_height == trim_height && r->content_check == p->content_check)
+        {
+            r->refs += 1;
+            dedup.shared_uploads += 1;
+            dedup.shared_bytes += 2 * trim_width * trim_height;
+            dedup.live_shared_bytes += 2 * trim_width * trim_height;
+            gfx_free_pixels(p);
+            return trimmed_storage(*same_content, width, height, trim_x, trim_y);
+        }
+    }
+
+    int region = alloc_atlas_region(trim_width, trim_height);
+    atlas_region_t *r = &regions[region];
+    atlas_t *atlas = &atlases[r->atlas];
+    r->refs = 1;
+    r->content_hash = content_hash;
+    r->content_check = p->content_check;
+    *regions_by_content.insert(content_hash) = region;
+
+    if (in_staging_ring(p->pixels))
+    {
+        // the region is ours now, the pixels follow with the next flush
+        staging_upload_t u;
+        u.tex = atlas->tex;
+        u.layer = -1;
+        u.x = r->x;
+        u.y = r->y;
+        u.width = trim_width;
+        u.height = trim_height;
+        u.offset = (int)((char *)p->pixels - staging.mapped);
+        staging.uploads.push_back(u);
+        pthread_mutex_lock(&staging_mutex);
+        staging.batch_used = true;
+        pthread_mutex_unlock(&staging_mutex);
+    }
+    else
+    {
+        check_gl_error(__LINE__);
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+        glBindTexture(GL_TEXTURE_2D, atlas->tex);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, r->x, r->y, trim_width, trim_height, GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, p->pixels);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        if (check_gl_error(__LINE__))
+        {
+            printf("error uploading 2d texture w, h: %d, %d\n", width, height);
+        }
+    }
+
+    // the region keeps the alpha mask
+    r->alpha_mask = p->alpha_mask;
+    p->alpha_mask = NULL;
+    gfx_free_pixels(p);
+
+    return trimmed_storage(region, width, height, trim_x, trim_y);
+}
+
+pixel_storage_t gfx_upload_land_tex2d(gfx_pixels_t *p)
+{
+    int width = p->width;
+    int height = p->height;
+    if (land_array.tex == 0)
+    {
+        create_land_array(width, height);
+    }
+    // layers hold whole tiles, so they only take tiles without transparent borders
+    bool trimmed = p->trim_width != width || p->trim_height != height;
+    if (width != land_array.tile_width || height != land_array.tile_height || trimmed || land_array.free_layers.empty())
+    {
+        return gfx_upload_tex2d(p);
+    }
+
+    int layer = land_array.free_layers.back();
+    land_array.free_layers.pop_back();
+
+    if (in_staging_ring(p->pixels))
+    {
+        staging_upload_t u;
+        u.tex = land_array.tex;
+        u.layer = layer;
+        u.x = 0;
+        u.y = 0;
+        u.width = width;
+        u.height = height;
+        u.offset = (int)((char *)p->pixels - staging.mapped);
+        staging.uploads.push_back(u);
+        pthread_mutex_lock(&staging_mutex);
+        staging.batch_used = true;
+        pthread_mutex_unlock(&staging_mutex);
+    }
+    else
+    {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, land_array.tex);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, width, height, 1, GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, p->pixels);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+        if (check_gl_error(__LINE__))
+        {
+            printf("error uploading land tile to layer %d\n", layer);
+        }
+    }
+    gfx_free_pixels(p);
+
+    pixel_storage_t ps;
+    ps.width = width;
+    ps.height = height;
+    ps.tex = land_array.tex;
+    // land tiles are diamonds turned into squares, every pixel is solid
+    ps.sprite_class = GFX_OPAQUE;
+    ps.region = -1;
+    ps.layer = layer;
+    ps.trim_x = 0;
+    ps.trim_y = 0;
+    ps.trim_width = width;
+    ps.trim_height = height;
+    // every layer is a whole texture, no neighbours to bleed in
+    ps.tcxs[0] = 0.0f; ps.tcys[0] = 0.0f;
+    ps.tcxs[1] = 1.0f; ps.tcys[1] = 0.0f;
+    ps.tcxs[2] = 1.0f; ps.tcys[2] = 1.0f;
+    ps.tcxs[3] = 0.0f; ps.tcys[3] = 1.0f;
+
+    return ps;
+}
+
+static int compile_shader(const char *name, int type, const char *src, const char *end)
+{
+    int shader = glCreateShader(type);
+    int length = end - src;
+    glShaderSource(shader, 1, &src, &length);
+    check_gl_error(__LINE__);
+    glCompileShader(shader);
+
+    int compiled_ok;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled_ok);
+    if (!compiled_ok)
+    {
+        int log_length;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH , &log_length);
+        if (log_length > 0)
+        {
+            char *log = (char *)malloc(log_length);
+            int hmz;
+            glGetShaderInfoLog(shader, log_length, &hmz, log);
+            printf("%d %d\n", hmz, log_length);
+            printf("Error compiling '%s':\n%s", name, log);
+            // TODO: more graceful?
+            exit(-1);
+            free(log);
+        }
+
+        return -1;
+    }
+    return shader;
+}
+
+static int link_program(const char *name, int shader0, int shader1)
+{
+    int program = glCreateProgram();
+    glAttachShader(program, shader0);
+    glAttachShader(program, shader1);
+    // all programs read sprite instances the same way
+    glBindAttribLocation(program, ATTRIB_CORNER,    "corner");
+    glBindAttribLocation(program, ATTRIB_CORNERS01, "corners01");
+    glBindAttribLocation(program, ATTRIB_CORNERS23, "corners23");
+    glBindAttribLocation(program, ATTRIB_TEX_RECT,  "tex_rect");
+    glBindAttribLocation(program, ATTRIB_DEPTH,     "depth");
+    glBindAttribLocation(program, ATTRIB_PARAM,     "param");
+    glLinkProgram(program);
+
+    int linked_ok;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked_ok);
+    if (!linked_ok)
+    {
+        int log_length;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH , &log_length);
+        if (log_length > 0)
+        {
+            char *log = (char *)malloc(log_length+1);
+            int hmz;
+            glGetProgramInfoLog(program, log_length, &hmz, log);
+            assert(hmz == log_length);
+            printf("Error linking '%s':\n%s\n", name, log);
+            // TODO: more graceful?
+            exit(-1);
+            free(log);
+        }
+
+        return -1;
+    }
+    return program;
+}
+
+struct program_info_t
+{
+    int program;
+    int sort_index;
+    int screen_size_loc;
+    int tex_loc;
+    int tex_hue_loc;
+    int offset_loc;
+};
+
+static const int max_programs = 16;
+static program_info_t programs[max_programs];
+static int program_count = 0;
+
+int gfx_upload_program(const char *vert_filename, const char *frag_filename)
+{
+    const char *vert_src_end;
+    const char *vert_src = file_map(vert_filename, &vert_src_end);
+    const char *frag_src_end;
+    const char *frag_src = file_map(frag_filename, &frag_src_end);
+
+    int s0 = compile_shader(vert_filename, GL_VERTEX_SHADER, vert_src, vert_src_end);
+    int s1 = compile_shader(frag_filename, GL_FRAGMENT_SHADER, frag_src, frag_src_end);
+
+    file_unmap(vert_src, vert_src_end);
+    file_unmap(frag_src, frag_src_end);
+
+    char program_name[1024];
+    sprintf(program_name, "program <%s> <%s>", vert_filename, frag_filename);
+
+    int program = link_program(program_name, s0, s1);
+
+    // remember where the uniforms are, looking them up while drawing is slow
+    assert(program_count < max_programs);
+    program_info_t *info = &programs[program_count];
+    info->program = program;
+    info->sort_index = program_count;
+    info->screen_size_loc = glGetUniformLocation(program, "screen_size");
+    info->tex_loc = glGetUniformLocation(program, "tex");
+    info->tex_hue_loc = glGetUniformLocation(program, "tex_hue");
+    info->offset_loc = glGetUniformLocation(program, "offset");
+    program_count += 1;
+
+    // only meshes are drawn with an offset, see draw_mesh
+    if (info->offset_loc != -1)
+    {
+        glUseProgram(program);
+        glUniform4f(info->offset_loc, 0.0f, 0.0f, 0.0f, 1.0f);
+        glUseProgram(0);
+    }
+
+    return program;
+}
+
+static program_info_t *get_program_info(int program)
+{
+    for (int i = 0; i < program_count; i++)
+    {
+        if (programs[i].program == program)
+        {
+            return &programs[i];
+        }
+    }
+    assert(0 && "program wasn't made by gfx_upload_program");
+    return NULL;
+}
+
+// everything the gpu needs to draw one sprite, read by the vertex shader as
+// per-instance attributes. keep this small, thousands of these are streamed
+// to the gpu every frame.
+struct sprite_instance_t
+{
+    int16_t corners[4][2]; // screen positions, in the same order as pixel_storage_t's tex coords
+    uint16_t tex_rect[4];  // left, top, right, bottom in the atlas, normalized to [0, 65535]
+    float depth;
+    uint16_t param[4];     // hue row, only grey, hued, normalized to [0, 65535]
+};
+
+// a sprite waiting for gfx_flush
+struct render_command_t
+{
+    sprite_instance_t instance;
+    int layer;
+    program_info_t *program;
+    unsigned int tex0;
+    unsigned int tex1;
+};
+
+// commands are drawn in the order of their sort keys. from the most
+// significant bits down:
+//  layer     4 bits, layers are drawn one after the other
+//  program   4 bits
+//  tex0     12 bits, dense texture index, not the gl name
+//  tex1     12 bits
+//  depth    32 bits, front to back for opaque sprites, so hidden pixels fail
+//           the depth test early; back to front for the rest
+const int SORT_LAYER_SHIFT   = 60;
+const int SORT_PROGRAM_SHIFT = 56;
+const int SORT_TEX0_SHIFT    = 44;
+const int SORT_TEX1_SHIFT    = 32;
+
+// layers, in drawing order
+const int LAYER_OPAQUE = 0;
+const int LAYER_ALPHA  = 1;
+
+static bool opaque_split = true;
+
+// the point being picked, and the best hit so far
+static struct
+{
+    bool enabled;
+    int x, y;
+    int flush; // number of flushes since picking began, later ones are drawn on top
+    int best_pick_id;
+    int best_flush;
+    float best_depth;
+} picking;
+
+static bool measure_fill = false;
+static gfx_fill_stats_t last_fill_stats;
+static unsigned int fill_query = 0;
+
+struct sort_entry_t
+{
+    uint64_t key;
+    uint32_t index;
+};
+
+// a range of instances that can be drawn with a single draw call
+struct draw_run_t
+{
+    int layer;
+    program_info_t *program;
+    unsigned int tex0;
+    unsigned int tex1;
+    int first;
+    int count;
+};
+
+// gl texture names are handed out by the driver and can be anything, so the
+// sort keys use small indices given out in order of first use instead
+static std::vector<uint16_t> texture_sort_indices;
+static int next_texture_sort_index = 1;
+
+static uint64_t texture_sort_index(unsigned int tex)
+{
+    if (tex == 0)
+    {
+        return 0;
+    }
+    if (tex >= texture_sort_indices.size())
+    {
+        texture_sort_indices.resize(tex + 1, 0);
+    }
+    if (texture_sort_indices[tex] == 0)
+    {
+        assert(next_texture_sort_index < (1 << 12));
+        texture_sort_indices[tex] = next_texture_sort_index++;
+    }
+    return texture_sort_indices[tex];
+}
+
+// draw prios are mapped into [0, 1] of the depth range by dividing by this
+static float depth_scale = 500000.0f;
+
+int cnt_render_commands = 0;
+int cnt_use_program = 0;
+int cnt_bind_tex0 = 0;
+int cnt_bind_tex1 = 0;
+int cnt_draw_calls = 0;
+int cnt_uploaded_bytes = 0;
+
+int bound_program = 0;
+int bound_tex0 = 0;
+int bound_tex0_target = GL_TEXTURE_2D;
+int bound_tex1 = 0;
+
+// the instance stream. when GL_ARB_buffer_storage is available the buffer is
+// mapped once and written directly; it is split into segments, and a fence
+// guards each segment so we never write to one the gpu may still be reading.
+// the flushes of a frame (world, static layer strips, texts, gumps, picking)
+// all go into the current segment one after the other, a segment is only
+// fenced when it fills up.
+// otherwise the buffer is orphaned whenever it fills up and written with
+// glBufferSubData.
+static const int stream_segment_count = 4;
+static const int stream_segment_instances = 1 << 16;
+static struct
+{
+    unsigned int vbo;
+    unsigned int corner_vbo;
+    bool persistent;
+    char *mapped;
+    GLsync fences[stream_segment_count];
+    int segment;
+    int offset; // in instances, within the current segment (or the whole buffer when orphaning)
+} stream;
+
+static int stream_capacity()
+{
+    return stream.persistent ? stream_segment_instances : stream_segment_count * stream_segment_instances;
+}
+
+void gfx_init()
+{
+    int buffer_size = stream_segment_count * stream_segment_instances * sizeof(sprite_instance_t);
+
+    glGenBuffers(1, &stream.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+#ifdef GL_MAP_PERSISTENT_BIT
+    stream.persistent = has_extension("GL_ARB_buffer_storage");
+#else
+    stream.persistent = false;
+#endif
+    if (stream.persistent)
+    {
+#ifdef GL_MAP_PERSISTENT_BIT
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, buffer_size, NULL, flags);
+        stream.mapped = (char *)glMapBufferRange(GL_ARRAY_BUFFER, 0, buffer_size, flags);
+        assert(stream.mapped != NULL);
+#endif
+    }
+    else
+    {
+        glBufferData(GL_ARRAY_BUFFER, buffer_size, NULL, GL_STREAM_DRAW);
+        stream.mapped = NULL;
+    }
+    for (int i = 0; i < stream_segment_count; i++)
+    {
+        stream.fences[i] = 0;
+    }
+    stream.segment = 0;
+    stream.offset = 0;
+
+    // generic attribute 0 must be a per-vertex array in compatibility contexts,
+    // so the corner index comes from a tiny static buffer instead of gl_VertexID
+    float corners[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+    glGenBuffers(1, &stream.corner_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, stream.corner_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    printf("[GFX] instance stream: %s\n", stream.persistent ? "persistently mapped" : "orphaned");
+    check_gl_error(__LINE__);
+
+    staging_init();
+}
+
+// copies instances into the stream buffer and returns their byte offset in it
+static int stream_write(sprite_instance_t *instances, int count)
+{
+    assert(count <= stream_capacity());
+    int bytes = count * sizeof(sprite_instance_t);
+    cnt_uploaded_bytes += bytes;
+
+    if (stream.persistent)
+    {
+#ifdef GL_MAP_PERSISTENT_BIT
+        if (stream.offset + count > stream_segment_instances)
+        {
+            // fence the segment we're leaving, and make sure the gpu is done with the next one
+            stream.fences[stream.segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            stream.segment = (stream.segment + 1) % stream_segment_count;
+            stream.offset = 0;
+            if (stream.fences[stream.segment] != 0)
+            {
+                glClientWaitSync(stream.fences[stream.segment], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+                glDeleteSync(stream.fences[stream.segment]);
+                stream.fences[stream.segment] = 0;
+            }
+        }
+        int byte_offset = (stream.segment * stream_segment_instances + stream.offset) * sizeof(sprite_instance_t);
+        memcpy(stream.mapped + byte_offset, instances, bytes);
+        stream.offset += count;
+        return byte_offset;
+#endif
+    }
+
+    if (stream.offset + count > stream_capacity())
+    {
+        // orphan, the driver hands us fresh storage while the gpu finishes with the old one
+        glBufferData(GL_ARRAY_BUFFER, stream_capacity() * sizeof(sprite_instance_t), NULL, GL_STREAM_DRAW);
+        stream.offset = 0;
+    }
+    int byte_offset = stream.offset * sizeof(sprite_instance_t);
+    glBufferSubData(GL_ARRAY_BUFFER, byte_offset, bytes, instances);
+    stream.offset += count;
+    return byte_offset;
+}
+
+static void set_instance_pointers(int byte_offset)
+{
+    int stride = sizeof(sprite_instance_t);
+    const char *base = (const char *)0 + byte_offset;
+    glVertexAttribPointer(ATTRIB_CORNERS01, 4, GL_SHORT, GL_FALSE, stride, base + offsetof(sprite_instance_t, corners[0]));
+    glVertexAttribPointer(ATTRIB_CORNERS23, 4, GL_SHORT, GL_FALSE, stride, base + offsetof(sprite_instance_t, corners[2]));
+    glVertexAttribPointer(ATTRIB_TEX_RECT, 4, GL_UNSIGNED_SHORT, GL_TRUE, stride, base + offsetof(sprite_instance_t, tex_rect));
+    glVertexAttribPointer(ATTRIB_DEPTH, 1, GL_FLOAT, GL_FALSE, stride, base + offsetof(sprite_instance_t, depth));
+    glVertexAttribPointer(ATTRIB_PARAM, 4, GL_UNSIGNED_SHORT, GL_TRUE, stride, base + offsetof(sprite_instance_t, param));
+}
+
+static void bind_run_state(program_info_t *program, unsigned int tex0, unsigned int tex1)
+{
+    if (program->program != bound_program)
+    {
+        program_info_t *info = program;
+        glUseProgram(info->program);
+        bound_program = info->program;
+        cnt_use_program += 1;
+
+        glUniform2f(info->screen_size_loc, (float)window_width, (float)window_height);
+        glUniform1i(info->tex_loc, 0);
+        if (info->tex_hue_loc != -1)
+        {
+            glUniform1i(info->tex_hue_loc, 1);
+        }
+    }
+    if (tex0 != bound_tex0)
+    {
+        int target = (tex0 == land_array.tex) ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+        if (target != bound_tex0_target)
+        {
+            glBindTexture(bound_tex0_target, 0);
+            bound_tex0_target = target;
+        }
+        glBindTexture(target, tex0);
+        bound_tex0 = tex0;
+        cnt_bind_tex0 += 1;
+    }
+    if (tex1 != bound_tex1)
+    {
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, tex1);
+        glActiveTexture(GL_TEXTURE0);
+        bound_tex1 = tex1;
+        cnt_bind_tex1 += 1;
+    }
+}
+
+static void draw_run(draw_run_t *run, sprite_instance_t *instances)
+{
+    bind_run_state(run->program, run->tex0, run->tex1);
+
+    // a run can be bigger than what fits in the stream at once
+    int first = run->first;
+    int remaining = run->count;
+    while (remaining > 0)
+    {
+        int count = std::min(remaining, stream_capacity());
+        set_instance_pointers(stream_write(&instances[first], count));
+        glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, 4, count);
+        cnt_draw_calls += 1;
+        first += count;
+        remaining -= count;
+    }
+}
+
+// a mesh to draw, at an offset
+struct mesh_command_t
+{
+    gfx_mesh_t *mesh;
+    int offset_x, offset_y;
+    int offset_prio;
+};
+
+// render commands waiting to be drawn by the next gfx_flush
+static struct
+{
+    std::vector<render_command_t> cmds;
+    std::vector<mesh_command_t> meshes;
+    gfx_fill_stats_t fill_stats;
+} frame_commands;
+
+static std::vector<sort_entry_t> sort_keys;
+
+static uint64_t sort_key(render_command_t *cmd)
+{
+    // depth is in [0, 1], where positive floats sort like their bits do.
+    // higher draw prio is in front.
+    float key_depth = std::max(cmd->instance.depth, 0.0f);
+    uint32_t depth_bits;
+    memcpy(&depth_bits, &key_depth, sizeof(depth_bits));
+    uint32_t depth_key = (cmd->layer == LAYER_OPAQUE) ? 0xffffffffu - depth_bits : depth_bits;
+
+    return ((uint64_t)cmd->layer << SORT_LAYER_SHIFT) |
+           ((uint64_t)cmd->program->sort_index << SORT_PROGRAM_SHIFT) |
+           (texture_sort_index(cmd->tex0) << SORT_TEX0_SHIFT) |
+           (texture_sort_index(cmd->tex1) << SORT_TEX1_SHIFT) |
+           (uint64_t)depth_key;
+}
+
+// the instances of a mesh live in their own buffer, sorted into runs like a
+// flush's. their depths are made with the depth scale of when the mesh was
+// built, and rescaled in the vertex shader if it has changed since.
+struct mesh_run_t
+{
+    int layer;
+    program_info_t *program;
+    unsigned int tex0;
+    unsigned int tex1;
+    int first;
+    int count;
+};
+
+struct gfx_mesh_t
+{
+    unsigned int vbo;
+    float depth_scale;
+    std::vector<mesh_run_t> runs;
+};
+
+static void draw_mesh(mesh_command_t *cmd)
+{
+    gfx_mesh_t *mesh = cmd->mesh;
+    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+    for (int i = 0; i < (int)mesh->runs.size(); i++)
+    {
+        mesh_run_t *run = &mesh->runs[i];
+        if (run->layer == LAYER_OPAQUE)
+        {
+            glDisable(GL_ALPHA_TEST);
+        }
+        else
+        {
+            glEnable(GL_ALPHA_TEST);
+        }
+        bind_run_state(run->program, run->tex0, run->tex1);
+        glUniform4f(run->program->offset_loc, (float)cmd->offset_x, (float)cmd->offset_y,
+            cmd->offset_prio / depth_scale, mesh->depth_scale / depth_scale);
+        set_instance_pointers(run->first * sizeof(sprite_instance_t));
+        glDrawArraysInstanced(GL_TRIANGLE_FAN, 0, 4, run->count);
+        glUniform4f(run->program->offset_loc, 0.0f, 0.0f, 0.0f, 1.0f);
+        cnt_draw_calls += 1;
+    }
+}
+
+// least significant digit first radix sort, one byte per pass. passes where
+// every key has the same byte are skipped, which is most of them: the
+// layer/program/texture bytes only take a few distinct values per frame.
+static void radix_sort(std::vector<sort_entry_t> &entries)
+{
+    static std::vector<sort_entry_t> scratch;
+    int n = (int)entries.size();
+    scratch.resize(n);
+
+    sort_entry_t *src = n > 0 ? &entries[0] : NULL;
+    sort_entry_t *dst = n > 0 ? &scratch[0] : NULL;
+    for (int shift = 0; shift < 64; shift += 8)
+    {
+        int counts[256];
+        memset(counts, 0, sizeof(counts));
+        for (int i = 0; i < n; i++)
+        {
+            counts[(src[i].key >> shift) & 0xff] += 1;
+        }
+        if (n == 0 || counts[(src[0].key >> shift) & 0xff] == n)
+        {
+            continue;
+        }
+
+        int offset = 0;
+        for (int i = 0; i < 256; i++)
+        {
+            int count = counts[i];
+            counts[i] = offset;
+            offset += count;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            dst[counts[(src[i].key >> shift) & 0xff]++] = src[i];
+        }
+        std::swap(src, dst);
+    }
+    if (n > 0 && src != &entries[0])
+    {
+        memcpy(&entries[0], src, n * sizeof(sort_entry_t));
+    }
+}
+
+void gfx_flush()
+{
+    static std::vector<sprite_instance_t> instances;
+    static std::vector<draw_run_t> runs;
+    instances.clear();
+    runs.clear();
+
+    // whatever is drawn below may use sprites that were just uploaded
+    staging_flush_uploads();
+
+    std::vector<render_command_t> &cmds = frame_commands.cmds;
+    sort_keys.resize(cmds.size());
+    for (int i = 0; i < (int)cmds.size(); i++)
     {
-        glMatrixMode(GL_PROJECTION);
-        glPushMatrix();
-        glLoadIdentity();
-        glOrtho(0, window_width, window_height, 0, -1, 1);
+        sort_keys[i].key = sort_key(&cmds[i]);
+        sort_keys[i].index = (uint32_t)i;
+    }
+    radix_sort(sort_keys);
+
+    // lay out the instances in key order, so that every (program, texture)
+    // combination ends up as one contiguous run
+    for (int i = 0; i < (int)sort_keys.size(); i++)
+    {
+        render_command_t *cmd = &cmds[sort_keys[i].index];
+        draw_run_t *run = runs.empty() ? NULL : &runs.back();
+        if (run == NULL || run->layer != cmd->layer || run->program != cmd->program || run->tex0 != cmd->tex0 || run->tex1 != cmd->tex1)
+        {
+            draw_run_t new_run;
+            new_run.layer = cmd->layer;
+            new_run.program = cmd->program;
+            new_run.tex0 = cmd->tex0;
+            new_run.tex1 = cmd->tex1;
+            new_run.first = (int)instances.size();
+            new_run.count = 0;
+            runs.push_back(new_run);
+            run = &runs.back();
+        }
+        instances.push_back(cmd->instance);
+        run->count += 1;
+    }
+    cnt_render_commands += (int)cmds.size();
+    cmds.clear();
+    sort_keys.clear();
+    picking.flush += 1;
 
+    static std::vector<mesh_command_t> meshes;
+    meshes.swap(frame_commands.meshes);
+    frame_commands.meshes.clear();
+
+    // prepare a good state
+    {
         glEnable(GL_TEXTURE_2D);
-        glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
         glAlphaFunc(GL_GREATER, 0.0f);
         glDepthFunc(GL_LEQUAL);
         glEnable(GL_DEPTH_TEST);
         glEnable(GL_ALPHA_TEST);
+
+        glBindBuffer(GL_ARRAY_BUFFER, stream.corner_vbo);
+        glVertexAttribPointer(ATTRIB_CORNER, 1, GL_FLOAT, GL_FALSE, 0, 0);
+        glEnableVertexAttribArray(ATTRIB_CORNER);
+
+        glBindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+        for (int attrib = ATTRIB_CORNERS01; attrib <= ATTRIB_PARAM; attrib++)
+        {
+            glEnableVertexAttribArray(attrib);
+            glVertexAttribDivisor(attrib, 1);
+        }
     }
     check_gl_error(__LINE__);
 
-
-    // execute all render commands
-    for (int i = 0; i < 30; i++)
+    if (measure_fill)
     {
-        for (std::vector<render_command_t>::iterator it = cmds[i].begin(); it != cmds[i].end(); ++it)
+        if (fill_query == 0)
         {
-            render_command_t *cmd = &(*it);
-            render_command(cmd);
+            glGenQueries(1, &fill_query);
         }
-        cmds[i].clear();
+        glBeginQuery(GL_SAMPLES_PASSED, fill_query);
     }
 
-    check_gl_error(__LINE__);
+    // meshes first, their instances are already on the gpu
+    for (int i = 0; i < (int)meshes.size(); i++)
+    {
+        draw_mesh(&meshes[i]);
+    }
+    if (!meshes.empty())
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+    }
+
+    for (int i = 0; i < (int)runs.size(); i++)
+    {
+        // opaque sprites don't need the alpha test, and drawing them without
+        // it lets the gpu reject hidden pixels before shading them
+        if (i == 0 || runs[i - 1].layer != runs[i].layer)
+        {
+            if (runs[i].layer == LAYER_OPAQUE)
+            {
+                glDisable(GL_ALPHA_TEST);
+            }
+            else
+            {
+                glEnable(GL_ALPHA_TEST);
+            }
+        }
+        draw_run(&runs[i], instances.empty() ? NULL : &instances[0]);
+    }
 
-    if (did_begin)
+    if (measure_fill)
     {
-        glEnd();
-        did_begin = false;
-        cnt_glend += 1;
+        glEndQuery(GL_SAMPLES_PASSED);
+        // this stalls until the gpu is done, fine for measuring
+        GLuint samples = 0;
+        glGetQueryObjectuiv(fill_query, GL_QUERY_RESULT, &samples);
+        frame_commands.fill_stats.samples_passed = samples;
+        last_fill_stats = frame_commands.fill_stats;
     }
+    memset(&frame_commands.fill_stats, 0, sizeof(frame_commands.fill_stats));
 
     check_gl_error(__LINE__);
 
     // clean up state
     {
+        for (int attrib = ATTRIB_CORNER; attrib <= ATTRIB_PARAM; attrib++)
+        {
+            glVertexAttribDivisor(attrib, 0);
+            glDisableVertexAttribArray(attrib);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
         glDisable(GL_ALPHA_TEST);
         glDisable(GL_DEPTH_TEST);
         glDisable(GL_TEXTURE_2D);
-
-        glPopMatrix();
     }
 
     check_gl_error(__LINE__);
@@ -560,8 +1993,9 @@ void gfx_flush()
     }
     if (bound_tex0 != 0)
     {
-        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindTexture(bound_tex0_target, 0);
         bound_tex0 = 0;
+        bound_tex0_target = GL_TEXTURE_2D;
     }
     if (bound_tex1 != 0)
     {
@@ -574,109 +2008,436 @@ void gfx_flush()
     //check_gl_error(__LINE__);
 }
 
-void gfx_render(pixel_storage_t *ps, int xs[4], int ys[4], int draw_prio, int hue_id, int pick_id)
+// one row of 32 colors per hue
+static struct
 {
-    render_command_t cmd;
-    for (int i = 0; i < 4; i++)
+    unsigned int tex;
+    int hue_count;
+} hue_table;
+
+void gfx_upload_hue_table(int hue_count, uint16_t *colors)
+{
+    glGenTextures(1, &hue_table.tex);
+    glBindTexture(GL_TEXTURE_2D, hue_table.tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 32, hue_count, 0, GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, colors);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    hue_table.hue_count = hue_count;
+
+    if (check_gl_error(__LINE__))
     {
-        cmd.pos[i][0] = xs[i];
-        cmd.pos[i][1] = ys[i];
-        cmd.pos[i][2] = draw_prio / 500000.0f;
+        printf("error uploading hue table, %d hues\n", hue_count);
     }
-    for (int i = 0; i < 4; i++)
+}
+
+static uint16_t normalize16(float f)
+{
+    if (f <= 0.0f) return 0;
+    if (f >= 1.0f) return 0xffff;
+    return (uint16_t)(f * 65535.0f + 0.5f);
+}
+
+void gfx_begin_picking(int x, int y)
+{
+    picking.enabled = true;
+    picking.x = x;
+    picking.y = y;
+    picking.flush = 0;
+    picking.best_pick_id = -1;
+}
+
+int gfx_end_picking()
+{
+    picking.enabled = false;
+    return picking.best_pick_id;
+}
+
+// does the sprite cover the picking point, like the rasterizer would draw it
+static bool region_pixel_visible(atlas_region_t *r, int tx, int ty)
+{
+    if (r->alpha_mask == NULL)
     {
-        cmd.tex_coords[i][0] = ps->tcxs[i];
-        cmd.tex_coords[i][1] = ps->tcys[i];
+        return true;
     }
-    //memcpy(cmd.xs, xs, sizeof(cmd.xs));
-    //memcpy(cmd.ys, ys, sizeof(cmd.ys));
-    //memcpy(cmd.tcxs, ps->tcxs, sizeof(cmd.tcxs));
-    //memcpy(cmd.tcys, ps->tcys, sizeof(cmd.tcys));
-    //cmd.draw_prio = draw_prio;
+    tx = std::max(0, std::min(tx, r->used_width - 1));
+    ty = std::max(0, std::min(ty, r->used_height - 1));
 
-    bool use_picking = pick_id != -1;
-    bool use_hue = hue_id != 0;
+    int i = ty * r->used_width + tx;
+    return (r->alpha_mask[i >> 3] >> (i & 7)) & 1;
+}
 
-    if (use_picking)
+static bool pick_hit(pixel_storage_t *ps, int xs[4], int ys[4])
+{
+    // nothing is inside a quad without area, though every point is on the
+    // same side of all its edges
+    long area2 = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        int j = (i + 1) % 4;
+        area2 += (long)xs[i] * ys[j] - (long)xs[j] * ys[i];
+    }
+    if (area2 == 0)
     {
-        int pick_id0 = (pick_id >> 16) & 0xff;
-        int pick_id1 = (pick_id >>  8) & 0xff;
-        int pick_id2 = (pick_id >>  0) & 0xff;
-        float pick_id_vec[3] = { pick_id0 / 255.0f, pick_id1 / 255.0f, pick_id2 / 255.0f };
+        return false;
+    }
+
+    float px = picking.x + 0.5f;
+    float py = picking.y + 0.5f;
 
-        cmd.program = prg_blit_picking;
+    // the quads are convex, so the point must be on the same side of every edge
+    bool left = false;
+    bool right = false;
+    for (int i = 0; i < 4; i++)
+    {
+        int j = (i + 1) % 4;
+        float cross = (xs[j] - xs[i]) * (py - ys[i]) - (ys[j] - ys[i]) * (px - xs[i]);
+        left  |= cross < 0.0f;
+        right |= cross > 0.0f;
+    }
+    if (left && right)
+    {
+        return false;
+    }
 
-        cmd.tex0 = ps->tex;
-        cmd.tex1 = 0;
+    if (ps->region < 0 || regions[ps->region].alpha_mask == NULL)
+    {
+        return true;
+    }
 
-        cmd.uniform1i0_loc = glGetUniformLocation(prg_blit_picking, "tex");
-        cmd.uniform1i0 = 0;
+    // only (possibly flipped) rectangles have transparent pixels, land quads are always opaque
+    bool is_rect = xs[0] == xs[3] && xs[1] == xs[2] && ys[0] == ys[1] && ys[2] == ys[3];
+    if (!is_rect || xs[0] == xs[1] || ys[0] == ys[3])
+    {
+        return true;
+    }
 
-        cmd.uniform1i1_loc = -1;
+    atlas_region_t *r = &regions[ps->region];
+    atlas_t *atlas = &atlases[r->atlas];
+    float fx = (px - xs[0]) / (float)(xs[1] - xs[0]);
+    float fy = (py - ys[0]) / (float)(ys[3] - ys[0]);
+    int tx = (int)((ps->tcxs[0] + fx * (ps->tcxs[1] - ps->tcxs[0])) * atlas->width) - r->x;
+    int ty = (int)((ps->tcys[0] + fy * (ps->tcys[3] - ps->tcys[0])) * atlas->height) - r->y;
+    return region_pixel_visible(r, tx, ty);
+}
 
-        //cmd.uniform3f0_loc = glGetUniformLocation(prg_blit_picking, "pick_id");
-        //memcpy(cmd.uniform3f0, pick_id_vec, sizeof(cmd.uniform3f0));
+// sprites without a single visible pixel are neither drawn nor picked
+static bool fully_trimmed(pixel_storage_t *ps)
+{
+    return ps->trim_width == 0 || ps->trim_height == 0;
+}
 
+// the corners of the part of the quad where the stored pixels go, see pixel_storage_t
+static void trim_quad(pixel_storage_t *ps, int xs[4], int ys[4], int trimmed_xs[4], int trimmed_ys[4])
+{
+    if (ps->trim_width == ps->width && ps->trim_height == ps->height)
+    {
         for (int i = 0; i < 4; i++)
         {
-            cmd.normal[i][0] = pick_id_vec[0];
-            cmd.normal[i][1] = pick_id_vec[1];
-            cmd.normal[i][2] = pick_id_vec[2];
+            trimmed_xs[i] = xs[i];
+            trimmed_ys[i] = ys[i];
         }
+        return;
+    }
+
+    float u0 = ps->trim_x / (float)ps->width;
+    float u1 = (ps->trim_x + ps->trim_width) / (float)ps->width;
+    float v0 = ps->trim_y / (float)ps->height;
+    float v1 = (ps->trim_y + ps->trim_height) / (float)ps->height;
+    float us[4] = { u0, u1, u1, u0 };
+    float vs[4] = { v0, v0, v1, v1 };
+    for (int i = 0; i < 4; i++)
+    {
+        // bilinear, which for the usual rectangles moves the edges by whole pixels
+        float w0 = (1 - us[i]) * (1 - vs[i]);
+        float w1 = us[i] * (1 - vs[i]);
+        float w2 = us[i] * vs[i];
+        float w3 = (1 - us[i]) * vs[i];
+        trimmed_xs[i] = (int)floorf(w0 * xs[0] + w1 * xs[1] + w2 * xs[2] + w3 * xs[3] + 0.5f);
+        trimmed_ys[i] = (int)floorf(w0 * ys[0] + w1 * ys[1] + w2 * ys[2] + w3 * ys[3] + 0.5f);
     }
-    else if (use_hue)
+}
+
+// something under the mouse was drawn. on ties the later sprite wins, as
+// with GL_LEQUAL
+static void pick_record(float depth, int pick_id)
+{
+    if (picking.best_pick_id == -1 || picking.flush > picking.best_flush ||
+        (picking.flush == picking.best_flush && depth >= picking.best_depth))
+    {
+        picking.best_pick_id = pick_id;
+        picking.best_flush = picking.flush;
+        picking.best_depth = depth;
+    }
+}
+
+static void pick_test(pixel_storage_t *ps, int xs[4], int ys[4], float depth, int pick_id)
+{
+    if (picking.enabled && pick_id != -1 && pick_hit(ps, xs, ys))
     {
-        pixel_storage_t ps_hue = get_hue_tex(hue_id & 0x7fff);
+        pick_record(depth, pick_id);
+    }
+}
 
-        cmd.program = prg_blit_hue;
+void gfx_pick_sprite(pixel_storage_t *ps, int xs[4], int ys[4], int draw_prio, int pick_id)
+{
+    if (fully_trimmed(ps))
+    {
+        return;
+    }
+    int trimmed_xs[4], trimmed_ys[4];
+    trim_quad(ps, xs, ys, trimmed_xs, trimmed_ys);
+    pick_test(ps, trimmed_xs, trimmed_ys, draw_prio / depth_scale, pick_id);
+}
 
-        cmd.tex0 = ps->tex;
-        cmd.tex1 = ps_hue.tex;
+static void make_command(pixel_storage_t *ps, int xs[4], int ys[4], int draw_prio, int hue_id, render_command_t *command)
+{
+    render_command_t &cmd = *command;
+    sprite_instance_t &inst = cmd.instance;
+    for (int i = 0; i < 4; i++)
+    {
+        inst.corners[i][0] = xs[i];
+        inst.corners[i][1] = ys[i];
+    }
+    inst.tex_rect[0] = normalize16(ps->tcxs[0]);
+    inst.tex_rect[1] = normalize16(ps->tcys[0]);
+    inst.tex_rect[2] = normalize16(ps->tcxs[2]);
+    inst.tex_rect[3] = normalize16(ps->tcys[2]);
+    inst.depth = draw_prio / depth_scale;
+
+    // hued or not, it's the same program and textures, so they batch together
+    cmd.program = get_program_info(ps->layer >= 0 ? prg_land : prg_blit);
+    cmd.tex0 = ps->tex;
+    cmd.tex1 = hue_table.tex;
+
+    int hue = hue_id & 0x7fff;
+    // the server may send hues we don't know, those are drawn unhued
+    if (hue != 0 && hue <= hue_table.hue_count)
+    {
+        inst.param[0] = normalize16((hue - 1 + 0.5f) / hue_table.hue_count);
+        inst.param[1] = (hue_id & 0x8000) == 0 ? 0xffff : 0;
+        inst.param[2] = 0xffff;
+    }
+    else
+    {
+        inst.param[0] = 0;
+        inst.param[1] = 0;
+        inst.param[2] = 0;
+    }
+    // the layer in the land texture array, read back unnormalized
+    inst.param[3] = ps->layer >= 0 ? ps->layer : 0;
 
-        cmd.uniform1i0_loc = glGetUniformLocation(prg_blit_hue, "tex");
-        cmd.uniform1i0 = 0;
+    cmd.layer = (opaque_split && ps->sprite_class == GFX_OPAQUE) ? LAYER_OPAQUE : LAYER_ALPHA;
+}
 
-        cmd.uniform1i1_loc = glGetUniformLocation(prg_blit_hue, "tex_hue");
-        cmd.uniform1i1 = 1;
+void gfx_render(pixel_storage_t *ps, int quad_xs[4], int quad_ys[4], int draw_prio, int hue_id, int pick_id)
+{
+    if (fully_trimmed(ps))
+    {
+        return;
+    }
+    int xs[4], ys[4];
+    trim_quad(ps, quad_xs, quad_ys, xs, ys);
 
-        //cmd.uniform3f0_loc = glGetUniformLocation(prg_blit_hue, "tex_coords_hue");
-        //cmd.uniform3f0[0] = ps_hue.tcxs[0];
-        //cmd.uniform3f0[1] = ps_hue.tcxs[1];
-        //cmd.uniform3f0[2] = ps_hue.tcys[0];
+    render_command_t cmd;
+    make_command(ps, xs, ys, draw_prio, hue_id, &cmd);
 
+    if (measure_fill)
+    {
+        // shoelace formula, the quads aren't always rectangles
+        long area2 = 0;
         for (int i = 0; i < 4; i++)
         {
-            cmd.normal[i][0] = ps_hue.tcxs[0];
-            cmd.normal[i][1] = ps_hue.tcxs[1];
-            cmd.normal[i][2] = ps_hue.tcys[0];
+            int j = (i + 1) % 4;
+            area2 += (long)xs[i] * ys[j] - (long)xs[j] * ys[i];
         }
+        frame_commands.fill_stats.sprites += 1;
+        frame_commands.fill_stats.submitted_area += std::abs(area2) / 2;
+    }
+
+    pick_test(ps, xs, ys, cmd.instance.depth, pick_id);
+
+    frame_commands.cmds.push_back(cmd);
+}
+
+// the top left width x height of the sprite, for the cut off tiles at the
+// right and bottom edges of a tiled area
+static pixel_storage_t clip_storage(pixel_storage_t *ps, int width, int height)
+{
+    pixel_storage_t clipped = *ps;
+    clipped.width = width;
+    clipped.height = height;
+    clipped.trim_width = std::max(0, std::min(ps->trim_x + ps->trim_width, width) - ps->trim_x);
+    clipped.trim_height = std::max(0, std::min(ps->trim_y + ps->trim_height, height) - ps->trim_y);
+    float fx = ps->trim_width > 0 ? clipped.trim_width / (float)ps->trim_width : 0.0f;
+    float fy = ps->trim_height > 0 ? clipped.trim_height / (float)ps->trim_height : 0.0f;
+    clipped.tcxs[1] = clipped.tcxs[2] = ps->tcxs[0] + fx * (ps->tcxs[1] - ps->tcxs[0]);
+    clipped.tcys[2] = clipped.tcys[3] = ps->tcys[0] + fy * (ps->tcys[2] - ps->tcys[0]);
+    return clipped;
+}
 
-        // TODO: add this
-        //cmd.only_grey = (hue_id & 0x8000) == 0;
+void gfx_render_tiled(pixel_storage_t *ps, int x, int y, int width, int height, int draw_prio, int hue_id, int pick_id)
+{
+    if (width <= 0 || height <= 0 || ps->width == 0 || ps->height == 0 || fully_trimmed(ps))
+    {
+        return;
     }
-    else
+
+    // sprites with trimmed borders would need their borders back for the shader
+    // to wrap them, those are drawn a tile at a time instead
+    bool wraps = ps->layer < 0 && ps->region >= 0 && ps->trim_width == ps->width && ps->trim_height == ps->height;
+    if (!wraps)
     {
-        cmd.program = 0;
+        for (int tile_y = y; tile_y < y + height; tile_y += ps->height)
+        for (int tile_x = x; tile_x < x + width; tile_x += ps->width)
+        {
+            int tile_width = std::min(x + width - tile_x, ps->width);
+            int tile_height = std::min(y + height - tile_y, ps->height);
+            pixel_storage_t tile = clip_storage(ps, tile_width, tile_height);
+            int xs[4] = { tile_x, tile_x + tile_width, tile_x + tile_width, tile_x };
+            int ys[4] = { tile_y, tile_y, tile_y + tile_height, tile_y + tile_height };
+            gfx_render(&tile, xs, ys, draw_prio, hue_id, pick_id);
+        }
+        return;
+    }
 
-        cmd.tex0 = ps->tex;
-        cmd.tex1 = 0;
+    int xs[4] = { x, x + width, x + width, x };
+    int ys[4] = { y, y, y + height, y + height };
+    render_command_t cmd;
+    make_command(ps, xs, ys, draw_prio, hue_id, &cmd);
+    cmd.program = get_program_info(prg_tiled);
 
-        //cmd.uniform1i0_loc = -1;
-        //cmd.uniform1i1_loc = -1;
-        //cmd.uniform3f0_loc = -1;
+    if (measure_fill)
+    {
+        frame_commands.fill_stats.sprites += 1;
+        frame_commands.fill_stats.submitted_area += (long)width * height;
+    }
 
-        for (int i = 0; i < 4; i++)
+    if (picking.enabled && pick_id != -1 &&
+        picking.x >= x && picking.x < x + width && picking.y >= y && picking.y < y + height &&
+        region_pixel_visible(&regions[ps->region], (picking.x - x) % ps->width, (picking.y - y) % ps->height))
+    {
+        pick_record(cmd.instance.depth, pick_id);
+    }
+
+    frame_commands.cmds.push_back(cmd);
+}
+
+static std::vector<render_command_t> mesh_building;
+
+void gfx_mesh_begin()
+{
+    mesh_building.clear();
+}
+
+void gfx_mesh_add(pixel_storage_t *ps, int quad_xs[4], int quad_ys[4], int draw_prio)
+{
+    if (fully_trimmed(ps))
+    {
+        return;
+    }
+    int xs[4], ys[4];
+    trim_quad(ps, quad_xs, quad_ys, xs, ys);
+
+    render_command_t cmd;
+    make_command(ps, xs, ys, draw_prio, 0, &cmd);
+    mesh_building.push_back(cmd);
+}
+
+static bool mesh_command_less(const render_command_t &a, const render_command_t &b)
+{
+    if (a.layer != b.layer) return a.layer < b.layer;
+    if (a.program->sort_index != b.program->sort_index) return a.program->sort_index < b.program->sort_index;
+    return a.tex0 < b.tex0;
+}
+
+gfx_mesh_t *gfx_mesh_end()
+{
+    if (mesh_building.empty())
+    {
+        return NULL;
+    }
+
+    // no need for depth order within a mesh, the depth test takes care of it
+    std::stable_sort(mesh_building.begin(), mesh_building.end(), mesh_command_less);
+
+    gfx_mesh_t *mesh = new gfx_mesh_t;
+    mesh->depth_scale = depth_scale;
+    std::vector<sprite_instance_t> instances(mesh_building.size());
+    for (int i = 0; i < (int)mesh_building.size(); i++)
+    {
+        render_command_t *cmd = &mesh_building[i];
+        mesh_run_t *run = mesh->runs.empty() ? NULL : &mesh->runs.back();
+        if (run == NULL || run->layer != cmd->layer || run->program != cmd->program || run->tex0 != cmd->tex0)
         {
-            cmd.normal[i][0] = 0.0f;
-            cmd.normal[i][1] = 0.0f;
-            cmd.normal[i][2] = 0.0f;
+            mesh_run_t new_run;
+            new_run.layer = cmd->layer;
+            new_run.program = cmd->program;
+            new_run.tex0 = cmd->tex0;
+            new_run.tex1 = cmd->tex1;
+            new_run.first = i;
+            new_run.count = 0;
+            mesh->runs.push_back(new_run);
+            run = &mesh->runs.back();
         }
+        instances[i] = cmd->instance;
+        run->count += 1;
     }
 
-    assert(cmd.tex0 < 30);
-    cmds[cmd.tex0].push_back(cmd);
+    glGenBuffers(1, &mesh->vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+    glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(sprite_instance_t), &instances[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    cnt_uploaded_bytes += (int)(instances.size() * sizeof(sprite_instance_t));
+
+    check_gl_error(__LINE__);
+
+    return mesh;
+}
+
+void gfx_render_mesh(gfx_mesh_t *mesh, int offset_x, int offset_y, int offset_prio)
+{
+    mesh_command_t cmd;
+    cmd.mesh = mesh;
+    cmd.offset_x = offset_x;
+    cmd.offset_y = offset_y;
+    cmd.offset_prio = offset_prio;
+    frame_commands.meshes.push_back(cmd);
+}
+
+void gfx_free_mesh(gfx_mesh_t *mesh)
+{
+    glDeleteBuffers(1, &mesh->vbo);
+    delete mesh;
+}
+
+bool gfx_picking_inside(int x, int y, int width, int height)
+{
+    return picking.enabled && picking.x >= x && picking.x < x + width && picking.y >= y && picking.y < y + height;
+}
+
+void gfx_set_opaque_split(bool enable)
+{
+    opaque_split = enable;
+}
+
+void gfx_measure_fill(bool enable)
+{
+    measure_fill = enable;
+}
+
+gfx_fill_stats_t gfx_last_fill_stats()
+{
+    return last_fill_stats;
+}
 
-    //render_command(&cmd);
+void gfx_set_depth_range(int max_draw_prio)
+{
+    assert(max_draw_prio > 0);
+    depth_scale = (float)max_draw_prio;
 }
 
 void gfx_scissor_area(int x, int y, int width, int height)
@@ -721,15 +2482,152 @@ void gfx_background()
     glEnd();
 }
 
-uint32_t gfx_read_pixel(int x, int y)
+// the static layer lives in one of two window sized color + depth targets.
+// scrolling draws the current target into the other one, moved, and makes
+// that the current one.
+struct layer_target_t
+{
+    unsigned int fbo;
+    unsigned int color_tex;
+    unsigned int depth_tex;
+};
+
+static struct
+{
+    layer_target_t targets[2];
+    int current;
+    int width, height; // 0 until the targets exist
+    int tex_loc, tex_depth_loc;
+} static_layer;
+
+static unsigned int create_layer_texture(int width, int height, int internal_format, int format, int type)
+{
+    unsigned int tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return tex;
+}
+
+static void create_static_layer(int width, int height)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        layer_target_t *t = &static_layer.targets[i];
+        if (static_layer.width != 0)
+        {
+            glDeleteFramebuffers(1, &t->fbo);
+            glDeleteTextures(1, &t->color_tex);
+            glDeleteTextures(1, &t->depth_tex);
+        }
+        t->color_tex = create_layer_texture(width, height, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+        t->depth_tex = create_layer_texture(width, height, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT);
+
+        glGenFramebuffers(1, &t->fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, t->fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, t->color_tex, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, t->depth_tex, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            printf("[GFX] static layer framebuffer is incomplete\n");
+        }
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    static_layer.current = 0;
+    static_layer.width = width;
+    static_layer.height = height;
+    static_layer.tex_loc = glGetUniformLocation(prg_composite, "tex");
+    static_layer.tex_depth_loc = glGetUniformLocation(prg_composite, "tex_depth");
+
+    check_gl_error(__LINE__);
+}
+
+// draws a target's color and depth over whatever is bound, moved by
+// (offset_x, offset_y) pixels
+static void draw_layer_target(layer_target_t *t, int offset_x, int offset_y)
+{
+    glUseProgram(prg_composite);
+    glUniform1i(static_layer.tex_loc, 0);
+    glUniform1i(static_layer.tex_depth_loc, 1);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, t->depth_tex);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, t->color_tex);
+
+    // depth is only written with the depth test on
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_ALWAYS);
+
+    // screen y points down, clip space y up
+    float dx =  2.0f * offset_x / static_layer.width;
+    float dy = -2.0f * offset_y / static_layer.height;
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f + dx, -1.0f + dy);
+    glTexCoord2f(1.0f, 0.0f); glVertex2f( 1.0f + dx, -1.0f + dy);
+    glTexCoord2f(1.0f, 1.0f); glVertex2f( 1.0f + dx,  1.0f + dy);
+    glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f + dx,  1.0f + dy);
+    glEnd();
+
+    glDepthFunc(GL_LEQUAL);
+    glDisable(GL_DEPTH_TEST);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glUseProgram(0);
+}
+
+bool gfx_static_layer_begin(bool clear, int scroll_x, int scroll_y)
+{
+    if (static_layer.width != window_width || static_layer.height != window_height)
+    {
+        create_static_layer(window_width, window_height);
+        clear = true;
+    }
+    // nothing would be left over anyway
+    if (std::abs(scroll_x) >= static_layer.width || std::abs(scroll_y) >= static_layer.height)
+    {
+        clear = true;
+    }
+
+    if (clear)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, static_layer.targets[static_layer.current].fbo);
+        gfx_clear(true, true);
+    }
+    else if (scroll_x != 0 || scroll_y != 0)
+    {
+        layer_target_t *from = &static_layer.targets[static_layer.current];
+        static_layer.current = 1 - static_layer.current;
+        glBindFramebuffer(GL_FRAMEBUFFER, static_layer.targets[static_layer.current].fbo);
+        gfx_clear(true, true);
+        draw_layer_target(from, scroll_x, scroll_y);
+    }
+    else
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, static_layer.targets[static_layer.current].fbo);
+    }
+
+    check_gl_error(__LINE__);
+    return !clear;
+}
+
+void gfx_static_layer_end()
 {
-    uint8_t data[3];
-    glReadPixels(x, y, 1, 1, GL_RGB, GL_UNSIGNED_BYTE, &data);
-    uint32_t res = 0;
-    res |= data[0] << 16;
-    res |= data[1] << 8;
-    res |= data[2] << 0;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
 
-    return res;
+void gfx_static_layer_composite()
+{
+    assert(static_layer.width != 0);
+    draw_layer_target(&static_layer.targets[static_layer.current], 0, 0);
+    check_gl_error(__LINE__);
 }
 
+
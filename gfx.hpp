@@ -1,6 +1,11 @@
 #ifndef _GFX_HPP
 #define _GFX_HPP
 
+// how a sprite's pixels cover its quad, decided once when it is uploaded
+const int GFX_OPAQUE       = 0; // every pixel is solid, no alpha test needed
+const int GFX_ALPHA_TESTED = 1; // some pixels are fully transparent
+const int GFX_TRANSLUCENT  = 2; // some pixels are partially transparent
+
 struct pixel_storage_t
 {
     int width;
@@ -8,13 +13,59 @@ struct pixel_storage_t
     unsigned int tex;
     float tcxs[4];
     float tcys[4];
+    int sprite_class;
+    int region; // where in the atlases this lives, for gfx_free_tex2d
+    int layer;  // or in the land texture array, -1 if not
+    // only this part of width x height is stored, the rest is transparent.
+    // quads still cover the whole sprite, gfx shrinks them to this part.
+    int trim_x, trim_y, trim_width, trim_height;
 };
 
-pixel_storage_t gfx_upload_tex2d(int width, int height, void *data);
+// call once the gl context exists, before anything else in here
+void gfx_init();
+
+// a sprite's pixels on their way to the atlases. preparing them does all the
+// work that looks at the pixels (trimming, hashing, the alpha mask) and copies
+// them into upload staging memory, so it is best done on the thread that
+// decoded them, while they're still in its cache. safe to call from any
+// thread, data isn't needed anymore afterwards.
+struct gfx_pixels_t;
+gfx_pixels_t *gfx_prepare_pixels(int width, int height, uint16_t *data);
+// for prepared pixels that won't be uploaded after all
+void gfx_free_pixels(gfx_pixels_t *pixels);
+
+// these take over the prepared pixels. the gpu transfers them during the next
+// gfx_flush, or right away if there was no room in staging memory.
+pixel_storage_t gfx_upload_tex2d(gfx_pixels_t *pixels);
+// for land tiles, which all have the same size: they're kept in a texture
+// array instead, so terrain draws without switching textures. falls back
+// to gfx_upload_tex2d when the array is full or the size is different.
+pixel_storage_t gfx_upload_land_tex2d(gfx_pixels_t *pixels);
+// how much vram the land texture array may take, all of it is allocated
+// with the first land tile
+void gfx_set_land_array_bytes(long bytes);
+// gives the atlas space back, ps must not be drawn anymore after this
+void gfx_free_tex2d(pixel_storage_t *ps);
+void gfx_report_atlas_occupancy();
+// for measuring what sharing identical pixels saves on a whole data set,
+// without uploading anything: counts the pixels against everything surveyed
+// before, and frees them. the report covers what was surveyed since the last
+// one, and everything so far.
+void gfx_survey_pixels(gfx_pixels_t *pixels);
+void gfx_report_survey(const char *what);
+
+// colors holds 32 colors for each hue, hue_id n (ignoring the 0x8000 bit)
+// is hue n-1 in there
+void gfx_upload_hue_table(int hue_count, uint16_t *colors);
 
 int gfx_upload_program(const char *vert_filename, const char *frag_filename);
 
 void gfx_render(pixel_storage_t *ps, int xs[4], int ys[4], int draw_prio, int hue_id, int pick_id);
+// repeats the sprite to fill the rectangle, cutting off the last row and column
+void gfx_render_tiled(pixel_storage_t *ps, int x, int y, int width, int height, int draw_prio, int hue_id, int pick_id);
+
+// largest draw_prio that will be passed to gfx_render
+void gfx_set_depth_range(int max_draw_prio);
 
 void gfx_scissor_area(int x, int y, int width, int height);
 void gfx_scissor(bool enable);
@@ -22,10 +73,61 @@ void gfx_scissor(bool enable);
 void gfx_clear(bool color, bool depth);
 void gfx_background();
 
-uint32_t gfx_read_pixel(int x, int y);
+// the static layer is an offscreen color and depth target the size of the
+// window, for drawing the parts of the world that rarely change once and
+// compositing them under the rest every frame.
+// begin redirects drawing into it. the layer keeps what was drawn into it
+// before, moved by (scroll_x, scroll_y) pixels, and returns true; or it
+// clears the layer (when asked to, on first use, or after a resize) and
+// returns false.
+bool gfx_static_layer_begin(bool clear, int scroll_x, int scroll_y);
+void gfx_static_layer_end();
+// draws the layer's colors and depths into the window
+void gfx_static_layer_composite();
+
+// picking is done on the cpu: between these, every sprite rendered with a
+// pick_id is hit tested against the point (in screen coordinates, y down),
+// using its alpha mask. sprites from later flushes are on top, within a flush
+// the higher draw_prio is. end returns the topmost pick_id, or -1.
+void gfx_begin_picking(int x, int y);
+int gfx_end_picking();
+// hit tests a sprite without drawing it, for sprites drawn earlier that
+// should still be pickable this frame
+void gfx_pick_sprite(pixel_storage_t *ps, int xs[4], int ys[4], int draw_prio, int pick_id);
 
 void gfx_flush();
 
+// opaque sprites are drawn first, front to back, without alpha testing.
+// turning this off draws everything alpha tested, for comparison.
+void gfx_set_opaque_split(bool enable);
+
+struct gfx_fill_stats_t
+{
+    int sprites;
+    long submitted_area; // sum of the sprites' areas, in pixels
+    long samples_passed; // pixels that passed the depth test
+};
+
+// when enabled, every gfx_flush measures how much it drew
+void gfx_measure_fill(bool enable);
+gfx_fill_stats_t gfx_last_fill_stats();
+
+// a mesh is a batch of sprites kept on the gpu, for things that look the same
+// frame after frame. it is built relative to some origin, and drawn with an
+// offset added to every sprite's position and draw prio. meshes are drawn at
+// the start of the next gfx_flush, and aren't picked; use gfx_pick_sprite.
+struct gfx_mesh_t;
+void gfx_mesh_begin();
+void gfx_mesh_add(pixel_storage_t *ps, int xs[4], int ys[4], int draw_prio);
+// NULL if nothing was added
+gfx_mesh_t *gfx_mesh_end();
+void gfx_render_mesh(gfx_mesh_t *mesh, int offset_x, int offset_y, int offset_prio);
+// not while it's waiting to be drawn
+void gfx_free_mesh(gfx_mesh_t *mesh);
+
+// whether the point being picked is inside the rect
+bool gfx_picking_inside(int x, int y, int width, int height);
+
 
 #endif
 
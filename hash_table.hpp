@@ -0,0 +1,190 @@
+#ifndef _HASH_TABLE_HPP
+#define _HASH_TABLE_HPP
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+#include <stdint.h>
+
+// open addressing hash table with linear probing, mapping 64 bit keys to
+// values of type V. V must be a plain old data type, it is copied around
+// with memcpy when the table grows or entries are shifted.
+//
+// removal uses backward shifting instead of tombstones, so lookups stay
+// short even after lots of insert/remove churn. removing entries while
+// iterating over the slots is NOT allowed.
+template <typename V>
+struct hash_table_t
+{
+    struct slot_t
+    {
+        uint64_t key;
+        bool used;
+        V value;
+    };
+
+    int capacity; // always a power of two
+    int count;
+    slot_t *slots;
+
+    void init(int initial_capacity)
+    {
+        capacity = 16;
+        while (capacity < initial_capacity)
+        {
+            capacity *= 2;
+        }
+        count = 0;
+        slots = (slot_t *)malloc(capacity * sizeof(slot_t));
+        memset(slots, 0, capacity * sizeof(slot_t));
+    }
+
+    void destroy()
+    {
+        free(slots);
+        slots = NULL;
+        capacity = 0;
+        count = 0;
+    }
+
+    void clear()
+    {
+        memset(slots, 0, capacity * sizeof(slot_t));
+        count = 0;
+    }
+
+    int home(uint64_t key)
+    {
+        // fibonacci hashing, spreads sequential serials/coordinates nicely
+        uint64_t h = key * 0x9e3779b97f4a7c15ull;
+        return (int)(h >> 32) & (capacity - 1);
+    }
+
+    V *find(uint64_t key)
+    {
+        int i = home(key);
+        while (slots[i].used)
+        {
+            if (slots[i].key == key)
+            {
+                return &slots[i].value;
+            }
+            i = (i + 1) & (capacity - 1);
+        }
+        return NULL;
+    }
+
+    // returns the value for key, inserting a zeroed value if it doesn't exist
+    V *insert(uint64_t key, bool *existed = NULL)
+    {
+        // keep load factor below 1/2
+        if (2 * (count + 1) > capacity)
+        {
+            grow();
+        }
+
+        int i = home(key);
+        while (slots[i].used)
+        {
+            if (slots[i].key == key)
+            {
+                if (existed) *existed = true;
+                return &slots[i].value;
+            }
+            i = (i + 1) & (capacity - 1);
+        }
+
+        slots[i].used = true;
+        slots[i].key = key;
+        memset(&slots[i].value, 0, sizeof(V));
+        count += 1;
+        if (existed) *existed = false;
+        return &slots[i].value;
+    }
+
+    bool remove(uint64_t key)
+    {
+        int i = home(key);
+        while (slots[i].used && slots[i].key != key)
+        {
+            i = (i + 1) & (capacity - 1);
+        }
+        if (!slots[i].used)
+        {
+            return false;
+        }
+
+        // shift back any following entries that would otherwise become unreachable
+        int j = i;
+        while (true)
+        {
+            slots[i].used = false;
+            while (true)
+            {
+                j = (j + 1) & (capacity - 1);
+                if (!slots[j].used)
+                {
+                    count -= 1;
+                    return true;
+                }
+                int k = home(slots[j].key);
+                // entry j may move to i only if its home is not cyclically in (i, j]
+                bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+                if (!stays)
+                {
+                    break;
+                }
+            }
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+
+    // make room for n entries in total without growing on insert
+    void reserve(int n)
+    {
+        int new_capacity = capacity;
+        while (2 * n > new_capacity)
+        {
+            new_capacity *= 2;
+        }
+        if (new_capacity != capacity)
+        {
+            grow(new_capacity);
+        }
+    }
+
+    void grow()
+    {
+        grow(capacity * 2);
+    }
+
+    void grow(int new_capacity)
+    {
+        int old_capacity = capacity;
+        slot_t *old_slots = slots;
+
+        capacity = new_capacity;
+        slots = (slot_t *)malloc(capacity * sizeof(slot_t));
+        memset(slots, 0, capacity * sizeof(slot_t));
+
+        for (int i = 0; i < old_capacity; i++)
+        {
+            if (old_slots[i].used)
+            {
+                int j = home(old_slots[i].key);
+                while (slots[j].used)
+                {
+                    j = (j + 1) & (capacity - 1);
+                }
+                slots[j] = old_slots[i];
+            }
+        }
+
+        free(old_slots);
+    }
+};
+
+#endif
+
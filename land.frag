@@ -0,0 +1,12 @@
+#version 130
+
+uniform sampler2DArray tex;
+
+in vec2 texCoord;
+flat in float texLayer;
+
+void main()
+{
+    // land is never hued
+    gl_FragColor = texture(tex, vec3(texCoord, texLayer));
+}
@@ -1,12 +1,15 @@
 #include <cassert>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include <stdint.h>
 
 #include <algorithm>
 #include <map>
 #include <list>
+#include <vector>
 #include <string>
 #include <iostream>
 
@@ -15,6 +18,9 @@
 #include "game.hpp"
 #include "file.hpp"
 #include "gfx.hpp"
+#include "hash_table.hpp"
+#include "pool.hpp"
+#include "asset_cache.hpp"
 
 #ifdef _LINUX
 
@@ -30,8 +36,8 @@ extern int cnt_render_commands;
 extern int cnt_use_program;
 extern int cnt_bind_tex0;
 extern int cnt_bind_tex1;
-extern int cnt_glbegin;
-extern int cnt_glend;
+extern int cnt_draw_calls;
+extern int cnt_uploaded_bytes;
 
 const int ping_frequency = 30000;
 
@@ -45,6 +51,19 @@ const int TYPE_GUMP_WIDGET = 5;
 int window_width = 800;
 int window_height = 600;
 
+// how many tiles away from the player things are drawn.
+// set from the command line, or picked to cover the window if left at 0
+int view_distance = 0;
+// world_draw_prio can encode tiles at most this far from draw_prio_origin
+int draw_prio_radius = 32;
+// draw prios are relative to this, normally the player's position. the static
+// layer cache keeps it where the layer was last drawn from scratch, so the
+// depths in the layer stay valid while the player walks around.
+int draw_prio_origin_x = 0;
+int draw_prio_origin_y = 0;
+// how far the player may get from draw_prio_origin
+const int draw_prio_slack = 8;
+
 std::wstring chat_str;
 
 struct pick_target_t
@@ -81,7 +100,8 @@ struct pick_target_t
         } gump_widget;
     };
 };
-static pick_target_t pick_slots[0x10000];
+// large view distances can have well over 0x10000 pickable things on screen
+static pick_target_t pick_slots[0x40000];
 static bool picking_enabled = false;
 static int next_pick_id = 0;
 
@@ -122,7 +142,11 @@ int pick_land(int x, int y, int z, int tile_id)
     {
         return -1;
     }
-    assert(next_pick_id < sizeof(pick_slots)/sizeof(pick_slots[0]));
+    if (next_pick_id >= (int)(sizeof(pick_slots)/sizeof(pick_slots[0])))
+    {
+        // out of pick slots, this one just won't be pickable this frame
+        return -1;
+    }
     pick_slots[next_pick_id].type = TYPE_LAND;
     pick_slots[next_pick_id].land.x = x;
     pick_slots[next_pick_id].land.y = y;
@@ -137,7 +161,11 @@ int pick_static(int x, int y, int z, int item_id)
     {
         return -1;
     }
-    assert(next_pick_id < sizeof(pick_slots)/sizeof(pick_slots[0]));
+    if (next_pick_id >= (int)(sizeof(pick_slots)/sizeof(pick_slots[0])))
+    {
+        // out of pick slots, this one just won't be pickable this frame
+        return -1;
+    }
     pick_slots[next_pick_id].type = TYPE_STATIC;
     pick_slots[next_pick_id].static_item.x = x;
     pick_slots[next_pick_id].static_item.y = y;
@@ -146,13 +174,35 @@ int pick_static(int x, int y, int z, int item_id)
     return next_pick_id++;
 }
 
+// hands out count consecutive pick ids, for the caller to fill in their
+// slots. -1 when none are available.
+static int reserve_pick_ids(int count)
+{
+    if (!picking_enabled)
+    {
+        return -1;
+    }
+    if (next_pick_id + count > (int)(sizeof(pick_slots)/sizeof(pick_slots[0])))
+    {
+        // out of pick slots, these just won't be pickable this frame
+        return -1;
+    }
+    int first = next_pick_id;
+    next_pick_id += count;
+    return first;
+}
+
 int pick_item(item_t *item)
 {
     if (!picking_enabled)
     {
         return -1;
     }
-    assert(next_pick_id < sizeof(pick_slots)/sizeof(pick_slots[0]));
+    if (next_pick_id >= (int)(sizeof(pick_slots)/sizeof(pick_slots[0])))
+    {
+        // out of pick slots, this one just won't be pickable this frame
+        return -1;
+    }
     pick_slots[next_pick_id].type = TYPE_ITEM;
     pick_slots[next_pick_id].item.item = item;
     return next_pick_id++;
@@ -164,7 +214,11 @@ int pick_mobile(mobile_t *mobile)
     {
         return -1;
     }
-    assert(next_pick_id < sizeof(pick_slots)/sizeof(pick_slots[0]));
+    if (next_pick_id >= (int)(sizeof(pick_slots)/sizeof(pick_slots[0])))
+    {
+        // out of pick slots, this one just won't be pickable this frame
+        return -1;
+    }
     pick_slots[next_pick_id].type = TYPE_MOBILE;
     pick_slots[next_pick_id].mobile.mobile = mobile;
     return next_pick_id++;
@@ -176,7 +230,11 @@ int pick_gump(gump_t *gump)
     {
         return -1;
     }
-    assert(next_pick_id < sizeof(pick_slots)/sizeof(pick_slots[0]));
+    if (next_pick_id >= (int)(sizeof(pick_slots)/sizeof(pick_slots[0])))
+    {
+        // out of pick slots, this one just won't be pickable this frame
+        return -1;
+    }
     pick_slots[next_pick_id].type = TYPE_GUMP;
     pick_slots[next_pick_id].gump.gump = gump;
     return next_pick_id++;
@@ -188,7 +246,11 @@ int pick_gump_widget(gump_t *gump, gump_widget_t *widget)
     {
         return -1;
     }
-    assert(next_pick_id < sizeof(pick_slots)/sizeof(pick_slots[0]));
+    if (next_pick_id >= (int)(sizeof(pick_slots)/sizeof(pick_slots[0])))
+    {
+        // out of pick slots, this one just won't be pickable this frame
+        return -1;
+    }
     pick_slots[next_pick_id].type = TYPE_GUMP_WIDGET;
     pick_slots[next_pick_id].gump_widget.gump = gump;
     pick_slots[next_pick_id].gump_widget.widget = widget;
@@ -198,16 +260,29 @@ int pick_gump_widget(gump_t *gump, gump_widget_t *widget)
 
 long now;
 
-std::map <int, item_t *> items;
-std::map <int, multi_t *> multis;
-std::map <int, mobile_t *> mobiles;
+// world objects, keyed by serial. the objects themselves live in pools
+// so pointers to them stay valid until they are deleted.
+hash_table_t<item_t *> items;
+hash_table_t<multi_t *> multis;
+hash_table_t<mobile_t *> mobiles;
+object_pool_t<item_t> item_pool;
+object_pool_t<multi_t> multi_pool;
+object_pool_t<mobile_t> mobile_pool;
+
+void game_reserve_items(int n)
+{
+    items.reserve(items.count + n);
+    item_pool.reserve(n);
+}
 std::list<gump_t *> gump_list;
 
 int draw_ceiling = 128;
 bool draw_roofs = true;
 
-int prg_blit_picking;
-int prg_blit_hue;
+int prg_blit;
+int prg_land;
+int prg_tiled;
+int prg_composite;
 
 /* A simple function that prints a message, the error code returned by SDL,
  * and quits the application */
@@ -274,89 +349,124 @@ struct anim_frame_t
     pixel_storage_t ps;
 };
 
-static struct
+// one direction of a body's action
+struct anim_t
 {
-    struct
-    {
-        bool valid;
-        pixel_storage_t ps;
-    } entries[8*375];
-} hue_cache;
+    int frame_count;
+    anim_frame_t *frames;
+};
 
-static struct
+static void release_ps(pixel_storage_t *ps)
 {
-    struct
-    {
-        bool valid;
-        bool fetching;
-        int fetching_entries;
-        struct
-        {
-            int frame_count;
-            anim_frame_t *frames;
-        } directions[5];
-    } entries[1100*35]; // 1100 bodies, each with 35 actions
-} anim_cache;
+    gfx_free_tex2d(ps);
+}
 
-static struct
+static void release_texmap(pixel_storage_t *ps)
 {
-    struct
+    if (ps->width > 0)
     {
-        bool valid;
-        bool fetching;
-        pixel_storage_t ps;
-    } entries[0x4000];
-} land_cache;
+        gfx_free_tex2d(ps);
+    }
+}
 
-static struct
+static void release_anim(anim_t *anim)
 {
-    struct
+    for (int j = 0; j < anim->frame_count; j++)
     {
-        bool valid;
-        bool fetching;
-        pixel_storage_t ps;
-    } entries[0x10000];
-} static_cache;
+        gfx_free_tex2d(&anim->frames[j].ps);
+    }
+    free(anim->frames);
+}
 
-static struct
+// the composition is kept to tell apart compositions whose keys collide
+struct composed_anim_t
 {
-    struct
-    {
-        bool valid;
-        bool fetching;
-        pixel_storage_t ps;
-    } entries[0x10000];
-} gump_cache;
+    ml_anim_composition composition;
+    anim_t anim;
+};
 
-static struct
+static void release_composed_anim(composed_anim_t *composed)
 {
-    struct
-    {
-        bool valid;
-        bool fetching;
-        ml_multi *multi;
-    } entries[0x2000];
-} multi_cache;
+    release_anim(&composed->anim);
+}
+
+static void release_multi(ml_multi **m)
+{
+    free(*m);
+}
+
+static asset_cache_t<int, anim_t>          anim_cache; // keyed by anim_key
+// a body and its equipment in one direction, flattened into one animation
+static asset_cache_t<uint64_t, composed_anim_t> composed_anim_cache; // keyed by composition_key
+static asset_cache_t<int, pixel_storage_t> land_cache;
+static asset_cache_t<int, pixel_storage_t> texmap_cache; // width 0 if there is no texmap
+static asset_cache_t<int, pixel_storage_t> static_cache;
+static asset_cache_t<int, pixel_storage_t> gump_cache;
+static asset_cache_t<int, ml_multi *>      multi_cache;
+
+// asset memory budgets, in MiB
+int gpu_budget_mb = 256;
+int cpu_budget_mb = 64;
+
+void asset_caches_init()
+{
+    long gpu = (long)gpu_budget_mb * 1024 * 1024;
+    long cpu = (long)cpu_budget_mb * 1024 * 1024;
+    // split roughly along what a busy town actually uses
+    anim_cache.init  ("anim_cache",   release_anim,  gpu * 27 / 100, cpu / 10);
+    composed_anim_cache.init("composed_anim_cache", release_composed_anim, gpu * 8 / 100, 0);
+    land_cache.init  ("land_cache",   release_ps,    gpu *  4 / 100, 0);
+    // the land texture array is allocated in one go, so it gets the land
+    // cache's share up front and the tiles in it stay within that
+    gfx_set_land_array_bytes(gpu * 4 / 100);
+    texmap_cache.init("texmap_cache", release_texmap, gpu * 6 / 100, 0);
+    static_cache.init("static_cache", release_ps,    gpu * 40 / 100, 0);
+    gump_cache.init  ("gump_cache",   release_ps,    gpu * 15 / 100, 0);
+    multi_cache.init ("multi_cache",  release_multi, 0,             cpu * 9 / 10);
+}
+
+// throws out assets until the caches are within budget again.
+// must only be called after the last gfx_flush of a frame.
+void asset_caches_trim()
+{
+    anim_cache.trim();
+    composed_anim_cache.trim();
+    land_cache.trim();
+    texmap_cache.trim();
+    static_cache.trim();
+    gump_cache.trim();
+    multi_cache.trim();
+}
+
+void asset_caches_report()
+{
+    anim_cache.report();
+    composed_anim_cache.report();
+    land_cache.report();
+    texmap_cache.report();
+    static_cache.report();
+    gump_cache.report();
+    multi_cache.report();
+}
+
+static long ps_bytes(pixel_storage_t *ps)
+{
+    return ps->width * ps->height * 2;
+}
+
+// every load into a block cache entry gets a new serial, so things derived
+// from a block can tell whether it has changed since
+static long block_load_serial = 0;
 
 struct land_block_t
 {
+    long serial;
     struct {
         int tile_id;
         int z;
     } tiles[8*8];
 };
 
-static struct
-{
-    struct
-    {
-        bool valid;
-        bool fetching;
-        int x, y;
-        land_block_t land_block;
-    } entries[8 * 8];
-} land_block_cache;
-
 struct statics_block_entry_t
 {
     int item_id;
@@ -365,21 +475,154 @@ struct statics_block_entry_t
 
 struct statics_block_t
 {
+    long serial;
     int statics_count;
     int roof_heights[8*8];
     statics_block_entry_t *statics;
 };
 
-static struct
+static void release_block(land_block_t *lb)
 {
-    struct
+}
+
+static void release_block(statics_block_t *sb)
+{
+    free(sb->statics);
+    sb->statics = NULL;
+}
+
+static uint64_t block_key(int map, int block_x, int block_y)
+{
+    return ((uint64_t)map << 32) | ((uint64_t)block_x << 16) | (uint64_t)block_y;
+}
+
+// frame counter used for LRU bookkeeping
+static long frame_number = 0;
+
+// caches map blocks around the player, keyed by (map, block_x, block_y).
+// when full, the least recently used block is thrown out. if that block was
+// already used this frame, the working set doesn't fit and we would just keep
+// reloading the same blocks over and over, so the cache grows instead.
+// entries are allocated one by one and never move, so pointers handed out
+// stay valid for at least the rest of the frame.
+template <typename T>
+struct block_cache_t
+{
+    struct entry_t
     {
         bool valid;
         bool fetching;
-        int x, y;
-        statics_block_t statics_block;
-    } entries[8 * 8];
-} statics_block_cache;
+        int map, x, y;
+        long last_used;
+        T block;
+    };
+
+    const char *name;
+    int capacity;
+    int entry_count;
+    entry_t **entries;
+    hash_table_t<entry_t *> index;
+
+    // statistics
+    int hits;
+    int misses;
+    int evictions;
+    int thrash_count;
+
+    void init(const char *cache_name, int initial_capacity)
+    {
+        name = cache_name;
+        capacity = 0;
+        entry_count = 0;
+        entries = NULL;
+        index.init(2 * initial_capacity);
+        hits = misses = evictions = thrash_count = 0;
+        resize(initial_capacity);
+    }
+
+    void resize(int new_capacity)
+    {
+        if (new_capacity <= capacity)
+        {
+            return;
+        }
+        entries = (entry_t **)realloc(entries, new_capacity * sizeof(entry_t *));
+        capacity = new_capacity;
+    }
+
+    entry_t *find(int map, int block_x, int block_y)
+    {
+        entry_t **e = index.find(block_key(map, block_x, block_y));
+        return e ? *e : NULL;
+    }
+
+    // returns the entry for this block, or a fresh one that the caller must start fetching
+    entry_t *lookup(int map, int block_x, int block_y, bool *miss)
+    {
+        entry_t *e = find(map, block_x, block_y);
+        if (e)
+        {
+            hits += 1;
+            e->last_used = frame_number;
+            *miss = false;
+            return e;
+        }
+
+        misses += 1;
+        *miss = true;
+
+        if (entry_count < capacity)
+        {
+            e = (entry_t *)malloc(sizeof(entry_t));
+            memset(e, 0, sizeof(*e));
+            entries[entry_count++] = e;
+        }
+        else
+        {
+            // find least recently used entry that isn't still being fetched
+            entry_t *lru = NULL;
+            for (int i = 0; i < entry_count; i++)
+            {
+                entry_t *candidate = entries[i];
+                if (!candidate->fetching && (lru == NULL || candidate->last_used < lru->last_used))
+                {
+                    lru = candidate;
+                }
+            }
+
+            if (lru == NULL || lru->last_used >= frame_number)
+            {
+                // thrashing! every block is in use right now. grow instead of evicting.
+                thrash_count += 1;
+                printf("%s: thrashing detected, growing from %d to %d entries\n", name, capacity, 2 * capacity);
+                resize(2 * capacity);
+                e = (entry_t *)malloc(sizeof(entry_t));
+                memset(e, 0, sizeof(*e));
+                entries[entry_count++] = e;
+            }
+            else
+            {
+                e = lru;
+                evictions += 1;
+                index.remove(block_key(e->map, e->x, e->y));
+                release_block(&e->block);
+            }
+        }
+
+        e->valid = true;
+        e->fetching = true;
+        e->map = map;
+        e->x = block_x;
+        e->y = block_y;
+        e->last_used = frame_number;
+        *index.insert(block_key(map, block_x, block_y)) = e;
+
+        return e;
+    }
+};
+
+static block_cache_t<land_block_t>    land_block_cache;
+static block_cache_t<statics_block_t> statics_block_cache;
 
 struct string_cache_entry_t
 {
@@ -391,340 +634,547 @@ static struct
     std::map<std::wstring, string_cache_entry_t> entries;
 } string_cache;
 
-pixel_storage_t get_hue_tex(int hue_id)
+// all hues go into one lookup texture, hue_id n is row n-1
+void upload_hue_table()
 {
-    assert(hue_id > 0 && hue_id < 8*375);
-    if (!hue_cache.entries[hue_id-1].valid)
+    const int hue_count = 8*375;
+    uint16_t *colors = (uint16_t *)malloc(hue_count * 32 * sizeof(uint16_t));
+    for (int i = 0; i < hue_count; i++)
     {
-        hue_cache.entries[hue_id-1].valid = true;
-
-        ml_hue *hue = ml_get_hue(hue_id-1);
-        hue_cache.entries[hue_id-1].ps = gfx_upload_tex2d(32, 1, hue->colors);
+        memcpy(&colors[i * 32], ml_get_hue(i)->colors, 32 * sizeof(uint16_t));
     }
+    gfx_upload_hue_table(hue_count, colors);
+    free(colors);
+}
 
-    return hue_cache.entries[hue_id-1].ps;
+
+// runs on the mullib workers, for every image they decoded
+static void *prepare_pixels(int width, int height, uint16_t *data)
+{
+    return gfx_prepare_pixels(width, height, data);
 }
 
+// set by the game_prefetch_* functions while they look things up
+static bool prefetching = false;
 
-void write_anim_frames(int body_id, int action, int direction, ml_anim *anim)
+// whether a lookup has to request the entry's asset: on a miss, and when a
+// prefetch requested it but it is needed right away now. prefetch requests
+// wait behind everything else, so then it is requested again with the normal
+// priority. the first response fills the entry, the other one is discarded.
+template <typename E>
+static bool needs_request(E *e, bool miss)
+{
+    if (miss)
+    {
+        e->prefetched = prefetching;
+        return true;
+    }
+    if (e->state == ASSET_FETCHING && e->prefetched && !prefetching)
+    {
+        e->prefetched = false;
+        return true;
+    }
+    return false;
+}
+
+// for responses that came in after their entry was already filled
+static void discard_anim(ml_anim *anim)
+{
+    for (int j = 0; j < anim->frame_count; j++)
+    {
+        gfx_free_pixels((gfx_pixels_t *)anim->frames[j].prepared);
+    }
+    ml_free_pixels(anim);
+}
+
+static int anim_key(int body_id, int action, int direction)
 {
-    int body_action_id = body_id * 35 + action;
+    return (body_id * 35 + action) * 5 + direction;
+}
 
+// uploads the frames of a freshly read animation, and frees it
+static void upload_anim(anim_t *value, ml_anim *anim, long *gpu_bytes, long *cpu_bytes)
+{
     anim_frame_t *frames = (anim_frame_t *)malloc(anim->frame_count * sizeof(anim_frame_t));
 
+    *gpu_bytes = 0;
     for (int j = 0; j < anim->frame_count; j++)
     {
         frames[j].center_x = anim->frames[j].center_x;
         frames[j].center_y = anim->frames[j].center_y;
-        frames[j].ps = gfx_upload_tex2d(anim->frames[j].width, anim->frames[j].height, anim->frames[j].data);
+        frames[j].ps = gfx_upload_tex2d((gfx_pixels_t *)anim->frames[j].prepared);
+        *gpu_bytes += ps_bytes(&frames[j].ps);
     }
+    *cpu_bytes = anim->frame_count * sizeof(anim_frame_t);
 
-    anim_cache.entries[body_action_id].directions[direction].frame_count = anim->frame_count;
-    anim_cache.entries[body_action_id].directions[direction].frames = frames;
+    value->frame_count = anim->frame_count;
+    value->frames = frames;
 
-    free(anim);
+    ml_free_pixels(anim);
+}
 
-    anim_cache.entries[body_action_id].fetching_entries -= 1;
-    assert(anim_cache.entries[body_action_id].fetching_entries >= 0);
-    if (anim_cache.entries[body_action_id].fetching_entries == 0)
+void write_anim_frames(int body_id, int action, int direction, ml_anim *anim)
+{
+    asset_cache_t<int, anim_t>::entry_t *e = anim_cache.find(anim_key(body_id, action, direction));
+    if (e == NULL || e->state != ASSET_FETCHING)
     {
-        anim_cache.entries[body_action_id].fetching = false;
+        discard_anim(anim);
+        return;
     }
+
+    long gpu_bytes, cpu_bytes;
+    upload_anim(&e->value, anim, &gpu_bytes, &cpu_bytes);
+    anim_cache.set_ready(e, gpu_bytes, cpu_bytes);
 }
 
-anim_frame_t *get_anim_frames(int body_id, int action, int direction, int *frame_count)
+void write_composed_anim(uint64_t key, ml_anim *anim)
 {
-    assert(body_id   >= 0 && body_id   < 1100);
-    assert(action    >= 0 && action    <   35);
-    assert(direction >= 0 && direction <    5);
-
-    int body_action_id = body_id * 35 + action;
-
-    if (!anim_cache.entries[body_action_id].valid)
+    asset_cache_t<uint64_t, composed_anim_t>::entry_t *e = composed_anim_cache.find(key);
+    if (e == NULL || e->state != ASSET_FETCHING)
     {
-        anim_cache.entries[body_action_id].valid = true;
-        anim_cache.entries[body_action_id].fetching = true;
-
-        anim_cache.entries[body_action_id].fetching_entries = 5;
-
-        for (int i = 0; i < 5; i++)
+        if (anim != NULL)
         {
-            //printf("anim_cache         : loading %d %d %d\n", body_id, action, i);
-            mlt_read_anim(body_id, action, i, write_anim_frames);
-            //write_anim_frames(body_id, action, i);
+            discard_anim(anim);
         }
+        return;
     }
-
-    if (anim_cache.entries[body_action_id].fetching)
-    {
-        // TODO: return dummy item
-        return NULL;
-    }
-    else
+    if (anim == NULL)
     {
-        *frame_count = anim_cache.entries[body_action_id].directions[direction].frame_count;
-        return anim_cache.entries[body_action_id].directions[direction].frames;
+        // it can't be composed, it's drawn layered instead
+        e->value.anim.frame_count = 0;
+        e->value.anim.frames = NULL;
+        composed_anim_cache.set_ready(e, 0, 0);
+        return;
     }
+
+    long gpu_bytes, cpu_bytes;
+    upload_anim(&e->value.anim, anim, &gpu_bytes, &cpu_bytes);
+    composed_anim_cache.set_ready(e, gpu_bytes, cpu_bytes);
 }
 
-void write_land_ps(int land_id, ml_art *l)
+// FNV-1a over the whole composition, which must be zeroed before it's filled in
+static uint64_t composition_key(ml_anim_composition *composition)
 {
-    land_cache.entries[land_id].ps = gfx_upload_tex2d(l->width, l->height, l->data);
-    free(l);
-
-    land_cache.entries[land_id].fetching = false;
+    uint64_t h = 0xcbf29ce484222325ull;
+    uint8_t *p = (uint8_t *)composition;
+    for (int i = 0; i < (int)sizeof(ml_anim_composition); i++)
+    {
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    }
+    return h;
 }
 
-pixel_storage_t *get_land_ps(int land_id)
+// NULL while the composed animation is being put together, or if it can't be
+anim_frame_t *get_composed_anim_frames(ml_anim_composition *composition, int *frame_count)
 {
-    assert(land_id >= 0 && land_id < 0x4000);
-    if (!land_cache.entries[land_id].valid)
+    // a key taken by a different composition moves this one on to the next key
+    uint64_t key = composition_key(composition);
+    asset_cache_t<uint64_t, composed_anim_t>::entry_t *e;
+    while ((e = composed_anim_cache.find(key)) != NULL &&
+           memcmp(&e->value.composition, composition, sizeof(ml_anim_composition)) != 0)
     {
-        land_cache.entries[land_id].valid = true;
-        land_cache.entries[land_id].fetching = true;
-
-        //printf("land_cache         : loading %d\n", land_id);
-
-        //write_land_ps(land_id);
-        mlt_read_land_art(land_id, write_land_ps);
+        key += 1;
     }
 
-    if (land_cache.entries[land_id].fetching)
+    bool miss;
+    e = composed_anim_cache.lookup(key, &miss);
+    if (miss)
     {
-        return NULL;
+        e->value.composition = *composition;
     }
-    else
+    if (needs_request(e, miss))
     {
-        return &land_cache.entries[land_id].ps;
+        mlt_compose_anim(key, composition, write_composed_anim);
     }
-}
-
-void write_static_ps(int item_id, ml_art *s)
-{
-    static_cache.entries[item_id].ps = gfx_upload_tex2d(s->width, s->height, s->data);
-    free(s);
 
-    static_cache.entries[item_id].fetching = false;
+    if (e->state == ASSET_FETCHING)
+    {
+        return NULL;
+    }
+    *frame_count = e->value.anim.frame_count;
+    return e->value.anim.frames;
 }
 
-pixel_storage_t *get_static_ps(int item_id)
+anim_frame_t *get_anim_frames(int body_id, int action, int direction, int *frame_count)
 {
-    assert(item_id >= 0 && item_id < 0x10000);
-    if (!static_cache.entries[item_id].valid)
-    {
-        static_cache.entries[item_id].valid = true;
-        static_cache.entries[item_id].fetching = true;
-
-        //printf("static_cache       : loading %d\n", item_id);
+    assert(body_id   >= 0 && body_id   < ML_ANIM_BODY_COUNT);
+    assert(action    >= 0 && action    <   35);
+    assert(direction >= 0 && direction <    5);
 
-        //async_get_static_ps(item_id);
-        mlt_read_static_art(item_id, write_static_ps);
+    // directions are loaded one at a time, most mobiles on screen only ever face one or two
+    bool miss;
+    asset_cache_t<int, anim_t>::entry_t *e = anim_cache.lookup(anim_key(body_id, action, direction), &miss);
+    if (needs_request(e, miss))
+    {
+        //printf("anim_cache         : loading %d %d %d\n", body_id, action, direction);
+        mlt_read_anim(body_id, action, direction, write_anim_frames);
     }
 
-    if (static_cache.entries[item_id].fetching)
+    if (e->state == ASSET_FETCHING)
     {
+        // TODO: return dummy item
         return NULL;
     }
     else
     {
-        return &static_cache.entries[item_id].ps;
+        *frame_count = e->value.frame_count;
+        return e->value.frames;
     }
 }
 
-void write_gump_ps(int gump_id, ml_gump *g)
+void write_land_ps(int land_id, ml_art *l)
 {
-    gump_cache.entries[gump_id].ps = gfx_upload_tex2d(g->width, g->height, g->data);
-    free(g);
+    asset_cache_t<int, pixel_storage_t>::entry_t *e = land_cache.find(land_id);
+    if (e == NULL || e->state != ASSET_FETCHING)
+    {
+        gfx_free_pixels((gfx_pixels_t *)l->prepared);
+        ml_free_pixels(l);
+        return;
+    }
+
+    e->value = gfx_upload_land_tex2d((gfx_pixels_t *)l->prepared);
+    ml_free_pixels(l);
 
-    gump_cache.entries[gump_id].fetching = false;
+    land_cache.set_ready(e, ps_bytes(&e->value), 0);
 }
 
-pixel_storage_t *get_gump_ps(int gump_id)
+// the cache entry itself, which may still be fetching
+static asset_cache_t<int, pixel_storage_t>::entry_t *get_land_art_entry(int land_id)
 {
-    assert(gump_id >= 0 && gump_id < 0x10000);
-    if (!gump_cache.entries[gump_id].valid)
+    assert(land_id >= 0 && land_id < 0x4000);
+    bool miss;
+    asset_cache_t<int, pixel_storage_t>::entry_t *e = land_cache.lookup(land_id, &miss);
+    if (miss)
     {
-        gump_cache.entries[gump_id].valid = true;
-        gump_cache.entries[gump_id].fetching = true;
-
-        //printf("gump_cache       : loading %d\n", gump_id);
+        //printf("land_cache         : loading %d\n", land_id);
+        mlt_read_land_art(land_id, write_land_ps);
+    }
+    return e;
+}
 
-        mlt_read_gump(gump_id, write_gump_ps);
+void write_texmap(int texture_id, ml_art *t)
+{
+    asset_cache_t<int, pixel_storage_t>::entry_t *e = texmap_cache.find(texture_id);
+    if (e == NULL || e->state != ASSET_FETCHING)
+    {
+        if (t != NULL)
+        {
+            gfx_free_pixels((gfx_pixels_t *)t->prepared);
+            ml_free_pixels(t);
+        }
+        return;
     }
 
-    if (gump_cache.entries[gump_id].fetching)
+    if (t != NULL)
     {
-        return NULL;
+        e->value = gfx_upload_tex2d((gfx_pixels_t *)t->prepared);
+        ml_free_pixels(t);
     }
     else
     {
-        return &gump_cache.entries[gump_id].ps;
+        memset(&e->value, 0, sizeof(e->value));
     }
-}
-
-void write_multi(int multi_id, ml_multi *m)
-{
-    multi_cache.entries[multi_id].multi = m;
 
-    multi_cache.entries[multi_id].fetching = false;
+    texmap_cache.set_ready(e, ps_bytes(&e->value), 0);
 }
 
-ml_multi *get_multi(int multi_id)
+// the cache entry itself, which may still be fetching
+static asset_cache_t<int, pixel_storage_t>::entry_t *get_texmap_entry(int texture_id)
 {
-    assert(multi_id >= 0 && multi_id < 0x10000);
-    if (!multi_cache.entries[multi_id].valid)
+    bool miss;
+    asset_cache_t<int, pixel_storage_t>::entry_t *e = texmap_cache.lookup(texture_id, &miss);
+    if (miss)
     {
-        multi_cache.entries[multi_id].valid = true;
-        multi_cache.entries[multi_id].fetching = true;
-
-        printf("multi_cache       : loading %d\n", multi_id);
-
-        write_multi(multi_id, ml_read_multi(multi_id));
+        mlt_read_texmap(texture_id, write_texmap);
     }
+    return e;
+}
+
+pixel_storage_t *get_land_ps(int land_id)
+{
+    asset_cache_t<int, pixel_storage_t>::entry_t *e = get_land_art_entry(land_id);
 
-    if (multi_cache.entries[multi_id].fetching)
+    if (e->state == ASSET_FETCHING)
     {
         return NULL;
     }
     else
     {
-        return multi_cache.entries[multi_id].multi;
+        return &e->value;
     }
 }
 
-
-void write_land_block(int map, int block_x, int block_y, ml_land_block *lb)
+void write_static_ps(int item_id, ml_art *s)
 {
-    int cache_block_x = block_x % 8;
-    int cache_block_y = block_y % 8;
+    asset_cache_t<int, pixel_storage_t>::entry_t *e = static_cache.find(item_id);
+    if (e == NULL || e->state != ASSET_FETCHING)
+    {
+        gfx_free_pixels((gfx_pixels_t *)s->prepared);
+        ml_free_pixels(s);
+        return;
+    }
 
-    int cache_block_index = cache_block_x + cache_block_y * 8;
+    e->value = gfx_upload_tex2d((gfx_pixels_t *)s->prepared);
+    ml_free_pixels(s);
 
-    for (int i = 0; i < 8 * 8; i++)
+    static_cache.set_ready(e, ps_bytes(&e->value), 0);
+}
+
+// the cache entry itself, which may still be fetching
+static asset_cache_t<int, pixel_storage_t>::entry_t *get_static_art_entry(int item_id)
+{
+    assert(item_id >= 0 && item_id < 0x10000);
+    bool miss;
+    asset_cache_t<int, pixel_storage_t>::entry_t *e = static_cache.lookup(item_id, &miss);
+    if (needs_request(e, miss))
     {
-        land_block_cache.entries[cache_block_index].land_block.tiles[i].tile_id = lb->tiles[i].tile_id;
-        land_block_cache.entries[cache_block_index].land_block.tiles[i].z = lb->tiles[i].z;
+        //printf("static_cache       : loading %d\n", item_id);
+        mlt_read_static_art(item_id, write_static_ps);
     }
-    free(lb);
+    return e;
+}
 
-    land_block_cache.entries[cache_block_index].fetching = false;
+pixel_storage_t *get_static_ps(int item_id)
+{
+    asset_cache_t<int, pixel_storage_t>::entry_t *e = get_static_art_entry(item_id);
+
+    if (e->state == ASSET_FETCHING)
+    {
+        return NULL;
+    }
+    else
+    {
+        return &e->value;
+    }
 }
 
-land_block_t *get_land_block(int map, int block_x, int block_y)
+void write_gump_ps(int gump_id, ml_gump *g)
+{
+    asset_cache_t<int, pixel_storage_t>::entry_t *e = gump_cache.find(gump_id);
+    if (e == NULL || e->state != ASSET_FETCHING)
+    {
+        gfx_free_pixels((gfx_pixels_t *)g->prepared);
+        ml_free_pixels(g);
+        return;
+    }
+
+    e->value = gfx_upload_tex2d((gfx_pixels_t *)g->prepared);
+    ml_free_pixels(g);
+
+    gump_cache.set_ready(e, ps_bytes(&e->value), 0);
+}
+
+// the cache entry itself, which may still be fetching
+static asset_cache_t<int, pixel_storage_t>::entry_t *get_gump_entry(int gump_id)
+{
+    assert(gump_id >= 0 && gump_id < 0x10000);
+    bool miss;
+    asset_cache_t<int, pixel_storage_t>::entry_t *e = gump_cache.lookup(gump_id, &miss);
+    if (needs_request(e, miss))
+    {
+        //printf("gump_cache       : loading %d\n", gump_id);
+        mlt_read_gump(gump_id, write_gump_ps);
+    }
+    return e;
+}
+
+pixel_storage_t *get_gump_ps(int gump_id)
+{
+    asset_cache_t<int, pixel_storage_t>::entry_t *e = get_gump_entry(gump_id);
+
+    if (e->state == ASSET_FETCHING)
+    {
+        return NULL;
+    }
+    else
+    {
+        return &e->value;
+    }
+}
+
+void write_multi(int multi_id, ml_multi *m)
+{
+    asset_cache_t<int, ml_multi *>::entry_t *e = multi_cache.find(multi_id);
+    assert(e != NULL && e->state == ASSET_FETCHING);
+
+    e->value = m;
+
+    long bytes = sizeof(ml_multi) + m->item_count * sizeof(m->items[0]) + (m->bucket_width * m->bucket_height + 1) * sizeof(int);
+    multi_cache.set_ready(e, 0, bytes);
+}
+
+ml_multi *get_multi(int multi_id)
+{
+    assert(multi_id >= 0 && multi_id < 0x2000);
+    bool miss;
+    asset_cache_t<int, ml_multi *>::entry_t *e = multi_cache.lookup(multi_id, &miss);
+    if (miss)
+    {
+        //printf("multi_cache       : loading %d\n", multi_id);
+        mlt_read_multi(multi_id, write_multi);
+    }
+
+    if (e->state == ASSET_FETCHING)
+    {
+        return NULL;
+    }
+    else
+    {
+        return e->value;
+    }
+}
+
+// number of map blocks kept resident for a given view distance (in tiles)
+static int block_cache_capacity_for(int view_distance)
 {
-    // TODO: remove these assumptions
-    assert(map == 0 || map == 1);
-    assert(block_x >= 0 && block_x < 896);
-    assert(block_y >= 0 && block_y < 512);
+    // the blocks being drawn, plus some slack for neighbour lookups
+    // (land z, roof flood fill) and for blocks still around from before a move
+    int block_radius = (view_distance + 7) / 8 + 1;
+    int side = 2 * block_radius + 1;
+    return 2 * side * side;
+}
 
-    int cache_block_x = block_x % 8;
-    int cache_block_y = block_y % 8;
+void block_caches_init(int view_distance)
+{
+    int capacity = block_cache_capacity_for(view_distance);
+    land_block_cache.init("land_block_cache", capacity);
+    statics_block_cache.init("statics_block_cache", capacity);
+}
 
-    // TODO: also care about map in the cache lookup
+void block_caches_resize(int view_distance)
+{
+    int capacity = block_cache_capacity_for(view_distance);
+    land_block_cache.resize(capacity);
+    statics_block_cache.resize(capacity);
+}
 
-    int cache_block_index = cache_block_x + cache_block_y * 8;
+// the map (facet) the player is on
+int current_map = 1;
 
-    // TODO: add thrashing check
-    if (!land_block_cache.entries[cache_block_index].valid ||
-         land_block_cache.entries[cache_block_index].x != block_x ||
-         land_block_cache.entries[cache_block_index].y != block_y)
+// blocks outside the map (or on a map we don't have) are never loaded
+static bool block_in_map(int map, int block_x, int block_y)
+{
+    static struct
     {
-        land_block_cache.entries[cache_block_index].valid = true;
-        land_block_cache.entries[cache_block_index].fetching = true;
-        land_block_cache.entries[cache_block_index].x = block_x;
-        land_block_cache.entries[cache_block_index].y = block_y;
+        bool known;
+        bool present;
+        int block_width, block_height;
+    } dims[ML_MAP_COUNT];
 
+    if (map < 0 || map >= ML_MAP_COUNT)
+    {
+        return false;
+    }
+    if (!dims[map].known)
+    {
+        dims[map].present = ml_get_map_dimensions(map, &dims[map].block_width, &dims[map].block_height);
+        dims[map].known = true;
+    }
+    return dims[map].present &&
+           block_x >= 0 && block_x < dims[map].block_width &&
+           block_y >= 0 && block_y < dims[map].block_height;
+}
+
+void write_land_block(int map, int block_x, int block_y, ml_land_block *lb)
+{
+    block_cache_t<land_block_t>::entry_t *e = land_block_cache.find(map, block_x, block_y);
+    // blocks are never evicted while fetching
+    assert(e != NULL && e->fetching);
+
+    for (int i = 0; i < 8 * 8; i++)
+    {
+        e->block.tiles[i].tile_id = lb->tiles[i].tile_id;
+        e->block.tiles[i].z = lb->tiles[i].z;
+    }
+    e->block.serial = ++block_load_serial;
+    free(lb);
+
+    e->fetching = false;
+}
+
+land_block_t *get_land_block(int map, int block_x, int block_y)
+{
+    if (!block_in_map(map, block_x, block_y))
+    {
+        return NULL;
+    }
+
+    bool miss;
+    block_cache_t<land_block_t>::entry_t *e = land_block_cache.lookup(map, block_x, block_y, &miss);
+    if (miss)
+    {
         //printf("land_block_cache   : loading %d %d %d\n", map, block_x, block_y);
 
         mlt_read_land_block(map, block_x, block_y, write_land_block);
     }
 
-    if (land_block_cache.entries[cache_block_index].fetching)
+    if (e->fetching)
     {
         return NULL;
     }
     else
     {
-        return &land_block_cache.entries[cache_block_index].land_block;
+        return &e->block;
     }
 }
 
 void write_statics_block(int map, int block_x, int block_y, ml_statics_block *sb)
 {
-    int cache_block_x = block_x % 8;
-    int cache_block_y = block_y % 8;
-
-    // TODO: also care about map in the cache lookup
-
-    int cache_block_index = cache_block_x + cache_block_y * 8;
+    block_cache_t<statics_block_t>::entry_t *e = statics_block_cache.find(map, block_x, block_y);
+    // blocks are never evicted while fetching
+    assert(e != NULL && e->fetching);
 
-    statics_block_cache.entries[cache_block_index].statics_block.statics_count = sb->statics_count;
-    statics_block_cache.entries[cache_block_index].statics_block.statics = (statics_block_entry_t *)malloc(sb->statics_count * sizeof(statics_block_entry_t));
+    e->block.statics_count = sb->statics_count;
+    e->block.statics = (statics_block_entry_t *)malloc(sb->statics_count * sizeof(statics_block_entry_t));
 
     for (int i = 0; i < 8*8; i++)
     {
-        statics_block_cache.entries[cache_block_index].statics_block.roof_heights[i] = sb->roof_heights[i];
+        e->block.roof_heights[i] = sb->roof_heights[i];
     }
 
     for (int i = 0; i < sb->statics_count; i++)
     {
-        statics_block_cache.entries[cache_block_index].statics_block.statics[i].item_id = sb->statics[i].tile_id;
-        statics_block_cache.entries[cache_block_index].statics_block.statics[i].dx = sb->statics[i].dx;
-        statics_block_cache.entries[cache_block_index].statics_block.statics[i].dy = sb->statics[i].dy;
-        statics_block_cache.entries[cache_block_index].statics_block.statics[i].z = sb->statics[i].z;
+        e->block.statics[i].item_id = sb->statics[i].tile_id;
+        e->block.statics[i].dx = sb->statics[i].dx;
+        e->block.statics[i].dy = sb->statics[i].dy;
+        e->block.statics[i].z = sb->statics[i].z;
     }
+    e->block.serial = ++block_load_serial;
     free(sb);
 
-    statics_block_cache.entries[cache_block_index].fetching = false;
+    e->fetching = false;
 }
 
 statics_block_t *get_statics_block(int map, int block_x, int block_y)
 {
-    // TODO: remove these assumptions
-    assert(map == 0 || map == 1);
-    assert(block_x >= 0 && block_x < 896);
-    assert(block_y >= 0 && block_y < 512);
-
-    int cache_block_x = block_x % 8;
-    int cache_block_y = block_y % 8;
-
-    int cache_block_index = cache_block_x + cache_block_y * 8;
-
-    // TODO: add thrashing check
-    if (!statics_block_cache.entries[cache_block_index].valid ||
-         statics_block_cache.entries[cache_block_index].x != block_x ||
-         statics_block_cache.entries[cache_block_index].y != block_y)
+    if (!block_in_map(map, block_x, block_y))
     {
-        // if we're throwing an old block out, free its resources!
-        if (statics_block_cache.entries[cache_block_index].valid)
-        {
-            free(statics_block_cache.entries[cache_block_index].statics_block.statics);
-        }
-
-        statics_block_cache.entries[cache_block_index].valid = true;
-        statics_block_cache.entries[cache_block_index].fetching = true;
-        statics_block_cache.entries[cache_block_index].x = block_x;
-        statics_block_cache.entries[cache_block_index].y = block_y;
+        return NULL;
+    }
 
+    bool miss;
+    block_cache_t<statics_block_t>::entry_t *e = statics_block_cache.lookup(map, block_x, block_y, &miss);
+    if (miss)
+    {
         //printf("statics_block_cache: loading %d %d %d\n", map, block_x, block_y);
 
         mlt_read_statics_block(map, block_x, block_y, write_statics_block);
     }
 
-    if (statics_block_cache.entries[cache_block_index].fetching)
+    if (e->fetching)
     {
         return NULL;
     }
     else
     {
-        return &statics_block_cache.entries[cache_block_index].statics_block;
+        return &e->block;
     }
 }
 
 void write_string_ps(int font_id, std::wstring str, ml_art *a)
 {
-    string_cache.entries[str].ps = gfx_upload_tex2d(a->width, a->height, a->data);
-    free(a);
+    string_cache.entries[str].ps = gfx_upload_tex2d(gfx_prepare_pixels(a->width, a->height, a->data));
+    ml_free_pixels(a);
 
     string_cache.entries[str].fetching = false;
 }
@@ -819,15 +1269,15 @@ void world_to_screen(int world_x, int world_y, int world_z, int *screen_x, int *
 
 int world_draw_prio(int world_x, int world_y, int world_z)
 {
-    int world_dx = world_x - player.x;
-    int world_dy = world_y - player.y;
+    int world_dx = world_x - draw_prio_origin_x;
+    int world_dy = world_y - draw_prio_origin_y;
 
-    world_dx += 32;
-    world_dy += 32;
+    world_dx += draw_prio_radius;
+    world_dy += draw_prio_radius;
     world_z += 128;
 
-    assert(world_dx >= 0 && world_dx < 64);
-    assert(world_dy >= 0 && world_dy < 64);
+    assert(world_dx >= 0 && world_dx < 2 * draw_prio_radius);
+    assert(world_dy >= 0 && world_dy < 2 * draw_prio_radius);
     assert(world_z >= 0 && world_z < 256);
 
     // 32 layers, 2 types of foliage (is foliage/is not foliage)
@@ -841,7 +1291,7 @@ int land_block_z_slow(int x, int y)
     int block_y = y / 8;
     int dx = x % 8;
     int dy = y % 8;
-    land_block_t *lb = get_land_block(1, block_x, block_y);
+    land_block_t *lb = get_land_block(current_map, block_x, block_y);
     if (lb)
     {
         int z = lb->tiles[dx + dy * 8].z;
@@ -865,15 +1315,13 @@ int land_block_z_averaged(int x, int y)
     return z_sum / 4;
 }
 
+// screen corners of the land tile at (x, y), returns its draw prio.
 // this might be optimized when it comes to z calculations
-void draw_world_land_ps(pixel_storage_t *ps, int x, int y, int pick_id)
+int land_quad(int x, int y, int xs[4], int ys[4], bool *flat)
 {
     int dxs[4] = { 0, 1, 1, 0 };
     int dys[4] = { 0, 0, 1, 1 };
 
-    int xs[4];
-    int ys[4];
-
     int zs[4];
     for (int i = 0; i < 4; i++)
     {
@@ -893,6 +1341,8 @@ void draw_world_land_ps(pixel_storage_t *ps, int x, int y, int pick_id)
         ys[i] = screen_y;
     }
 
+    *flat = zs[0] == zs[1] && zs[0] == zs[2] && zs[0] == zs[3];
+
     // find smallest z and use that for prio order 
     // seems to work ok...
     int min_z = zs[0];
@@ -903,7 +1353,20 @@ void draw_world_land_ps(pixel_storage_t *ps, int x, int y, int pick_id)
             min_z = zs[i];
         }
     }
-    gfx_render(ps, xs, ys, world_draw_prio(x, y, min_z-1), 0, pick_id);
+    return world_draw_prio(x, y, min_z-1);
+}
+
+// top left screen corner of art standing at (x, y, z), returns its draw prio
+int art_position(pixel_storage_t *ps, int x, int y, int z, int bonus_prio, int *screen_x, int *screen_y)
+{
+    world_to_screen(x, y, z, screen_x, screen_y);
+    // offset x by art's width/2
+    *screen_x -= ps->width / 2;
+    // offset y by art's height
+    *screen_y -= ps->height;
+    // statics tiles are shifted half a world unit downwards
+    *screen_y += 22;
+    return world_draw_prio(x, y, z) + bonus_prio;
 }
 
 void draw_world_art_ps(pixel_storage_t *ps, int x, int y, int z, int height, int bonus_prio, int hue_id, int pick_id)
@@ -915,14 +1378,8 @@ void draw_world_art_ps(pixel_storage_t *ps, int x, int y, int z, int height, int
 
     int screen_x;
     int screen_y;
-    world_to_screen(x, y, z, &screen_x, &screen_y);
-    // offset x by art's width/2
-    screen_x -= ps->width / 2;
-    // offset y by art's height
-    screen_y -= ps->height;
-    // statics tiles are shifted half a world unit downwards
-    screen_y += 22;
-    blit_ps(ps, screen_x, screen_y, world_draw_prio(x, y, z) + bonus_prio, hue_id, pick_id);
+    int prio = art_position(ps, x, y, z, bonus_prio, &screen_x, &screen_y);
+    blit_ps(ps, screen_x, screen_y, prio, hue_id, pick_id);
 }
 
 static int gump_draw_order = 0;
@@ -974,14 +1431,399 @@ void draw_world_anim_frame(anim_frame_t *frame, bool flip, int x, int y, int z,
     }
 }
 
-void draw_world_land(int tile_id, int x, int y, int pick_id)
+// land and statics only change when their blocks do, so instead of working
+// out every tile's quad and draw prio each frame, each block keeps a list of
+// its sprites, positioned relative to the block's origin. drawing a block is
+// then just adding the camera's offset to them.
+//
+// a list is rebuilt when
+//  - a block it was built from has been (re)loaded since
+//  - art it wanted was still loading, and some art has arrived since
+//  - art it uses may have been evicted. lists touch their art every frame
+//    they're drawn, so that only happens while a list isn't drawn.
+//  - for statics: roofs were toggled and it has roofs, or the ceiling moved
+//    across the z of its statics
+struct retained_sprite_t
 {
-    pixel_storage_t *ps = get_land_ps(tile_id);
-    // TODO: this null check shouldn't be necessary
-    if (ps)
+    asset_cache_t<int, pixel_storage_t>::entry_t *art;
+    int xs[4], ys[4];
+    int prio;
+    // for picking
+    int x, y, z, id;
+};
+
+struct block_draw_list_t
+{
+    retained_sprite_t *sprites;
+    int count;
+    int capacity;
+
+    bool built;
+    long block_serials[4];
+    bool missing_art;
+    int art_loads;     // of the art cache when built
+    int art_evictions; // of the art cache when last drawn
+    long last_drawn;
+    // bounds of the sprites, relative to the origin
+    int min_x, min_y, max_x, max_y;
+
+    // land only: sloped tiles with their texmap stretched over them. they are
+    // drawn from a mesh on the gpu, and kept here for picking and for keeping
+    // their texmaps in the cache.
+    retained_sprite_t *mesh_sprites;
+    int mesh_count;
+    int mesh_capacity;
+    gfx_mesh_t *mesh;
+    bool missing_texmaps;
+    int texmap_loads;
+    int texmap_evictions;
+
+    // statics only
+    bool has_roofs;
+    bool built_draw_roofs;
+    int built_ceiling;
+    int max_z;
+};
+
+static hash_table_t<block_draw_list_t> land_draw_lists;
+static hash_table_t<block_draw_list_t> statics_draw_lists;
+
+// lists not drawn for this many frames are thrown away
+const int draw_list_max_age = 256;
+
+// draw sloped land with texmaps, like the original client does. with this
+// off, all land is drawn with the rotated land art.
+static bool terrain_texmaps = true;
+
+// when enabled, only lists with sprites in this screen rect are submitted
+static struct
+{
+    bool enabled;
+    int x, y, width, height;
+} draw_list_clip;
+// only hit test the lists' sprites for picking, they're drawn already
+static bool draw_lists_pick_only = false;
+// only bring the lists up to date and keep their art cached, nothing is
+// drawn or picked
+static bool draw_lists_refresh_only = false;
+// every build of a block draw list that is (or was) on screen gets a new serial
+static long draw_list_build_serial = 0;
+
+static void block_origin(int block_x, int block_y, int *screen_x, int *screen_y, int *prio)
+{
+    world_to_screen(8 * block_x, 8 * block_y, 0, screen_x, screen_y);
+    *prio = world_draw_prio(8 * block_x, 8 * block_y, 0);
+}
+
+static void draw_list_begin(block_draw_list_t *list, asset_cache_t<int, pixel_storage_t> *art_cache)
+{
+    list->count = 0;
+    list->built = true;
+    list->missing_art = false;
+    list->art_loads = art_cache->loads;
+
+    list->mesh_count = 0;
+    if (list->mesh != NULL)
+    {
+        gfx_free_mesh(list->mesh);
+        list->mesh = NULL;
+    }
+    list->missing_texmaps = false;
+    list->texmap_loads = texmap_cache.loads;
+}
+
+static retained_sprite_t *sprite_array_add(retained_sprite_t **sprites, int *count, int *capacity)
+{
+    if (*count == *capacity)
+    {
+        *capacity = std::max(16, 2 * *capacity);
+        *sprites = (retained_sprite_t *)realloc(*sprites, *capacity * sizeof(retained_sprite_t));
+    }
+    return &(*sprites)[(*count)++];
+}
+
+static retained_sprite_t *draw_list_add(block_draw_list_t *list)
+{
+    return sprite_array_add(&list->sprites, &list->count, &list->capacity);
+}
+
+static retained_sprite_t *draw_list_add_mesh(block_draw_list_t *list)
+{
+    return sprite_array_add(&list->mesh_sprites, &list->mesh_count, &list->mesh_capacity);
+}
+
+static void draw_list_end(block_draw_list_t *list)
+{
+    list->min_x = list->min_y = INT_MAX;
+    list->max_x = list->max_y = INT_MIN;
+    for (int i = 0; i < list->count + list->mesh_count; i++)
+    {
+        retained_sprite_t *sprite = i < list->count ? &list->sprites[i] : &list->mesh_sprites[i - list->count];
+        for (int j = 0; j < 4; j++)
+        {
+            list->min_x = std::min(list->min_x, sprite->xs[j]);
+            list->min_y = std::min(list->min_y, sprite->ys[j]);
+            list->max_x = std::max(list->max_x, sprite->xs[j]);
+            list->max_y = std::max(list->max_y, sprite->ys[j]);
+        }
+    }
+
+    if (list->mesh_count > 0)
+    {
+        gfx_mesh_begin();
+        for (int i = 0; i < list->mesh_count; i++)
+        {
+            retained_sprite_t *sprite = &list->mesh_sprites[i];
+            gfx_mesh_add(&sprite->art->value, sprite->xs, sprite->ys, sprite->prio);
+        }
+        list->mesh = gfx_mesh_end();
+    }
+}
+
+static bool draw_list_clipped(block_draw_list_t *list, int block_x, int block_y)
+{
+    bool empty = list->count == 0 && list->mesh_count == 0;
+    if (!draw_list_clip.enabled || empty)
+    {
+        return empty;
+    }
+    int origin_x, origin_y, origin_prio;
+    block_origin(block_x, block_y, &origin_x, &origin_y, &origin_prio);
+    return origin_x + list->max_x <= draw_list_clip.x || origin_x + list->min_x >= draw_list_clip.x + draw_list_clip.width ||
+           origin_y + list->max_y <= draw_list_clip.y || origin_y + list->min_y >= draw_list_clip.y + draw_list_clip.height;
+}
+
+static bool draw_list_on_screen(block_draw_list_t *list, int block_x, int block_y)
+{
+    if (!list->built || (list->count == 0 && list->mesh_count == 0))
+    {
+        return false;
+    }
+    int origin_x, origin_y, origin_prio;
+    block_origin(block_x, block_y, &origin_x, &origin_y, &origin_prio);
+    return origin_x + list->max_x > 0 && origin_x + list->min_x < window_width &&
+           origin_y + list->max_y > 0 && origin_y + list->min_y < window_height;
+}
+
+static bool draw_list_art_valid(block_draw_list_t *list, asset_cache_t<int, pixel_storage_t> *art_cache)
+{
+    if (list->missing_art && art_cache->loads != list->art_loads)
+    {
+        return false;
+    }
+    if (list->last_drawn != frame_number - 1 && art_cache->evictions != list->art_evictions)
+    {
+        return false;
+    }
+    // the same for the texmaps of the mesh
+    if (list->missing_texmaps && texmap_cache.loads != list->texmap_loads)
+    {
+        return false;
+    }
+    if (list->mesh_count > 0 && list->last_drawn != frame_number - 1 && texmap_cache.evictions != list->texmap_evictions)
+    {
+        return false;
+    }
+    return true;
+}
+
+static void fill_draw_list_pick_slot(int pick_id, int pick_type, retained_sprite_t *sprite)
+{
+    pick_target_t *target = &pick_slots[pick_id];
+    target->type = pick_type;
+    if (pick_type == TYPE_LAND)
+    {
+        target->land.x = sprite->x;
+        target->land.y = sprite->y;
+        target->land.z = sprite->z;
+        target->land.tile_id = sprite->id;
+    }
+    else
+    {
+        target->static_item.x = sprite->x;
+        target->static_item.y = sprite->y;
+        target->static_item.z = sprite->z;
+        target->static_item.item_id = sprite->id;
+    }
+}
+
+static void submit_draw_list(block_draw_list_t *list, asset_cache_t<int, pixel_storage_t> *art_cache, int pick_type, int block_x, int block_y)
+{
+    for (int i = 0; i < list->count; i++)
+    {
+        art_cache->touch(list->sprites[i].art);
+    }
+    for (int i = 0; i < list->mesh_count; i++)
+    {
+        texmap_cache.touch(list->mesh_sprites[i].art);
+    }
+    list->last_drawn = frame_number;
+    list->art_evictions = art_cache->evictions;
+    list->texmap_evictions = texmap_cache.evictions;
+    if (draw_lists_refresh_only)
+    {
+        return;
+    }
+
+    int origin_x, origin_y, origin_prio;
+    block_origin(block_x, block_y, &origin_x, &origin_y, &origin_prio);
+    int first_pick_id = reserve_pick_ids(list->count + list->mesh_count);
+
+    for (int i = 0; i < list->count; i++)
+    {
+        retained_sprite_t *sprite = &list->sprites[i];
+
+        int xs[4], ys[4];
+        for (int j = 0; j < 4; j++)
+        {
+            xs[j] = origin_x + sprite->xs[j];
+            ys[j] = origin_y + sprite->ys[j];
+        }
+
+        int pick_id = -1;
+        if (first_pick_id != -1)
+        {
+            pick_id = first_pick_id + i;
+            fill_draw_list_pick_slot(pick_id, pick_type, sprite);
+        }
+
+        if (draw_lists_pick_only)
+        {
+            gfx_pick_sprite(&sprite->art->value, xs, ys, origin_prio + sprite->prio, pick_id);
+        }
+        else
+        {
+            gfx_render(&sprite->art->value, xs, ys, origin_prio + sprite->prio, 0, pick_id);
+        }
+    }
+
+    if (list->mesh != NULL && !draw_lists_pick_only)
+    {
+        gfx_render_mesh(list->mesh, origin_x, origin_y, origin_prio);
+    }
+    // the mesh isn't picked by gfx, so its tiles are hit tested here when the point is near
+    if (first_pick_id != -1 && list->mesh_count > 0 &&
+        gfx_picking_inside(origin_x + list->min_x, origin_y + list->min_y, list->max_x - list->min_x, list->max_y - list->min_y))
+    {
+        for (int i = 0; i < list->mesh_count; i++)
+        {
+            retained_sprite_t *sprite = &list->mesh_sprites[i];
+            int xs[4], ys[4];
+            for (int j = 0; j < 4; j++)
+            {
+                xs[j] = origin_x + sprite->xs[j];
+                ys[j] = origin_y + sprite->ys[j];
+            }
+            int pick_id = first_pick_id + list->count + i;
+            fill_draw_list_pick_slot(pick_id, pick_type, sprite);
+            gfx_pick_sprite(&sprite->art->value, xs, ys, origin_prio + sprite->prio, pick_id);
+        }
+    }
+}
+
+void draw_lists_init()
+{
+    land_draw_lists.init(256);
+    statics_draw_lists.init(256);
+}
+
+static void free_old_draw_lists(hash_table_t<block_draw_list_t> *lists)
+{
+    static std::vector<uint64_t> old_keys;
+    old_keys.clear();
+    for (int i = 0; i < lists->capacity; i++)
+    {
+        if (lists->slots[i].used && lists->slots[i].value.last_drawn < frame_number - draw_list_max_age)
+        {
+            free(lists->slots[i].value.sprites);
+            free(lists->slots[i].value.mesh_sprites);
+            if (lists->slots[i].value.mesh != NULL)
+            {
+                gfx_free_mesh(lists->slots[i].value.mesh);
+            }
+            old_keys.push_back(lists->slots[i].key);
+        }
+    }
+    for (int i = 0; i < (int)old_keys.size(); i++)
+    {
+        lists->remove(old_keys[i]);
+    }
+}
+
+static long land_block_serial(int map, int block_x, int block_y)
+{
+    land_block_t *lb = get_land_block(map, block_x, block_y);
+    return lb ? lb->serial : 0;
+}
+
+static void build_land_draw_list(block_draw_list_t *list, land_block_t *lb, int block_x, int block_y)
+{
+    draw_list_begin(list, &land_cache);
+
+    int origin_x, origin_y, origin_prio;
+    block_origin(block_x, block_y, &origin_x, &origin_y, &origin_prio);
+
+    for (int dy = 0; dy < 8; dy++)
+    for (int dx = 0; dx < 8; dx++)
     {
-        draw_world_land_ps(ps, x, y, pick_id);
+        int tile_id = lb->tiles[dx + dy * 8].tile_id;
+        int z = lb->tiles[dx + dy * 8].z;
+
+        int x = 8 * block_x + dx;
+        int y = 8 * block_y + dy;
+
+        int xs[4], ys[4];
+        bool flat;
+        int prio = land_quad(x, y, xs, ys, &flat);
+
+        // sloped tiles get their texmap stretched over them, if they have one.
+        // the rotated land art stands in while it's loading.
+        asset_cache_t<int, pixel_storage_t>::entry_t *texmap = NULL;
+        int texture_id = ml_get_tile_data(tile_id)->texture;
+        if (!flat && terrain_texmaps && texture_id != 0)
+        {
+            texmap = get_texmap_entry(texture_id);
+            if (texmap->state == ASSET_FETCHING)
+            {
+                list->missing_texmaps = true;
+                texmap = NULL;
+            }
+            else if (texmap->value.width == 0)
+            {
+                texmap = NULL;
+            }
+        }
+
+        retained_sprite_t *sprite;
+        if (texmap != NULL)
+        {
+            sprite = draw_list_add_mesh(list);
+            sprite->art = texmap;
+        }
+        else
+        {
+            asset_cache_t<int, pixel_storage_t>::entry_t *art = get_land_art_entry(tile_id);
+            if (art->state == ASSET_FETCHING)
+            {
+                list->missing_art = true;
+                continue;
+            }
+            sprite = draw_list_add(list);
+            sprite->art = art;
+        }
+
+        sprite->prio = prio - origin_prio;
+        for (int i = 0; i < 4; i++)
+        {
+            sprite->xs[i] = xs[i] - origin_x;
+            sprite->ys[i] = ys[i] - origin_y;
+        }
+        sprite->x = x;
+        sprite->y = y;
+        sprite->z = z;
+        sprite->id = tile_id;
     }
+    draw_list_end(list);
 }
 
 void draw_world_land_block(int map, int block_x, int block_y)
@@ -991,16 +1833,31 @@ void draw_world_land_block(int map, int block_x, int block_y)
     // TODO: this null check shouldn't be necessary
     if (lb)
     {
-        for (int dy = 0; dy < 8; dy++)
-        for (int dx = 0; dx < 8; dx++)
+        // the tiles' corners come from the blocks to the east and south too
+        long serials[4] =
         {
-            int tile_id = lb->tiles[dx + dy * 8].tile_id;
-            int z = lb->tiles[dx + dy * 8].z;
-
-            int x = 8 * block_x + dx;
-            int y = 8 * block_y + dy;
-            int pick_id = pick_land(x, y, z, tile_id);
-            draw_world_land(tile_id, x, y, pick_id);
+            lb->serial,
+            land_block_serial(map, block_x + 1, block_y),
+            land_block_serial(map, block_x, block_y + 1),
+            land_block_serial(map, block_x + 1, block_y + 1),
+        };
+
+        block_draw_list_t *list = land_draw_lists.insert(block_key(map, block_x, block_y));
+        bool valid = list->built && draw_list_art_valid(list, &land_cache) &&
+                     memcmp(serials, list->block_serials, sizeof(serials)) == 0;
+        if (!valid)
+        {
+            bool was_on_screen = draw_list_on_screen(list, block_x, block_y);
+            build_land_draw_list(list, lb, block_x, block_y);
+            memcpy(list->block_serials, serials, sizeof(serials));
+            if (was_on_screen || draw_list_on_screen(list, block_x, block_y))
+            {
+                draw_list_build_serial += 1;
+            }
+        }
+        if (!draw_list_clipped(list, block_x, block_y))
+        {
+            submit_draw_list(list, &land_cache, TYPE_LAND, block_x, block_y);
         }
     }
 }
@@ -1028,16 +1885,19 @@ void draw_world_item(int item_id, int x, int y, int z, int hue_id, int pick_id)
     }
 }
 
+// animations only come in 5 directions, the others are drawn mirrored
+static int anim_direction(int direction, bool *flip)
+{
+    direction = (direction + 5) % 8;
+    *flip = direction >= 5;
+    return *flip ? 8 - direction : direction;
+}
+
 void draw_world_anim(int body_id, int action, long action_start, int direction, int x, int y, int z, int layer_prio, int hue_id, int pick_id)
 {
     int frame_count;
-    bool flip = false;
-    direction = (direction + 5) % 8;
-    if (direction >= 5)
-    {
-        direction = 8 - direction;
-        flip = true;
-    }
+    bool flip;
+    direction = anim_direction(direction, &flip);
     anim_frame_t *frames = get_anim_frames(body_id, action, direction, &frame_count);
     // TODO: this null check shouldn't be necessary
     if (frames)
@@ -1046,6 +1906,58 @@ void draw_world_anim(int body_id, int action, long action_start, int direction,
     }
 }
 
+// draw humans as one sprite per frame, with their equipment baked in, instead
+// of one sprite per equipped layer
+static bool compose_mobiles = false;
+
+static void mobile_composition(mobile_t *mobile, int action, int direction, ml_anim_composition *composition)
+{
+    // in the same order draw_world_mobile draws the layers, so that it doesn't
+    // matter which of the two draws a mobile
+    memset(composition, 0, sizeof(*composition));
+    composition->action = action;
+    composition->direction = direction;
+    composition->layers[0].body_id = mobile->body_id;
+    composition->layers[0].hue_id = mobile->hue_id;
+    composition->layer_count = 1;
+    for (int i = 0; i < 32; i++)
+    {
+        item_t *item = mobile->equipped_items[layer_draw_order[i]];
+        if (item != NULL)
+        {
+            int animation = ml_get_item_data(item->item_id)->animation;
+            if (animation != 0)
+            {
+                composition->layers[composition->layer_count].body_id = animation;
+                composition->layers[composition->layer_count].hue_id = item->hue_id;
+                composition->layer_count += 1;
+            }
+        }
+    }
+}
+
+// draws the mobile's composed animation, false if it isn't ready yet
+static bool draw_world_composed_mobile(mobile_t *mobile, int action, long action_start, int pick_id)
+{
+    bool flip;
+    int direction = anim_direction(mobile->dir, &flip);
+
+    ml_anim_composition composition;
+    mobile_composition(mobile, action, direction, &composition);
+
+    int frame_count;
+    anim_frame_t *frames = get_composed_anim_frames(&composition, &frame_count);
+    if (frames == NULL)
+    {
+        return false;
+    }
+    if (frame_count > 0)
+    {
+        draw_world_anim_frame(&frames[((now-action_start) / 200) % frame_count], flip, mobile->x, mobile->y, mobile->z, 0, 0, pick_id);
+    }
+    return true;
+}
+
 bool body_is_animal(int body_id)
 {
     return body_id >= 200 && body_id < 400;
@@ -1061,102 +1973,536 @@ bool body_is_human(int body_id)
     return body_id == 400 || body_id == 401;
 }
 
-void draw_world_mobile(mobile_t *mobile, int pick_id)
+static void mobile_actions(mobile_t *mobile, int *walk_action_id, int *run_action_id, int *stand_action_id)
+{
+    if (body_is_monster(mobile->body_id))
+    {
+        *walk_action_id = 0;
+        *run_action_id = 0; // dragon's fly animation seems to be action 19?
+        *stand_action_id = 1;
+    }
+    else if (body_is_animal(mobile->body_id))
+    {
+        *walk_action_id = 0;
+        *run_action_id = 1;
+        *stand_action_id = 2;
+    }
+    else // human?
+    {
+        *walk_action_id = (mobile->flags & MOBFLAG_WARMODE) ? 15 : 0;
+        *run_action_id = 2;
+        *stand_action_id = (mobile->flags & MOBFLAG_WARMODE) ? 7 : 4;
+    }
+}
+
+void draw_world_mobile(mobile_t *mobile, int pick_id)
+{
+    int action_id = mobile->anim_action_id;
+    long action_start = 0;
+
+    int frame_duration = 200;
+    if (mobile->anim_start + frame_duration*mobile->anim_total_frames < now)
+    {
+
+        mobile->anim_start = -1;
+    }
+    else
+    {
+        action_start = mobile->anim_start;
+    }
+
+    int walk_action_id;
+    int run_action_id;
+    int stand_action_id;
+    mobile_actions(mobile, &walk_action_id, &run_action_id, &stand_action_id);
+
+    // no animation? do stand animation...
+    if (mobile->anim_start == -1)
+    {
+        action_id = stand_action_id;
+    }
+    // mobiles' walk animation override current animation
+    if (now - mobile->last_movement <= 500)
+    {
+        action_id = walk_action_id;
+    }
+
+    if (compose_mobiles && body_is_human(mobile->body_id) &&
+        draw_world_composed_mobile(mobile, action_id, action_start, pick_id))
+    {
+        return;
+    }
+
+    draw_world_anim(mobile->body_id, action_id, action_start, mobile->dir, mobile->x, mobile->y, mobile->z, 0, mobile->hue_id, pick_id);
+    if (body_is_human(mobile->body_id))
+    {
+        for (int i = 0; i < 32; i++)
+        {
+            int layer = layer_draw_order[i];
+            item_t *item = mobile->equipped_items[layer];
+            if (item != NULL)
+            {
+                int item_id = item->item_id;
+                int hue_id = item->hue_id;
+                ml_item_data_entry *item_data = ml_get_item_data(item_id);
+                if (item_data->animation != 0)
+                {
+                    //printf("drawing anim for item_id %d (%s)\n", item_id, item_data->name);
+                    draw_world_anim(item_data->animation, action_id, action_start, mobile->dir, mobile->x, mobile->y, mobile->z, i, hue_id, pick_id);
+                }
+            }
+        }
+    }
+}
+
+static void begin_prefetch()
+{
+    mlt_begin_prefetch();
+    prefetching = true;
+}
+
+static void end_prefetch()
+{
+    prefetching = false;
+    mlt_end_prefetch();
+}
+
+// the game_prefetch_* functions are called as soon as the server tells us
+// about something that will be drawn, so that its assets are already loaded
+// (or at least on their way) by the time it first is. the requests go to
+// the back of the loader's queue, behind everything needed right now, and
+// are requested again if they're still waiting there when they are needed.
+void game_prefetch_mobile(mobile_t *m)
+{
+    int walk_action_id, run_action_id, stand_action_id;
+    mobile_actions(m, &walk_action_id, &run_action_id, &stand_action_id);
+    bool flip;
+    int direction = anim_direction(m->dir, &flip);
+    int actions[2] = { stand_action_id, walk_action_id };
+
+    begin_prefetch();
+    int frame_count;
+    for (int i = 0; i < 2; i++)
+    {
+        if (compose_mobiles && body_is_human(m->body_id))
+        {
+            ml_anim_composition composition;
+            mobile_composition(m, actions[i], direction, &composition);
+            get_composed_anim_frames(&composition, &frame_count);
+            continue;
+        }
+
+        get_anim_frames(m->body_id, actions[i], direction, &frame_count);
+        if (body_is_human(m->body_id))
+        {
+            for (int layer = 0; layer < 32; layer++)
+            {
+                item_t *item = m->equipped_items[layer];
+                if (item != NULL && ml_get_item_data(item->item_id)->animation != 0)
+                {
+                    get_anim_frames(ml_get_item_data(item->item_id)->animation, actions[i], direction, &frame_count);
+                }
+            }
+        }
+    }
+    end_prefetch();
+}
+
+void game_prefetch_item(int item_id)
+{
+    begin_prefetch();
+    get_static_art_entry(item_id);
+    end_prefetch();
+}
+
+void game_prefetch_gump(int gump_id)
+{
+    begin_prefetch();
+    get_gump_ps(gump_id);
+    end_prefetch();
+}
+
+void game_prefetch_generic_gump(gump_t *gump)
+{
+    begin_prefetch();
+    std::list<gump_widget_t> *widgets = gump->generic.widgets;
+    for (std::list<gump_widget_t>::iterator it = widgets->begin(); it != widgets->end(); ++it)
+    {
+        gump_widget_t *widget = &*it;
+        if (widget->type == GUMPWTYPE_PIC)
+        {
+            get_gump_ps(widget->pic.gump_id);
+        }
+        else if (widget->type == GUMPWTYPE_PICTILED)
+        {
+            get_gump_ps(widget->pictiled.gump_id);
+        }
+        else if (widget->type == GUMPWTYPE_RESIZEPIC)
+        {
+            for (int i = 0; i < 9; i++)
+            {
+                get_gump_ps(widget->resizepic.gump_id_base + i);
+            }
+        }
+        else if (widget->type == GUMPWTYPE_BUTTON)
+        {
+            get_gump_ps(widget->button.up_gump_id);
+            get_gump_ps(widget->button.down_gump_id);
+        }
+        else if (widget->type == GUMPWTYPE_ITEM)
+        {
+            get_static_art_entry(widget->item.item_id);
+        }
+    }
+    end_prefetch();
+}
+
+static void build_statics_draw_list(block_draw_list_t *list, statics_block_t *sb, int block_x, int block_y)
+{
+    draw_list_begin(list, &static_cache);
+    list->block_serials[0] = sb->serial;
+    list->has_roofs = false;
+    list->built_draw_roofs = draw_roofs;
+    list->built_ceiling = draw_ceiling;
+    list->max_z = -128;
+
+    int origin_x, origin_y, origin_prio;
+    block_origin(block_x, block_y, &origin_x, &origin_y, &origin_prio);
+
+    for (int i = 0; i < sb->statics_count; i++)
+    {
+        int item_id = sb->statics[i].item_id;
+        int dx = sb->statics[i].dx;
+        int dy = sb->statics[i].dy;
+        int z  = sb->statics[i].z;
+
+        list->max_z = std::max(list->max_z, z);
+
+        // conditionally skip roofs
+        ml_item_data_entry *item_data = ml_get_item_data(item_id);
+        if (item_data->flags & TILEFLAG_ROOF)
+        {
+            list->has_roofs = true;
+            if (!draw_roofs)
+            {
+                continue;
+            }
+        }
+        if (z >= draw_ceiling)
+        {
+            continue;
+        }
+
+        asset_cache_t<int, pixel_storage_t>::entry_t *art = get_static_art_entry(item_id);
+        if (art->state == ASSET_FETCHING)
+        {
+            list->missing_art = true;
+            continue;
+        }
+
+        int x = 8 * block_x + dx;
+        int y = 8 * block_y + dy;
+        bool is_foliage = (item_data->flags & TILEFLAG_FOLIAGE) != 0;
+
+        pixel_storage_t *ps = &art->value;
+        int screen_x, screen_y;
+        int prio = art_position(ps, x, y, z, is_foliage ? 32 : 0, &screen_x, &screen_y);
+        screen_x -= origin_x;
+        screen_y -= origin_y;
+
+        // same quad as blit_ps
+        retained_sprite_t *sprite = draw_list_add(list);
+        sprite->art = art;
+        sprite->xs[0] = screen_x;             sprite->ys[0] = screen_y;
+        sprite->xs[1] = screen_x + ps->width; sprite->ys[1] = screen_y;
+        sprite->xs[2] = screen_x + ps->width; sprite->ys[2] = screen_y + ps->height;
+        sprite->xs[3] = screen_x;             sprite->ys[3] = screen_y + ps->height;
+        sprite->prio = prio - origin_prio;
+        sprite->x = x;
+        sprite->y = y;
+        sprite->z = z;
+        sprite->id = item_id;
+    }
+    draw_list_end(list);
+}
+
+void draw_world_statics_block(int map, int block_x, int block_y)
+{
+    statics_block_t *sb = get_statics_block(map, block_x, block_y);
+
+    // TODO: this null check shouldn't be necessary
+    if (sb)
+    {
+        block_draw_list_t *list = statics_draw_lists.insert(block_key(map, block_x, block_y));
+        bool valid = list->built && draw_list_art_valid(list, &static_cache) &&
+                     list->block_serials[0] == sb->serial;
+        if (valid && list->has_roofs && list->built_draw_roofs != draw_roofs)
+        {
+            valid = false;
+        }
+        // a ceiling above every static hides none of them, wherever it is exactly
+        if (valid && list->built_ceiling != draw_ceiling &&
+            !(list->built_ceiling > list->max_z && draw_ceiling > list->max_z))
+        {
+            valid = false;
+        }
+        if (!valid)
+        {
+            bool was_on_screen = draw_list_on_screen(list, block_x, block_y);
+            build_statics_draw_list(list, sb, block_x, block_y);
+            if (was_on_screen || draw_list_on_screen(list, block_x, block_y))
+            {
+                draw_list_build_serial += 1;
+            }
+        }
+        if (!draw_list_clipped(list, block_x, block_y))
+        {
+            submit_draw_list(list, &static_cache, TYPE_STATIC, block_x, block_y);
+        }
+    }
+}
+
+// uniform grid over the world, one cell per map block, holding the items,
+// mobiles and multis placed in the world. drawing only looks at the cells
+// in view instead of every object the server has told us about.
+struct grid_cell_t
+{
+    item_t *items;
+    mobile_t *mobiles;
+    multi_t *multis;
+};
+
+hash_table_t<grid_cell_t> world_grid;
+
+// multis are filed under the cell of their origin, but their components
+// can reach this many blocks away from it
+const int multi_grid_margin = 4;
+
+// objects further away from the player than this are dropped, the server
+// won't send us updates (or deletes) for them anymore
+int update_range = 18;
+
+static uint64_t grid_key(int x, int y)
+{
+    return ((uint64_t)(uint32_t)(x / 8) << 32) | (uint32_t)(y / 8);
+}
+
+static grid_cell_t *grid_cell_at_block(int block_x, int block_y)
+{
+    return world_grid.find(((uint64_t)(uint32_t)block_x << 32) | (uint32_t)block_y);
+}
+
+static void grid_remove_if_empty(uint64_t key, grid_cell_t *cell)
+{
+    if (cell->items == NULL && cell->mobiles == NULL && cell->multis == NULL)
+    {
+        world_grid.remove(key);
+    }
+}
+
+static void grid_unlink_item(item_t *item)
+{
+    assert(item->space == SPACETYPE_WORLD);
+    uint64_t key = grid_key(item->loc.world.x, item->loc.world.y);
+    grid_cell_t *cell = world_grid.find(key);
+    assert(cell != NULL);
+    item_t *prev = item->loc.world.grid_prev;
+    item_t *next = item->loc.world.grid_next;
+    if (prev != NULL) prev->loc.world.grid_next = next;
+    else cell->items = next;
+    if (next != NULL) next->loc.world.grid_prev = prev;
+    grid_remove_if_empty(key, cell);
+}
+
+static void grid_unlink_mobile(mobile_t *m)
+{
+    assert(m->in_grid);
+    uint64_t key = grid_key(m->x, m->y);
+    grid_cell_t *cell = world_grid.find(key);
+    assert(cell != NULL);
+    if (m->grid_prev != NULL) m->grid_prev->grid_next = m->grid_next;
+    else cell->mobiles = m->grid_next;
+    if (m->grid_next != NULL) m->grid_next->grid_prev = m->grid_prev;
+    m->in_grid = false;
+    grid_remove_if_empty(key, cell);
+}
+
+static void grid_unlink_multi(multi_t *multi)
 {
-    int action_id = mobile->anim_action_id;
-    long action_start = 0;
+    assert(multi->in_grid);
+    uint64_t key = grid_key(multi->x, multi->y);
+    grid_cell_t *cell = world_grid.find(key);
+    assert(cell != NULL);
+    if (multi->grid_prev != NULL) multi->grid_prev->grid_next = multi->grid_next;
+    else cell->multis = multi->grid_next;
+    if (multi->grid_next != NULL) multi->grid_next->grid_prev = multi->grid_prev;
+    multi->in_grid = false;
+    grid_remove_if_empty(key, cell);
+}
 
-    int frame_duration = 200;
-    if (mobile->anim_start + frame_duration*mobile->anim_total_frames < now)
+// takes the item out of whatever list its current space keeps it in
+static void container_unlink(item_t *item);
+static void item_unlink(item_t *item)
+{
+    if (item->space == SPACETYPE_WORLD)
     {
-
-        mobile->anim_start = -1;
+        grid_unlink_item(item);
     }
-    else
+    else if (item->space == SPACETYPE_CONTAINER && item->loc.container.container != NULL)
     {
-        action_start = mobile->anim_start;
+        container_unlink(item);
     }
+}
 
-    int walk_action_id;
-    int run_action_id;
-    int stand_action_id;
+void game_place_item(item_t *item, int x, int y, int z)
+{
+    item_unlink(item);
+
+    item->space = SPACETYPE_WORLD;
+    item->loc.world.x = x;
+    item->loc.world.y = y;
+    item->loc.world.z = z;
+
+    grid_cell_t *cell = world_grid.insert(grid_key(x, y));
+    item->loc.world.grid_prev = NULL;
+    item->loc.world.grid_next = cell->items;
+    if (cell->items != NULL) cell->items->loc.world.grid_prev = item;
+    cell->items = item;
+}
 
-    if (body_is_monster(mobile->body_id))
+static void facet_switch_player_placed();
+void game_place_mobile(mobile_t *m, int x, int y, int z)
+{
+    // the player is drawn on its own and never goes into the grid
+    if (m != &player && m->in_grid)
     {
-        walk_action_id = 0;
-        run_action_id = 0; // dragon's fly animation seems to be action 19?
-        stand_action_id = 1;
+        grid_unlink_mobile(m);
     }
-    else if (body_is_animal(mobile->body_id))
+
+    m->x = x;
+    m->y = y;
+    m->z = z;
+
+    if (m != &player)
     {
-        walk_action_id = 0;
-        run_action_id = 1;
-        stand_action_id = 2;
+        grid_cell_t *cell = world_grid.insert(grid_key(x, y));
+        m->grid_prev = NULL;
+        m->grid_next = cell->mobiles;
+        if (cell->mobiles != NULL) cell->mobiles->grid_prev = m;
+        cell->mobiles = m;
+        m->in_grid = true;
     }
-    else // human?
+    else
     {
-        walk_action_id = (mobile->flags & MOBFLAG_WARMODE) ? 15 : 0;
-        run_action_id = 2;
-        stand_action_id = (mobile->flags & MOBFLAG_WARMODE) ? 7 : 4;
+        facet_switch_player_placed();
     }
+}
 
-    // no animation? do stand animation...
-    if (mobile->anim_start == -1)
+void game_place_multi(multi_t *multi, int x, int y, int z)
+{
+    if (multi->in_grid)
     {
-        action_id = stand_action_id;
+        grid_unlink_multi(multi);
     }
-    // mobiles' walk animation override current animation
-    if (now - mobile->last_movement <= 500)
+
+    multi->x = x;
+    multi->y = y;
+    multi->z = z;
+
+    grid_cell_t *cell = world_grid.insert(grid_key(x, y));
+    multi->grid_prev = NULL;
+    multi->grid_next = cell->multis;
+    if (cell->multis != NULL) cell->multis->grid_prev = multi;
+    cell->multis = multi;
+    multi->in_grid = true;
+}
+
+void game_objects_init()
+{
+    items.init(4096);
+    multis.init(256);
+    mobiles.init(1024);
+    item_pool.init(256);
+    multi_pool.init(64);
+    mobile_pool.init(256);
+    world_grid.init(1024);
+}
+
+void game_set_update_range(int range)
+{
+    update_range = range;
+}
+
+static bool is_in_update_range(int x, int y)
+{
+    return abs(x - player.x) <= update_range && abs(y - player.y) <= update_range;
+}
+
+void game_delete_item(item_t *item);
+void game_delete_gump(gump_t *gump);
+static void free_gump_draw_list(gump_t *gump);
+void game_delete_mobile(mobile_t *mobile);
+
+// drops the items and mobiles the server has stopped telling us about.
+// only looks at the grid again once the player has moved to another
+// block or the update range changed.
+void drop_out_of_range_objects()
+{
+    static int last_block_x = -1, last_block_y = -1, last_range = -1;
+    if (player.x / 8 == last_block_x && player.y / 8 == last_block_y && update_range == last_range)
     {
-        action_id = walk_action_id;
+        return;
     }
+    last_block_x = player.x / 8;
+    last_block_y = player.y / 8;
+    last_range = update_range;
 
-    draw_world_anim(mobile->body_id, action_id, action_start, mobile->dir, mobile->x, mobile->y, mobile->z, 0, mobile->hue_id, pick_id);
-    if (body_is_human(mobile->body_id))
+    // can't remove from the grid while walking over it, collect first
+    static std::vector<item_t *> drop_items;
+    static std::vector<mobile_t *> drop_mobiles;
+    drop_items.clear();
+    drop_mobiles.clear();
+
+    int range_blocks = update_range / 8 + 1;
+    for (int i = 0; i < world_grid.capacity; i++)
     {
-        for (int i = 0; i < 32; i++)
+        if (!world_grid.slots[i].used) continue;
+        int block_x = (int)(world_grid.slots[i].key >> 32);
+        int block_y = (int)(uint32_t)world_grid.slots[i].key;
+        // cells well inside the range can be skipped without looking at their contents
+        if (abs(block_x - last_block_x) < range_blocks - 1 && abs(block_y - last_block_y) < range_blocks - 1)
         {
-            int layer = layer_draw_order[i];
-            item_t *item = mobile->equipped_items[layer];
-            if (item != NULL)
+            continue;
+        }
+        grid_cell_t *cell = &world_grid.slots[i].value;
+        for (item_t *item = cell->items; item != NULL; item = item->loc.world.grid_next)
+        {
+            if (!is_in_update_range(item->loc.world.x, item->loc.world.y))
             {
-                int item_id = item->item_id;
-                int hue_id = item->hue_id;
-                ml_item_data_entry *item_data = ml_get_item_data(item_id);
-                if (item_data->animation != 0)
-                {
-                    //printf("drawing anim for item_id %d (%s)\n", item_id, item_data->name);
-                    draw_world_anim(item_data->animation, action_id, action_start, mobile->dir, mobile->x, mobile->y, mobile->z, i, hue_id, pick_id);
-                }
+                drop_items.push_back(item);
             }
         }
-    }
-}
-
-void draw_world_statics_block(int map, int block_x, int block_y)
-{
-    statics_block_t *sb = get_statics_block(map, block_x, block_y);
-
-    // TODO: this null check shouldn't be necessary
-    if (sb)
-    {
-        for (int i = 0; i < sb->statics_count; i++)
+        for (mobile_t *m = cell->mobiles; m != NULL; m = m->grid_next)
         {
-            int item_id = sb->statics[i].item_id;
-            int dx = sb->statics[i].dx;
-            int dy = sb->statics[i].dy;
-            int z  = sb->statics[i].z;
-
-            // conditionally skip roofs
-            if ((ml_get_item_data(item_id)->flags & TILEFLAG_ROOF) && !draw_roofs)
+            if (!is_in_update_range(m->x, m->y))
             {
-                continue;
+                drop_mobiles.push_back(m);
             }
+        }
+    }
 
-            int x = 8 * block_x + dx;
-            int y = 8 * block_y + dy;
-            draw_world_item(item_id, x, y, z, 0, pick_static(x, y, z, item_id));
+    for (int i = 0; i < (int)drop_items.size(); i++)
+    {
+        item_t *item = drop_items[i];
+        if (item->container_gump != NULL)
+        {
+            game_delete_gump(item->container_gump);
         }
+        game_delete_item(item);
+    }
+    for (int i = 0; i < (int)drop_mobiles.size(); i++)
+    {
+        game_delete_mobile(drop_mobiles[i]);
     }
 }
 
@@ -1174,6 +2520,7 @@ uint32_t game_get_player_serial()
 void game_equip(mobile_t *m, uint32_t serial, int item_id, int layer, int hue_id)
 {
     item_t *item = game_get_item(serial);
+    item_unlink(item);
     item->item_id = item_id;
     item->hue_id = hue_id;
     item->loc.equipped.mobile = m;
@@ -1190,38 +2537,29 @@ void game_equip(mobile_t *m, uint32_t serial, int item_id, int layer, int hue_id
 
 item_t *game_get_item(uint32_t serial)
 {
-    std::map<int, item_t *>::iterator it = items.find(serial);
-    if (it != items.end())
-    {
-        return it->second;
-    }
-    else
+    bool existed;
+    item_t **slot = items.insert(serial, &existed);
+    if (!existed)
     {
-        assert(it == items.end());
-        item_t *i = (item_t *)malloc(sizeof(item_t));
-        memset(i, 0, sizeof(*i));
+        item_t *i = item_pool.alloc();
         i->serial = serial;
-        items[serial] = i;
-        return i;
+        i->space = SPACETYPE_NONE;
+        *slot = i;
     }
+    return *slot;
 }
 
 multi_t *game_get_multi(uint32_t serial)
 {
-    std::map<int, multi_t *>::iterator it = multis.find(serial);
-    if (it != multis.end())
-    {
-        return it->second;
-    }
-    else
+    bool existed;
+    multi_t **slot = multis.insert(serial, &existed);
+    if (!existed)
     {
-        assert(it == multis.end());
-        multi_t *m = (multi_t *)malloc(sizeof(multi_t));
-        memset(m, 0, sizeof(*m));
+        multi_t *m = multi_pool.alloc();
         m->serial = serial;
-        multis[serial] = m;
-        return m;
+        *slot = m;
     }
+    return *slot;
 }
 
 mobile_t *game_get_mobile(uint32_t serial)
@@ -1232,9 +2570,9 @@ mobile_t *game_get_mobile(uint32_t serial)
     }
     else
     {
-        std::map<int, mobile_t *>::iterator it = mobiles.find(serial);
-        assert(it != mobiles.end());
-        return it->second;
+        mobile_t **m = mobiles.find(serial);
+        assert(m != NULL);
+        return *m;
     }
 }
 
@@ -1248,21 +2586,60 @@ mobile_t *game_create_mobile(uint32_t serial)
     }
     else
     {
-        std::map<int, mobile_t *>::iterator it = mobiles.find(serial);
-        if (it != mobiles.end())
+        mobile_t **existing = mobiles.find(serial);
+        if (existing != NULL)
         {
-            return it->second;
+            return *existing;
         }
     }
 
-    mobile_t *m = (mobile_t *)malloc(sizeof(mobile_t));
-    memset(m, 0, sizeof(*m));
+    mobile_t *m = mobile_pool.alloc();
     m->serial = serial;
     m->anim_start = -1;
-    mobiles[serial] = m;
+    *mobiles.insert(serial) = m;
     return m;
 }
 
+static void container_unlink(item_t *item)
+{
+    assert(item->space == SPACETYPE_CONTAINER);
+    gump_t *container = item->loc.container.container;
+    item_t *prev = item->loc.container.prev;
+    item_t *next = item->loc.container.next;
+    if (prev != NULL) prev->loc.container.next = next;
+    else container->container.first_item = next;
+    if (next != NULL) next->loc.container.prev = prev;
+    else container->container.last_item = prev;
+    container->container.item_count -= 1;
+    item->loc.container.prev = NULL;
+    item->loc.container.next = NULL;
+}
+
+// puts item at the end of the container's item list, moving it there
+// if it already is in a container
+void game_container_add(gump_t *container, item_t *item, int x, int y)
+{
+    assert(container->type == GUMPTYPE_CONTAINER);
+    item_unlink(item);
+
+    item->space = SPACETYPE_CONTAINER;
+    item->loc.container.container = container;
+    item->loc.container.x = x;
+    item->loc.container.y = y;
+    item->loc.container.prev = container->container.last_item;
+    item->loc.container.next = NULL;
+    if (container->container.last_item != NULL)
+    {
+        container->container.last_item->loc.container.next = item;
+    }
+    else
+    {
+        container->container.first_item = item;
+    }
+    container->container.last_item = item;
+    container->container.item_count += 1;
+}
+
 // the three functions:
 //  game_delete_mobile
 //  game_delete_item
@@ -1271,8 +2648,6 @@ mobile_t *game_create_mobile(uint32_t serial)
 // and cooperate to clean up all traces of objects and their children
 // this cleaning up including removing objects from the global lists and
 // freeing any dynamically allocated objects
-void game_delete_item(item_t *item);
-void game_delete_gump(gump_t *gump);
 void game_delete_mobile(mobile_t *mobile)
 {
     for (int i = 0; i < 32; i++)
@@ -1296,25 +2671,32 @@ void game_delete_mobile(mobile_t *mobile)
         mobile->paperdoll_gump = NULL;
     }
 
-    std::map<int, mobile_t *>::iterator it = mobiles.find(mobile->serial);
-    assert(it != mobiles.end());
-    assert(it->second == mobile);
-    mobiles.erase(it);
+    if (mobile->in_grid)
+    {
+        grid_unlink_mobile(mobile);
+    }
 
-    free(mobile);
+    assert(mobiles.find(mobile->serial) != NULL && *mobiles.find(mobile->serial) == mobile);
+    mobiles.remove(mobile->serial);
+
+    mobile_pool.free(mobile);
 }
 
 void game_delete_item(item_t *item)
 {
     // TODO: fix these things:
     // 1. if item is container, delete any gumps and items inside container
-    assert(item->space == SPACETYPE_WORLD || item->space == SPACETYPE_CONTAINER || item->space == SPACETYPE_EQUIPPED);
+    assert(item->space == SPACETYPE_WORLD || item->space == SPACETYPE_CONTAINER || item->space == SPACETYPE_EQUIPPED || item->space == SPACETYPE_NONE);
     assert(item->container_gump == NULL);
 
-    if (item->space == SPACETYPE_CONTAINER)
+    if (item->space == SPACETYPE_WORLD)
+    {
+        grid_unlink_item(item);
+    }
+    else if (item->space == SPACETYPE_CONTAINER)
     {
         assert(item->loc.container.container->type == GUMPTYPE_CONTAINER);
-        item->loc.container.container->container.items->remove(item);
+        container_unlink(item);
     }
     else if (item->space == SPACETYPE_EQUIPPED)
     {
@@ -1334,12 +2716,10 @@ void game_delete_item(item_t *item)
         assert(found);
     }
 
-    std::map<int, item_t *>::iterator it = items.find(item->serial);
-    assert(it != items.end());
-    assert(it->second == item);
-    items.erase(it);
+    assert(items.find(item->serial) != NULL && *items.find(item->serial) == item);
+    items.remove(item->serial);
 
-    free(item);
+    item_pool.free(item);
 }
 
 void game_delete_gump(gump_t *gump)
@@ -1347,13 +2727,11 @@ void game_delete_gump(gump_t *gump)
     if (gump->type == GUMPTYPE_CONTAINER)
     {
         // delete all contained items
-        while (gump->container.items->size() > 0)
+        while (gump->container.first_item != NULL)
         {
             // item will remove itself from this container's item list
-            item_t *item = *gump->container.items->begin();
-            game_delete_item(item);
+            game_delete_item(gump->container.first_item);
         }
-        delete gump->container.items;
         gump->container.item->container_gump = NULL;
     }
     else if (gump->type == GUMPTYPE_GENERIC)
@@ -1369,6 +2747,7 @@ void game_delete_gump(gump_t *gump)
             }
         }
         delete gump->generic.widgets;
+        free_gump_draw_list(gump);
     }
     else if (gump->type == GUMPTYPE_PAPERDOLL)
     {
@@ -1388,22 +2767,40 @@ void game_delete_gump(gump_t *gump)
     free(gump);
 }
 
+void game_delete_multi(multi_t *multi)
+{
+    if (multi->in_grid)
+    {
+        grid_unlink_multi(multi);
+    }
+    multis.remove(multi->serial);
+    multi_pool.free(multi);
+}
+
 void game_delete_object(uint32_t serial)
 {
     // delete mobile
     {
-        std::map<int, mobile_t *>::iterator it = mobiles.find(serial);
-        if (it != mobiles.end())
+        mobile_t **m = mobiles.find(serial);
+        if (m != NULL)
         {
-            game_delete_mobile(it->second);
+            game_delete_mobile(*m);
         }
     }
     // delete item
     {
-        std::map<int, item_t *>::iterator it = items.find(serial);
-        if (it != items.end())
+        item_t **item = items.find(serial);
+        if (item != NULL)
+        {
+            game_delete_item(*item);
+        }
+    }
+    // delete multi
+    {
+        multi_t **multi = multis.find(serial);
+        if (multi != NULL)
         {
-            game_delete_item(it->second);
+            game_delete_multi(*multi);
         }
     }
 }
@@ -1411,10 +2808,10 @@ void game_delete_object(uint32_t serial)
 
 void game_show_container(uint32_t item_serial, int gump_id)
 {
-    std::map<int, item_t *>::iterator it = items.find(item_serial);
-    assert(it != items.end());
+    item_t **it = items.find(item_serial);
+    assert(it != NULL);
 
-    item_t *item = it->second;
+    item_t *item = *it;
 
     if (item->container_gump != NULL)
     {
@@ -1429,7 +2826,6 @@ void game_show_container(uint32_t item_serial, int gump_id)
         container->type = GUMPTYPE_CONTAINER;
         container->container.item = item;
         container->container.gump_id = gump_id;
-        container->container.items = new std::list<item_t *>();
 
         item->container_gump = container;
 
@@ -1460,10 +2856,10 @@ void game_show_paperdoll(mobile_t *m, std::wstring name)
 
 gump_t *game_get_container(uint32_t item_serial)
 {
-    std::map<int, item_t *>::iterator it = items.find(item_serial);
-    assert(it != items.end());
+    item_t **it = items.find(item_serial);
+    assert(it != NULL);
 
-    item_t *item = it->second;
+    item_t *item = *it;
 
     gump_t *container = item->container_gump;
     assert(container != NULL);
@@ -1621,101 +3017,440 @@ bool is_in_draw_range(int x, int y, int z)
 {
     int dx = player.x - x;
     int dy = player.y - y;
-    return std::max(std::abs(dx), std::abs(dy)) <= 18;
+    return std::max(std::abs(dx), std::abs(dy)) <= view_distance;
+}
+
+// smallest view distance that fills a window of the given size
+int view_distance_for_window(int width, int height)
+{
+    // tile offset (dx, dy) ends up at screen offset (22*(dx-dy), 22*(dx+dy)),
+    // so the window corners are (width/2 + height/2) / 44 tiles away.
+    // add a few tiles for tall statics sticking in from outside the window.
+    return (width / 2 + height / 2) / 44 + 3;
+}
+
+void set_view_distance(int distance)
+{
+    assert(distance > 0);
+    view_distance = distance;
+
+    // whole blocks are drawn, so tiles reach up to 7 tiles past the view
+    // distance, and land tiles look at one more row of corners than that
+    int block_radius = (view_distance + 7) / 8;
+    draw_prio_radius = 8 * block_radius + 9 + draw_prio_slack;
+
+    // largest prio world_draw_prio can return, plus layer/foliage bonus
+    int max_prio = 2 * 32 * (64 * 2 * (2 * draw_prio_radius) + 256) + 2 * 32;
+    gfx_set_depth_range(max_prio);
+
+    block_caches_resize(view_distance);
+
+    printf("view distance: %d tiles (%d blocks)\n", view_distance, 2 * block_radius + 1);
+}
+
+// the tiles in view are the ones within view_distance of the player on both axes
+static bool is_box_in_draw_range(int min_x, int min_y, int max_x, int max_y)
+{
+    return max_x >= player.x - view_distance && min_x <= player.x + view_distance &&
+           max_y >= player.y - view_distance && min_y <= player.y + view_distance;
+}
+
+void draw_world_multi(multi_t *multi)
+{
+    ml_multi *m = get_multi(multi->multi_id);
+    if (m == NULL)
+    {
+        return;
+    }
+    if (!is_box_in_draw_range(multi->x + m->min_x, multi->y + m->min_y, multi->x + m->max_x, multi->y + m->max_y))
+    {
+        return;
+    }
+
+    for (int by = 0; by < m->bucket_height; by++)
+    for (int bx = 0; bx < m->bucket_width; bx++)
+    {
+        int bucket_min_x = multi->x + (m->bucket_x + bx) * 8;
+        int bucket_min_y = multi->y + (m->bucket_y + by) * 8;
+        if (!is_box_in_draw_range(bucket_min_x, bucket_min_y, bucket_min_x + 7, bucket_min_y + 7))
+        {
+            continue;
+        }
+
+        int bucket = bx + by * m->bucket_width;
+        for (int i = m->bucket_starts[bucket]; i < m->bucket_starts[bucket + 1]; i++)
+        {
+            int item_id = m->items[i].item_id;
+            int x = multi->x + m->items[i].x;
+            int y = multi->y + m->items[i].y;
+            int z = multi->z + m->items[i].z;
+            bool visible = m->items[i].visible;
+            //assert(visible);
+            if (visible)
+            {
+                if (is_in_draw_range(x, y, z))
+                {
+                    draw_world_item(item_id, x, y, z, 0, pick_static(x, y, z, item_id));
+                }
+            }
+        }
+    }
 }
 
-void draw_world()
+// land and statics
+void draw_world_static_blocks()
 {
     int world_center_block_x = player.x / 8;
     int world_center_block_y = player.y / 8;
 
+    int block_radius = (view_distance + 7) / 8;
+
     // draw land blocks
-    for (int block_dy = -1; block_dy <= 1; block_dy++)
-    for (int block_dx = -1; block_dx <= 1; block_dx++)
+    for (int block_dy = -block_radius; block_dy <= block_radius; block_dy++)
+    for (int block_dx = -block_radius; block_dx <= block_radius; block_dx++)
     {
         int block_x = world_center_block_x + block_dx;
         int block_y = world_center_block_y + block_dy;
 
-        draw_world_land_block(1, block_x, block_y);
+        draw_world_land_block(current_map, block_x, block_y);
     }
     // draw statics blocks
-    for (int block_dy = -1; block_dy <= 1; block_dy++)
-    for (int block_dx = -1; block_dx <= 1; block_dx++)
+    for (int block_dy = -block_radius; block_dy <= block_radius; block_dy++)
+    for (int block_dx = -block_radius; block_dx <= block_radius; block_dx++)
     {
         int block_x = world_center_block_x + block_dx;
         int block_y = world_center_block_y + block_dy;
 
-        draw_world_statics_block(1, block_x, block_y);
+        draw_world_statics_block(current_map, block_x, block_y);
+    }
+}
+
+// with --static-layer-cache, land and statics are drawn into an offscreen
+// layer that is reused as long as nothing in it changes. when the player
+// walks, the layer is scrolled and only the strips that scrolled into the
+// window are drawn. everything else in the world is drawn on top of it,
+// depth tested against it.
+static struct
+{
+    bool enabled;
+    bool valid;
+    // what the layer was drawn with
+    int camera_x, camera_y, camera_z;
+    int center_block_x, center_block_y; // of the blocks that were in view
+    int map;
+    bool draw_roofs;
+    int draw_ceiling;
+    int view_distance;
+    long list_serial; // draw_list_build_serial
+    // statistics
+    int redraws, scrolls, reuses;
+} static_layer;
+
+static void draw_static_strip(int x, int y, int width, int height)
+{
+    draw_list_clip.enabled = true;
+    draw_list_clip.x = x;
+    draw_list_clip.y = y;
+    draw_list_clip.width = width;
+    draw_list_clip.height = height;
+    // gl counts y starting from the bottom
+    gfx_scissor_area(x, window_height - y - height, width, height);
+    gfx_scissor(true);
+
+    draw_world_static_blocks();
+    gfx_flush();
+
+    gfx_scissor(false);
+    gfx_scissor_area(0, 0, window_width, window_height);
+    draw_list_clip.enabled = false;
+}
+
+static void draw_static_layer_cached(int pick_x, int pick_y)
+{
+    // the lists in view are brought up to date first, what the layer shows
+    // only changes when one of them is rebuilt
+    draw_lists_refresh_only = true;
+    draw_world_static_blocks();
+    draw_lists_refresh_only = false;
+
+    // scrolling only draws the strips at the window's edges. when the view
+    // ends inside the window, blocks also enter and leave the view inside it,
+    // so then the whole layer has to be redrawn whenever that happens.
+    bool view_inside_window = view_distance < view_distance_for_window(window_width, window_height);
+    bool blocks_in_view_changed = static_layer.center_block_x != player.x / 8 ||
+                                  static_layer.center_block_y != player.y / 8;
+    bool redraw = !static_layer.valid ||
+                  (view_inside_window && blocks_in_view_changed) ||
+                  static_layer.map != current_map ||
+                  static_layer.draw_roofs != draw_roofs ||
+                  static_layer.draw_ceiling != draw_ceiling ||
+                  static_layer.view_distance != view_distance ||
+                  static_layer.list_serial != draw_list_build_serial ||
+                  std::abs(player.x - draw_prio_origin_x) > draw_prio_slack ||
+                  std::abs(player.y - draw_prio_origin_y) > draw_prio_slack;
+
+    // how far what was drawn moved on screen
+    int dx = player.x - static_layer.camera_x;
+    int dy = player.y - static_layer.camera_y;
+    int dz = player.z - static_layer.camera_z;
+    int scroll_x = -22 * (dx - dy);
+    int scroll_y = -22 * (dx + dy) + 4 * dz;
+
+    if (redraw)
+    {
+        draw_prio_origin_x = player.x;
+        draw_prio_origin_y = player.y;
+    }
+
+    // the sprites are drawn into the layer without picking, it's done below
+    bool was_picking = picking_enabled;
+    picking_enabled = false;
+
+    bool kept = gfx_static_layer_begin(redraw, redraw ? 0 : scroll_x, redraw ? 0 : scroll_y);
+    if (!kept)
+    {
+        draw_world_static_blocks();
+        gfx_flush();
+        static_layer.redraws += 1;
+    }
+    else if (scroll_x != 0 || scroll_y != 0)
+    {
+        if (scroll_x > 0) draw_static_strip(0, 0, scroll_x, window_height);
+        if (scroll_x < 0) draw_static_strip(window_width + scroll_x, 0, -scroll_x, window_height);
+        if (scroll_y > 0) draw_static_strip(0, 0, window_width, scroll_y);
+        if (scroll_y < 0) draw_static_strip(0, window_height + scroll_y, window_width, -scroll_y);
+        static_layer.scrolls += 1;
+    }
+    else
+    {
+        static_layer.reuses += 1;
+    }
+    gfx_static_layer_end();
+    gfx_static_layer_composite();
+
+    picking_enabled = was_picking;
+
+    // only the lists under the cursor need to be looked at for picking
+    if (picking_enabled)
+    {
+        draw_lists_pick_only = true;
+        draw_list_clip.enabled = true;
+        draw_list_clip.x = pick_x;
+        draw_list_clip.y = pick_y;
+        draw_list_clip.width = 1;
+        draw_list_clip.height = 1;
+        draw_world_static_blocks();
+        draw_list_clip.enabled = false;
+        draw_lists_pick_only = false;
+    }
+
+    static_layer.valid = true;
+    static_layer.camera_x = player.x;
+    static_layer.camera_y = player.y;
+    static_layer.camera_z = player.z;
+    static_layer.center_block_x = player.x / 8;
+    static_layer.center_block_y = player.y / 8;
+    static_layer.map = current_map;
+    static_layer.draw_roofs = draw_roofs;
+    static_layer.draw_ceiling = draw_ceiling;
+    static_layer.view_distance = view_distance;
+    // drawing may have rebuilt lists
+    static_layer.list_serial = draw_list_build_serial;
+}
+
+// draws the world into the window, picking at (pick_x, pick_y)
+void draw_world(int pick_x, int pick_y)
+{
+    int world_center_block_x = player.x / 8;
+    int world_center_block_y = player.y / 8;
+
+    int block_radius = (view_distance + 7) / 8;
+
+    if (static_layer.enabled)
+    {
+        draw_static_layer_cached(pick_x, pick_y);
     }
-    // draw items
+    else
+    {
+        draw_prio_origin_x = player.x;
+        draw_prio_origin_y = player.y;
+        draw_world_static_blocks();
+    }
+
+    // draw items and mobiles in the cells in view
+    for (int block_dy = -block_radius; block_dy <= block_radius; block_dy++)
+    for (int block_dx = -block_radius; block_dx <= block_radius; block_dx++)
     {
-        std::map<int, item_t *>::iterator it;
-        for (it = items.begin(); it != items.end(); ++it)
+        grid_cell_t *cell = grid_cell_at_block(world_center_block_x + block_dx, world_center_block_y + block_dy);
+        if (cell == NULL)
         {
-            item_t *item = it->second;
-            if (item->space == SPACETYPE_WORLD)
+            continue;
+        }
+        for (item_t *item = cell->items; item != NULL; item = item->loc.world.grid_next)
+        {
+            assert(item->space == SPACETYPE_WORLD);
+            if (is_in_draw_range(item->loc.world.x, item->loc.world.y, item->loc.world.z))
             {
-                if (is_in_draw_range(item->loc.world.x, item->loc.world.y, item->loc.world.z))
-                {
-                    draw_world_item(item->item_id, item->loc.world.x, item->loc.world.y, item->loc.world.z, item->hue_id, pick_item(item));
-                }
+                draw_world_item(item->item_id, item->loc.world.x, item->loc.world.y, item->loc.world.z, item->hue_id, pick_item(item));
             }
         }
-    }
-    // draw multis
-    {
-        std::map<int, multi_t *>::iterator it;
-        for (it = multis.begin(); it != multis.end(); ++it)
+        for (mobile_t *mobile = cell->mobiles; mobile != NULL; mobile = mobile->grid_next)
         {
-            multi_t *multi = it->second;
-            ml_multi *m = get_multi(multi->multi_id);
-            if (m)
+            if (is_in_draw_range(mobile->x, mobile->y, mobile->z))
             {
-                for (int i = 0; i < m->item_count; i++)
-                {
-                    int item_id = m->items[i].item_id;
-                    int x = multi->x + m->items[i].x;
-                    int y = multi->y + m->items[i].y;
-                    int z = multi->z + m->items[i].z;
-                    bool visible = m->items[i].visible;
-                    //assert(visible);
-                    if (visible)
-                    {
-                        if (is_in_draw_range(x, y, z))
-                        {
-                            draw_world_item(item_id, x, y, z, 0, pick_static(x, y, z, item_id));
-                        }
-                    }
-                }
+                draw_world_mobile(mobile, pick_mobile(mobile));
             }
         }
     }
-    // draw mobiles
+    // draw multis, these can stick out of their cell quite a bit
+    int multi_radius = block_radius + multi_grid_margin;
+    for (int block_dy = -multi_radius; block_dy <= multi_radius; block_dy++)
+    for (int block_dx = -multi_radius; block_dx <= multi_radius; block_dx++)
+    {
+        grid_cell_t *cell = grid_cell_at_block(world_center_block_x + block_dx, world_center_block_y + block_dy);
+        if (cell == NULL)
+        {
+            continue;
+        }
+        for (multi_t *multi = cell->multis; multi != NULL; multi = multi->grid_next)
+        {
+            draw_world_multi(multi);
+        }
+    }
+    // draw character
+    {
+        draw_world_mobile(&player, pick_mobile(&player));
+    }
+
+    if (frame_number % draw_list_max_age == 0)
+    {
+        free_old_draw_lists(&land_draw_lists);
+        free_old_draw_lists(&statics_draw_lists);
+    }
+}
+
+// requests every block in view around (x, y) on a map.
+// returns how many of them are not loaded yet.
+int request_blocks_around(int map, int x, int y)
+{
+    int center_block_x = x / 8;
+    int center_block_y = y / 8;
+    int block_radius = (view_distance + 7) / 8;
+
+    int missing = 0;
+    for (int block_dy = -block_radius; block_dy <= block_radius; block_dy++)
+    for (int block_dx = -block_radius; block_dx <= block_radius; block_dx++)
+    {
+        int block_x = center_block_x + block_dx;
+        int block_y = center_block_y + block_dy;
+        if (!block_in_map(map, block_x, block_y))
+        {
+            continue;
+        }
+        if (!get_land_block(map, block_x, block_y))
+        {
+            missing += 1;
+        }
+        if (!get_statics_block(map, block_x, block_y))
+        {
+            missing += 1;
+        }
+    }
+    return missing;
+}
+
+static struct
+{
+    bool pending;
+    bool placed; // the player's position on the new map is known
+    int map;
+    long start;
+} facet_switch;
+
+void game_set_map(int map)
+{
+    if (map < 0 || map >= ML_MAP_COUNT)
+    {
+        printf("ignoring switch to unknown map %d\n", map);
+        return;
+    }
+    if (map == current_map)
+    {
+        return;
+    }
+    int block_width, block_height;
+    if (!ml_get_map_dimensions(map, &block_width, &block_height))
+    {
+        printf("error: can't switch to map %d, its map, statics or staidx file is missing or empty\n", map);
+        return;
+    }
+
+    printf("switching to map %d\n", map);
+
+    // blocks are keyed by map, so nothing needs to be flushed.
+    // the old map's blocks will just age out of the caches.
+    current_map = map;
+
+    facet_switch.pending = true;
+    facet_switch.placed = false;
+    facet_switch.map = map;
+    facet_switch.start = SDL_GetTicks();
+
+    // the map change comes before the player's new position, so the
+    // destination area is requested once that arrives. requesting around
+    // the old position would keep the workers busy with the wrong area.
+}
+
+static void facet_switch_player_placed()
+{
+    if (facet_switch.pending && !facet_switch.placed)
+    {
+        facet_switch.placed = true;
+        // get the workers going on the destination area right away
+        request_blocks_around(facet_switch.map, player.x, player.y);
+    }
+}
+
+// reports how long a facet switch took once every block in view is loaded
+static void check_facet_switch()
+{
+    if (!facet_switch.pending)
+    {
+        return;
+    }
+    if (facet_switch.map != current_map)
     {
-        std::map<int, mobile_t *>::iterator it;
-        for (it = mobiles.begin(); it != mobiles.end(); ++it)
-        {
-            mobile_t *mobile = it->second;
-            if (is_in_draw_range(mobile->x, mobile->y, mobile->z))
-            {
-                draw_world_mobile(mobile, pick_mobile(mobile));
-            }
-        }
+        facet_switch.pending = false;
+        return;
     }
-    // draw character
+    if (!facet_switch.placed)
     {
-        draw_world_mobile(&player, pick_mobile(&player));
+        return;
+    }
+    if (request_blocks_around(current_map, player.x, player.y) == 0)
+    {
+        long elapsed = SDL_GetTicks() - facet_switch.start;
+        printf("facet switch to map %d: area loaded in %ld ms\n", current_map, elapsed);
+        facet_switch.pending = false;
     }
 }
 
 void draw_world_texts()
 {
     // draw mobiles' texts
+    int world_center_block_x = player.x / 8;
+    int world_center_block_y = player.y / 8;
+    int block_radius = (view_distance + 7) / 8;
+    for (int block_dy = -block_radius; block_dy <= block_radius; block_dy++)
+    for (int block_dx = -block_radius; block_dx <= block_radius; block_dx++)
     {
-        std::map<int, mobile_t *>::iterator it;
-        for (it = mobiles.begin(); it != mobiles.end(); ++it)
+        grid_cell_t *cell = grid_cell_at_block(world_center_block_x + block_dx, world_center_block_y + block_dy);
+        if (cell == NULL)
+        {
+            continue;
+        }
+        for (mobile_t *mobile = cell->mobiles; mobile != NULL; mobile = mobile->grid_next)
         {
-            mobile_t *mobile = it->second;
             if (is_in_draw_range(mobile->x, mobile->y, mobile->z))
             {
                 int pick_id = pick_mobile(mobile);
@@ -1758,35 +3493,14 @@ void draw_gump_tiled(int gump_id, int x, int y, int width, int height, int hue_i
     // TODO: this null check shouldn't be necessary
     if (ps)
     {
-        for (int draw_y = y; draw_y < y + height; draw_y += ps->height)
-        for (int draw_x = x; draw_x < x + width ; draw_x += ps->width )
-        {
-            int draw_width  = std::min(x + width  - draw_x, ps->width);
-            int draw_height = std::min(y + height - draw_y, ps->height);
-
-            bool custom_size = (draw_width  != ps->width) ||
-                               (draw_height != ps->height);
-            if (custom_size)
-            {
-                pixel_storage_t temp_ps;
-                temp_ps.width  = draw_width;
-                temp_ps.height = draw_height;
-                temp_ps.tex    = ps->tex;
-                // TODO: should do something more clever with texture coords...
-                memcpy(temp_ps.tcxs, ps->tcxs, sizeof(temp_ps.tcxs));
-                memcpy(temp_ps.tcys, ps->tcys, sizeof(temp_ps.tcys));
-                blit_ps(&temp_ps, draw_x, draw_y, gump_draw_order++, hue_id, pick_id);
-            }
-            else
-            {
-                blit_ps(ps, draw_x, draw_y, gump_draw_order++, hue_id, pick_id);
-            }
-        }
-        //blit_ps_tiled(ps, x, y, width, height, 0, hue_id, pick_id);
+        gfx_render_tiled(ps, x, y, width, height, gump_draw_order++, hue_id, pick_id);
     }
 }
 
-void draw_gump_dynamic(int gump_id_base, int x, int y, int width, int height, int hue_id, int pick_id)
+// where the 9 pieces of a resizable background go, relative to its top left:
+// the corners as they are, the edges and the middle tiled over the rest.
+// false while the pieces it's measured with are loading.
+static bool resizepic_layout(int gump_id_base, int width, int height, int xs[9], int ys[9], int ws[9], int hs[9])
 {
     pixel_storage_t *pss[3];
     pss[0] = get_gump_ps(gump_id_base + 0);
@@ -1798,39 +3512,55 @@ void draw_gump_dynamic(int gump_id_base, int x, int y, int width, int height, in
     {
         if (!pss[i])
         {
-            return;
+            return false;
         }
     }
 
-    int ws[3];
-    ws[0] = pss[0]->width;
-    ws[2] = pss[1]->width;
-    ws[1] = width - ws[2] - ws[0];
+    int column_ws[3];
+    column_ws[0] = pss[0]->width;
+    column_ws[2] = pss[1]->width;
+    column_ws[1] = width - column_ws[2] - column_ws[0];
 
-    int hs[3];
-    hs[0] = pss[0]->height;
-    hs[2] = pss[2]->height;
-    hs[1] = height - hs[2] - hs[0];
+    int row_hs[3];
+    row_hs[0] = pss[0]->height;
+    row_hs[2] = pss[2]->height;
+    row_hs[1] = height - row_hs[2] - row_hs[0];
 
-    int dxs[3] = { 0, ws[0], ws[0] + ws[1] };
-    int dys[3] = { 0, hs[0], hs[0] + hs[1] };
+    int dxs[3] = { 0, column_ws[0], column_ws[0] + column_ws[1] };
+    int dys[3] = { 0, row_hs[0], row_hs[0] + row_hs[1] };
 
     for (int i = 0; i < 9; i++)
     {
-        int grid_x = i % 3;
-        int grid_y = i / 3;
+        xs[i] = dxs[i % 3];
+        ys[i] = dys[i / 3];
+        ws[i] = column_ws[i % 3];
+        hs[i] = row_hs[i / 3];
+    }
+    return true;
+}
+
+static bool resizepic_corner(int i)
+{
+    return (i % 3) % 2 == 0 && (i / 3) % 2 == 0;
+}
 
-        int draw_x = x + dxs[grid_x];
-        int draw_y = y + dys[grid_y];
+void draw_gump_dynamic(int gump_id_base, int x, int y, int width, int height, int hue_id, int pick_id)
+{
+    int xs[9], ys[9], ws[9], hs[9];
+    if (!resizepic_layout(gump_id_base, width, height, xs, ys, ws, hs))
+    {
+        return;
+    }
 
-        bool corner = (grid_x % 2) == 0 && (grid_y % 2) == 0;
-        if (corner)
+    for (int i = 0; i < 9; i++)
+    {
+        if (resizepic_corner(i))
         {
-            draw_gump(gump_id_base + i, draw_x, draw_y, hue_id, pick_id);
+            draw_gump(gump_id_base + i, x + xs[i], y + ys[i], hue_id, pick_id);
         }
         else
         {
-            draw_gump_tiled(gump_id_base + i, draw_x, draw_y, ws[grid_x], hs[grid_y], hue_id, pick_id);
+            draw_gump_tiled(gump_id_base + i, x + xs[i], y + ys[i], ws[i], hs[i], hue_id, pick_id);
         }
     }
 }
@@ -1887,9 +3617,8 @@ void draw_container(gump_t *container)
     int x = container->x;
     int y = container->y;
     draw_gump(container->container.gump_id, x, y, 0, pick_gump(container));
-    for (std::list<item_t *>::iterator it = container->container.items->begin(); it != container->container.items->end(); ++it)
+    for (item_t *item = container->container.first_item; item != NULL; item = item->loc.container.next)
     {
-        item_t *item = *it;
 
         assert(item->space == SPACETYPE_CONTAINER);
 
@@ -1902,48 +3631,194 @@ void draw_container(gump_t *container)
     }
 }
 
-void draw_generic_gump(gump_t *gump)
+// generic gumps never change once the server has sent them, apart from the
+// page shown. so instead of walking their widgets every frame, their sprites
+// are worked out once, relative to the gump, and drawn from that list. like
+// the block draw lists, a list is rebuilt when
+//  - the page changed
+//  - art it wanted was still loading, and some art has arrived since
+//  - art it uses may have been evicted while it wasn't drawn
+struct gump_sprite_t
 {
-    assert(gump->type == GUMPTYPE_GENERIC);
-    int x = gump->x;
-    int y = gump->y;
+    asset_cache_t<int, pixel_storage_t> *cache; // NULL for text, strings are never evicted
+    asset_cache_t<int, pixel_storage_t>::entry_t *art;
+    pixel_storage_t *ps;
+    int x, y;
+    int width, height; // tiled if bigger than the sprite
+    int hue_id;
+    gump_widget_t *button; // picks as this button, NULL for the gump itself
+};
 
-    int pick_id = pick_gump(gump);
+struct gump_draw_list_t
+{
+    gump_sprite_t *sprites;
+    int count;
+    int capacity;
+
+    bool built;
+    int built_page;
+    bool missing_art;
+    int art_loads;     // of the gump and static caches when built
+    int art_evictions; // of the gump and static caches when last drawn
+    long last_drawn;
+};
+
+static hash_table_t<gump_draw_list_t> gump_draw_lists; // keyed by the gump's address
+
+void gump_draw_lists_init()
+{
+    gump_draw_lists.init(16);
+}
+
+static void free_gump_draw_list(gump_t *gump)
+{
+    gump_draw_list_t *list = gump_draw_lists.find((uint64_t)(uintptr_t)gump);
+    if (list != NULL)
+    {
+        free(list->sprites);
+        gump_draw_lists.remove((uint64_t)(uintptr_t)gump);
+    }
+}
+
+static void gump_draw_list_add(gump_draw_list_t *list, asset_cache_t<int, pixel_storage_t> *cache, asset_cache_t<int, pixel_storage_t>::entry_t *art,
+                               pixel_storage_t *ps, int x, int y, int width, int height, int hue_id, gump_widget_t *button)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = std::max(16, 2 * list->capacity);
+        list->sprites = (gump_sprite_t *)realloc(list->sprites, list->capacity * sizeof(gump_sprite_t));
+    }
+    gump_sprite_t *sprite = &list->sprites[list->count++];
+    sprite->cache = cache;
+    sprite->art = art;
+    sprite->ps = ps;
+    sprite->x = x;
+    sprite->y = y;
+    sprite->width = width;
+    sprite->height = height;
+    sprite->hue_id = hue_id;
+    sprite->button = button;
+}
+
+// width and height -1 for the art's own size
+static void gump_draw_list_add_art(gump_draw_list_t *list, asset_cache_t<int, pixel_storage_t> *cache, asset_cache_t<int, pixel_storage_t>::entry_t *art,
+                                   int x, int y, int width, int height, int hue_id, gump_widget_t *button)
+{
+    if (art->state == ASSET_FETCHING)
+    {
+        list->missing_art = true;
+        return;
+    }
+    pixel_storage_t *ps = &art->value;
+    gump_draw_list_add(list, cache, art, ps, x, y, width < 0 ? ps->width : width, height < 0 ? ps->height : height, hue_id, button);
+}
+
+static void build_gump_draw_list(gump_draw_list_t *list, gump_t *gump)
+{
+    list->count = 0;
+    list->built = true;
+    list->built_page = gump->generic.current_page;
+    list->missing_art = false;
+    list->art_loads = gump_cache.loads + static_cache.loads;
 
     for (std::list<gump_widget_t>::iterator it = gump->generic.widgets->begin(); it != gump->generic.widgets->end(); ++it)
     {
         gump_widget_t &widget = *it;
-        if (widget.page == 0 || widget.page == gump->generic.current_page)
+        if (widget.page != 0 && widget.page != gump->generic.current_page)
         {
-            if (widget.type == GUMPWTYPE_PIC)
-            {
-                draw_gump(widget.pic.gump_id, x + widget.pic.x, y + widget.pic.y, 0, pick_id);
-            }
-            else if (widget.type == GUMPWTYPE_PICTILED)
-            {
-                draw_gump_tiled(widget.pictiled.gump_id, x + widget.pictiled.x, y + widget.pictiled.y, widget.pictiled.width, widget.pictiled.height, 0, pick_id);
-            }
-            else if (widget.type == GUMPWTYPE_RESIZEPIC)
-            {
-                draw_gump_dynamic(widget.resizepic.gump_id_base, x + widget.resizepic.x, y + widget.resizepic.y, widget.resizepic.width, widget.resizepic.height, 0, pick_id);
-            }
-            else if (widget.type == GUMPWTYPE_BUTTON)
-            {
-                draw_gump(widget.button.up_gump_id, x + widget.button.x, y + widget.button.y, 0, pick_gump_widget(gump, &widget));
-            }
-            else if (widget.type == GUMPWTYPE_ITEM)
+            continue;
+        }
+        if (widget.type == GUMPWTYPE_PIC)
+        {
+            gump_draw_list_add_art(list, &gump_cache, get_gump_entry(widget.pic.gump_id), widget.pic.x, widget.pic.y, -1, -1, 0, NULL);
+        }
+        else if (widget.type == GUMPWTYPE_PICTILED)
+        {
+            gump_draw_list_add_art(list, &gump_cache, get_gump_entry(widget.pictiled.gump_id), widget.pictiled.x, widget.pictiled.y,
+                                   widget.pictiled.width, widget.pictiled.height, 0, NULL);
+        }
+        else if (widget.type == GUMPWTYPE_RESIZEPIC)
+        {
+            int xs[9], ys[9], ws[9], hs[9];
+            if (!resizepic_layout(widget.resizepic.gump_id_base, widget.resizepic.width, widget.resizepic.height, xs, ys, ws, hs))
             {
-                draw_screen_item(widget.item.item_id, x + widget.item.x, y + widget.item.y, widget.item.hue_id, pick_id);
+                list->missing_art = true;
+                continue;
             }
-            else if (widget.type == GUMPWTYPE_TEXT)
+            for (int i = 0; i < 9; i++)
             {
-                draw_screen_text(x + widget.text.x, y + widget.text.y, widget.text.font_id, -1, *widget.text.text, pick_id);
+                bool corner = resizepic_corner(i);
+                gump_draw_list_add_art(list, &gump_cache, get_gump_entry(widget.resizepic.gump_id_base + i),
+                                       widget.resizepic.x + xs[i], widget.resizepic.y + ys[i], corner ? -1 : ws[i], corner ? -1 : hs[i], 0, NULL);
             }
-            else
+        }
+        else if (widget.type == GUMPWTYPE_BUTTON)
+        {
+            gump_draw_list_add_art(list, &gump_cache, get_gump_entry(widget.button.up_gump_id), widget.button.x, widget.button.y, -1, -1, 0, &widget);
+        }
+        else if (widget.type == GUMPWTYPE_ITEM)
+        {
+            gump_draw_list_add_art(list, &static_cache, get_static_art_entry(widget.item.item_id), widget.item.x, widget.item.y, -1, -1, widget.item.hue_id, NULL);
+        }
+        else if (widget.type == GUMPWTYPE_TEXT)
+        {
+            pixel_storage_t *ps = get_string_ps(widget.text.font_id, *widget.text.text);
+            // TODO: this null check shouldn't be necessary
+            if (ps)
             {
-                assert(0 && "unhandled widget type");
+                gump_draw_list_add(list, NULL, NULL, ps, widget.text.x, widget.text.y, ps->width, ps->height, 0, NULL);
             }
         }
+        else
+        {
+            assert(0 && "unhandled widget type");
+        }
+    }
+}
+
+void draw_generic_gump(gump_t *gump)
+{
+    assert(gump->type == GUMPTYPE_GENERIC);
+    int x = gump->x;
+    int y = gump->y;
+
+    gump_draw_list_t *list = gump_draw_lists.insert((uint64_t)(uintptr_t)gump);
+    int art_loads = gump_cache.loads + static_cache.loads;
+    int art_evictions = gump_cache.evictions + static_cache.evictions;
+    bool valid = list->built && list->built_page == gump->generic.current_page;
+    if (valid && list->missing_art && list->art_loads != art_loads)
+    {
+        valid = false;
+    }
+    if (valid && list->last_drawn != frame_number - 1 && list->art_evictions != art_evictions)
+    {
+        valid = false;
+    }
+    if (!valid)
+    {
+        build_gump_draw_list(list, gump);
+    }
+    list->last_drawn = frame_number;
+    list->art_evictions = art_evictions;
+
+    int pick_id = pick_gump(gump);
+
+    for (int i = 0; i < list->count; i++)
+    {
+        gump_sprite_t *sprite = &list->sprites[i];
+        if (sprite->cache != NULL)
+        {
+            sprite->cache->touch(sprite->art);
+        }
+        int sprite_pick_id = sprite->button != NULL ? pick_gump_widget(gump, sprite->button) : pick_id;
+        if (sprite->width != sprite->ps->width || sprite->height != sprite->ps->height)
+        {
+            gfx_render_tiled(sprite->ps, x + sprite->x, y + sprite->y, sprite->width, sprite->height, gump_draw_order++, sprite->hue_id, sprite_pick_id);
+        }
+        else
+        {
+            blit_ps(sprite->ps, x + sprite->x, y + sprite->y, gump_draw_order++, sprite->hue_id, sprite_pick_id);
+        }
     }
 }
 
@@ -2185,11 +4060,162 @@ void game_speech(uint32_t serial, int font_id, std::wstring name, std::wstring s
     }
 }
 
-int main()
+// measures how many pixels the world pass fills, alternating between drawing
+// opaque sprites separately and drawing everything alpha tested.
+static struct
+{
+    bool enabled;
+    bool split;
+    int frames;
+    double sprites;
+    double submitted_area;
+    double samples_passed;
+} overdraw_benchmark;
+
+static void overdraw_benchmark_frame()
+{
+    if (!overdraw_benchmark.enabled)
+    {
+        return;
+    }
+    if (overdraw_benchmark.frames == 0)
+    {
+        gfx_measure_fill(true);
+    }
+    else
+    {
+        gfx_fill_stats_t stats = gfx_last_fill_stats();
+        overdraw_benchmark.sprites += stats.sprites;
+        overdraw_benchmark.submitted_area += stats.submitted_area;
+        overdraw_benchmark.samples_passed += stats.samples_passed;
+    }
+
+    const int frames_per_run = 120;
+    overdraw_benchmark.frames += 1;
+    if (overdraw_benchmark.frames > frames_per_run)
+    {
+        double n = frames_per_run;
+        double screen = (double)window_width * window_height;
+        printf("[overdraw] opaque split %s: %.0f sprites, submitted %.2fx screen, depth test passed %.2fx screen\n",
+            overdraw_benchmark.split ? " on" : "off",
+            overdraw_benchmark.sprites / n,
+            overdraw_benchmark.submitted_area / n / screen,
+            overdraw_benchmark.samples_passed / n / screen);
+
+        bool split = !overdraw_benchmark.split;
+        memset(&overdraw_benchmark, 0, sizeof(overdraw_benchmark));
+        overdraw_benchmark.enabled = true;
+        overdraw_benchmark.split = split;
+        gfx_set_opaque_split(split);
+    }
+}
+
+// with --dedup-survey, every static art, gump and animation frame in the
+// data files is prepared as if for uploading, and what sharing identical
+// pixels saves is printed. nothing else is done.
+static bool dedup_survey_enabled = false;
+
+static void dedup_survey()
+{
+    for (int item_id = 0; item_id < 0x10000; item_id++)
+    {
+        if (ml_has_static_art(item_id))
+        {
+            ml_art *a = ml_read_static_art(item_id);
+            gfx_survey_pixels(gfx_prepare_pixels(a->width, a->height, a->data));
+            ml_free_pixels(a);
+        }
+    }
+    gfx_report_survey("static art");
+
+    for (int gump_id = 0; gump_id < 0x10000; gump_id++)
+    {
+        if (ml_has_gump(gump_id))
+        {
+            ml_gump *g = ml_read_gump(gump_id);
+            gfx_survey_pixels(gfx_prepare_pixels(g->width, g->height, g->data));
+            ml_free_pixels(g);
+        }
+    }
+    gfx_report_survey("gumps");
+
+    for (int body_id = 0; body_id < ML_ANIM_BODY_COUNT; body_id++)
+    for (int action = 0; action < 35; action++)
+    for (int direction = 0; direction < 5; direction++)
+    {
+        ml_anim *a = ml_read_anim(body_id, action, direction);
+        for (int j = 0; j < a->frame_count; j++)
+        {
+            gfx_survey_pixels(gfx_prepare_pixels(a->frames[j].width, a->frames[j].height, a->frames[j].data));
+        }
+        ml_free_pixels(a);
+    }
+    gfx_report_survey("animations");
+}
+
+int main(int argc, char **argv)
 {
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--view-distance") == 0 && i + 1 < argc)
+        {
+            view_distance = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--window-size") == 0 && i + 1 < argc)
+        {
+            sscanf(argv[++i], "%dx%d", &window_width, &window_height);
+        }
+        else if (strcmp(argv[i], "--overdraw-benchmark") == 0)
+        {
+            overdraw_benchmark.enabled = true;
+        }
+        else if (strcmp(argv[i], "--dedup-survey") == 0)
+        {
+            dedup_survey_enabled = true;
+        }
+        else if (strcmp(argv[i], "--static-layer-cache") == 0)
+        {
+            static_layer.enabled = true;
+        }
+        else if (strcmp(argv[i], "--no-texmaps") == 0)
+        {
+            terrain_texmaps = false;
+        }
+        else if (strcmp(argv[i], "--compose-mobiles") == 0)
+        {
+            compose_mobiles = true;
+        }
+        else if (strcmp(argv[i], "--gpu-budget") == 0 && i + 1 < argc)
+        {
+            gpu_budget_mb = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--cpu-budget") == 0 && i + 1 < argc)
+        {
+            cpu_budget_mb = atoi(argv[++i]);
+        }
+        else
+        {
+            printf("usage: %s [--window-size WIDTHxHEIGHT] [--view-distance TILES] [--gpu-budget MB] [--cpu-budget MB] [--overdraw-benchmark] [--static-layer-cache] [--no-texmaps] [--compose-mobiles] [--dedup-survey]\n", argv[0]);
+            return 1;
+        }
+    }
+    assert(window_width > 0 && window_height > 0);
+    screen_center_x = window_width / 2;
+    screen_center_y = window_height / 2;
+    if (view_distance <= 0)
+    {
+        view_distance = view_distance_for_window(window_width, window_height);
+    }
+
     ml_init();
+    if (dedup_survey_enabled)
+    {
+        dedup_survey();
+        return 0;
+    }
 
     mlt_init();
+    game_objects_init();
     net_init();
     net_connect();
 
@@ -2226,8 +4252,25 @@ int main()
     main_context = SDL_GL_CreateContext(main_window);
     checkSDLError(__LINE__);
 
-    prg_blit_picking = gfx_upload_program("blit_picking.vert", "blit_picking.frag");
-    prg_blit_hue     = gfx_upload_program("blit_hue.vert", "blit_hue.frag");
+    gfx_init();
+    // decoded pixels are made ready for uploading by the workers
+    mlt_set_pixel_preparer(prepare_pixels);
+
+    // all sprites share one vertex shader, reading the instance stream
+    prg_blit         = gfx_upload_program("blit.vert", "blit.frag");
+    prg_land         = gfx_upload_program("blit.vert", "land.frag");
+    prg_tiled        = gfx_upload_program("tiled.vert", "tiled.frag");
+    prg_composite    = gfx_upload_program("composite.vert", "composite.frag");
+    upload_hue_table();
+
+    block_caches_init(view_distance);
+    draw_lists_init();
+    gump_draw_lists_init();
+    set_view_distance(view_distance);
+    asset_caches_init();
+
+    // start out measuring without the opaque split, to have something to compare to
+    gfx_set_opaque_split(!overdraw_benchmark.enabled);
  
     // 0 = free running
     // 1 = vsync
@@ -2253,19 +4296,18 @@ int main()
     long next_fps = start + 1000;
     int frames = 0;
     bool running = true;
-    int fps = 0;
     while (running)
     {
         // first some housekeeping...
 
         now = SDL_GetTicks() - start;
+        frame_number += 1;
 
         // FPS counter
         if (now > next_fps)
         {
             char title[64];
             sprintf(title, ":D - fps: %d", frames);
-            fps = frames;
             SDL_SetWindowTitle(main_window, title);
 
             while (now > next_fps)
@@ -2286,88 +4328,21 @@ int main()
         int world_center_block_x = player.x / 8;
         int world_center_block_y = player.y / 8;
 
-        // because GL counts y starting from bottom of screen
-        int inverted_mouse_y = window_height-mouse_y-1;
-
-        draw_ceiling = find_ceiling(1, player.x, player.y, player.z);
+        draw_ceiling = find_ceiling(current_map, player.x, player.y, player.z);
         draw_roofs = true;
-        if (has_roof(1, player.x, player.y))
+        if (has_roof(current_map, player.x, player.y))
         {
             draw_roofs = false;
         }
 
-        // reset pick ids
+        // reset pick ids, picking happens while drawing
         next_pick_id = 0;
         picking_enabled = true;
-        gfx_scissor_area(mouse_x, inverted_mouse_y, 1, 1);
-        gfx_scissor(true);
-        draw_world();
-        gfx_flush();
-        gfx_clear(false, true);
-        draw_world_texts();
-        // draw gumps
-        {
-            std::list<gump_t *>::iterator it;
-            for (it = gump_list.begin(); it != gump_list.end(); ++it)
-            {
-                gump_t *gump = *it;
-                draw_gump(gump);
-            }
-        }
-        gfx_flush();
-        //draw_paperdoll(&player, 0, 0, pick_gump());
-        gfx_scissor(false);
-        gfx_scissor_area(0, 0, window_width, window_height);
-
-        // do picking
-        pick_target_t *pick_target = NULL;
-        {
-            int pick_id = gfx_read_pixel(mouse_x, inverted_mouse_y);
-
-            if (pick_id >= 0 && pick_id < sizeof(pick_slots)/sizeof(pick_slots[0]))
-            {
-                pick_target = &pick_slots[pick_id];
-                //printf("picking id %d\n", id);
-                int type = pick_slots[pick_id].type;
-                switch (type)
-                {
-                    case TYPE_LAND:
-                        //printf("land (%d, %d)\n", pick_slots[id].land.x, pick_slots[id].land.y);
-                        break;
-                    case TYPE_STATIC:
-                        //printf("static\n");
-                        break;
-                    case TYPE_ITEM:
-                        //printf("item %x\n", pick_slots[pick_id].item.item->serial);
-                        break;
-                    case TYPE_MOBILE:
-                        //printf("mobile %x\n", pick_slots[pick_id].mobile.mobile->serial);
-                        break;
-                    case TYPE_GUMP:
-                        //printf("gump\n");
-                        break;
-                    case TYPE_GUMP_WIDGET:
-                        //printf("gump\n");
-                        break;
-                    default:
-                        printf("unknown item picked :O\n");
-                        break;
-                }
-            }
-            else
-            {
-                pick_target = NULL;
-            }
-        }
-        
-
-        gfx_clear(true, true);
-        // draw distinct background
-        gfx_background();
+        gfx_begin_picking(mouse_x, mouse_y);
 
-        picking_enabled = false;
-        draw_world();
+        draw_world(mouse_x, mouse_y);
         gfx_flush();
+        overdraw_benchmark_frame();
 
         gfx_clear(false, true);
         draw_world_texts();
@@ -2380,6 +4355,7 @@ int main()
                 draw_gump(gump);
             }
         }
+        picking_enabled = false;
 
         // draw dragged item
         if (dragging.type == DRAGTYPE_ITEM)
@@ -2396,6 +4372,19 @@ int main()
         }
 
         gfx_flush();
+        // nothing queued refers to cached art anymore, safe to evict
+        asset_caches_trim();
+
+        // do picking
+        pick_target_t *pick_target = NULL;
+        {
+            int pick_id = gfx_end_picking();
+
+            if (pick_id >= 0 && pick_id < next_pick_id)
+            {
+                pick_target = &pick_slots[pick_id];
+            }
+        }
 
 
         // the rest of the logic is done after drawing, so that it can make use of the picking done in drawing stage
@@ -2791,7 +4780,7 @@ int main()
                     int new_x = player.x + move_dx;
                     int new_y = player.y + move_dy;
 
-                    int new_z = find_move_z(1, new_x, new_y, player.z);
+                    int new_z = find_move_z(current_map, new_x, new_y, player.z);
                     if (new_z != -1)
                     {
                         player.x = new_x;
@@ -2823,17 +4812,20 @@ int main()
         // network...
         net_poll();
 
+        check_facet_switch();
+        drop_out_of_range_objects();
+
         //
         SDL_GL_SwapWindow(main_window);
 
-        //printf("fps: %d, per frame: commands: %d, use_program: %d, bind_tex0: %d, bind_tex1: %d, glbegin: %d, glend: %d\n", fps, cnt_render_commands, cnt_use_program, cnt_bind_tex0, cnt_bind_tex1, cnt_glbegin, cnt_glend);
+        //printf("per frame: commands: %d, use_program: %d, bind_tex0: %d, bind_tex1: %d, draw calls: %d, uploaded: %d bytes\n", cnt_render_commands, cnt_use_program, cnt_bind_tex0, cnt_bind_tex1, cnt_draw_calls, cnt_uploaded_bytes);
         // reset counters
         cnt_render_commands = 0;
         cnt_use_program = 0;
         cnt_bind_tex0 = 0;
         cnt_bind_tex1 = 0;
-        cnt_glbegin = 0;
-        cnt_glend = 0;
+        cnt_draw_calls = 0;
+        cnt_uploaded_bytes = 0;
     }
 
     // disconnect
@@ -2858,27 +4850,44 @@ int main()
         game_delete_gump(gump);
         //gump_list.erase(it);
     }
-    while (multis.size() > 0)
+    // deleting entries moves others around in the tables, so collect
+    // everything in one pass over each table first. mobiles go last,
+    // their equipped items are gone by then.
+    std::vector<multi_t *> all_multis;
+    for (int i = 0; i < multis.capacity; i++)
     {
-        std::map<int, multi_t *>::iterator it = multis.begin();
-        multi_t *multi = it->second;
-        // no special delete function
-        delete multi;
-        multis.erase(it);
+        if (multis.slots[i].used) all_multis.push_back(multis.slots[i].value);
     }
-    while (items.size() > 0)
+    for (int i = 0; i < (int)all_multis.size(); i++)
     {
-        std::map<int, item_t *>::iterator it = items.begin();
-        item_t *item = it->second;
-        game_delete_item(item);
-        //items.erase(it);
+        game_delete_multi(all_multis[i]);
+    }
+    std::vector<item_t *> all_items;
+    for (int i = 0; i < items.capacity; i++)
+    {
+        if (items.slots[i].used) all_items.push_back(items.slots[i].value);
+    }
+    for (int i = 0; i < (int)all_items.size(); i++)
+    {
+        game_delete_item(all_items[i]);
+    }
+    std::vector<mobile_t *> all_mobiles;
+    for (int i = 0; i < mobiles.capacity; i++)
+    {
+        if (mobiles.slots[i].used) all_mobiles.push_back(mobiles.slots[i].value);
+    }
+    for (int i = 0; i < (int)all_mobiles.size(); i++)
+    {
+        game_delete_mobile(all_mobiles[i]);
     }
-    while (mobiles.size() > 0)
+    assert(multis.count == 0 && items.count == 0 && mobiles.count == 0);
+
+    asset_caches_report();
+    gfx_report_atlas_occupancy();
+    if (static_layer.enabled)
     {
-        std::map<int, mobile_t *>::iterator it = mobiles.begin();
-        mobile_t *mobile = it->second;
-        game_delete_mobile(mobile);
-        //mobiles.erase(it);
+        printf("static layer: %d redraws, %d scrolls, %d reuses\n",
+            static_layer.redraws, static_layer.scrolls, static_layer.reuses);
     }
 
     SDL_GL_DeleteContext(main_context);
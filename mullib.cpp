@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <cstring>
@@ -29,16 +30,54 @@ static ml_cliloc_entry    *cliloc_entries        = NULL;
 static int                 font_metadata_count   = 0;
 static ml_font_metadata   *font_metadatas        = NULL;
 
-static ml_index           *anim_idx              = NULL;
+// anim.mul and anim2.mul to anim5.mul, stay mapped for as long as the library is used.
+// idx is NULL for the files that aren't there.
+static const int ANIM_FILE_COUNT = 5;
+static struct
+{
+    ml_index *idx;
+    const char *data;
+    const char *end;
+} anim_files[ANIM_FILE_COUNT];
+
+// where each body's animations are, with Bodyconv.def's remapping applied.
+// a body's entries in its file's index are first_entry + action * 5 + direction.
+static struct
+{
+    int anim_file; // index into anim_files
+    int first_entry;
+    int action_count; // 0 if the body has no animations
+} anim_bodies[ML_ANIM_BODY_COUNT];
 static ml_index           *art_idx               = NULL;
 static ml_index           *gump_idx              = NULL;
 static ml_index           *multi_idx             = NULL;
-static ml_index           *statics0_blocks_idx   = NULL;
-static ml_index           *statics1_blocks_idx   = NULL;
+static ml_index           *texmap_idx            = NULL; // NULL if there are no texmaps
+
+// everything needed to read blocks from one map (facet).
+// loaded lazily the first time a map is used, and never changed after that,
+// so once loaded it can be read from any thread without locking.
+struct ml_map_desc
+{
+    bool loaded;
+    bool present;
+    // size in number of blocks
+    int block_width;
+    int block_height;
+    const char *map_data;
+    const char *map_end;
+    const char *statics_data;
+    const char *statics_end;
+    ml_index *statics_idx;
+};
+static ml_map_desc         map_descs[ML_MAP_COUNT];
+static pthread_mutex_t     map_descs_mutex       = PTHREAD_MUTEX_INITIALIZER;
 
 static bool ml_inited = false;
 static bool mlt_inited = false;
 
+// called by the workers for every image they decoded, see mlt_set_pixel_preparer
+static void *(*pixel_prepare)(int width, int height, uint16_t *data) = NULL;
+
 
 // first a bunch of low level functions...
 // at bottom of file are exposed easy-to-use functions
@@ -175,10 +214,10 @@ static void parse_anim(const char *p, const char *end, ml_anim **animation)
 
 }
 
-static void anim(int offset, int length, ml_anim **animation)
+static void anim(int anim_file, int offset, int length, ml_anim **animation)
 {
-    const char *end;
-    const char *p = file_map("files/anim.mul", &end);
+    const char *p = anim_files[anim_file].data;
+    const char *end = anim_files[anim_file].end;
 
     assert(offset >= 0);
     assert(length >= 0);
@@ -188,8 +227,6 @@ static void anim(int offset, int length, ml_anim **animation)
 
     // do stuff...
     parse_anim(p + offset, p + offset + length, animation);
-
-    file_unmap(p, end);
 }
 
 static void parse_stat(const char *p, const char *end, ml_art **art)
@@ -449,6 +486,39 @@ static void parse_gump(const char *p, const char *end, int width, int height, ml
     }
 }
 
+// texmaps are plain squares of pixels, 64x64 or 128x128, without any
+// transparency. entries too short for their size are left NULL.
+static void parse_texmap(const char *p, const char *end, int size, ml_art **art)
+{
+    if (end - p < size * size * 2)
+    {
+        *art = NULL;
+        return;
+    }
+
+    *art = (ml_art *)malloc(sizeof(ml_art) + 2 * size * size);
+    (*art)->width = size;
+    (*art)->height = size;
+    for (int i = 0; i < size * size; i++)
+    {
+        (*art)->data[i] = read_uint16_le(&p, end) | 0x8000;
+    }
+}
+
+static void texmap(int offset, int length, int size, ml_art **art)
+{
+    const char *end;
+    const char *p = file_map("files/texmaps.mul", &end);
+
+    assert(offset >= 0);
+    assert(length >= 0);
+    assert(p + offset + length <= end);
+
+    parse_texmap(p + offset, p + offset + length, size, art);
+
+    file_unmap(p, end);
+}
+
 static void gump(int offset, int length, int width, int height, ml_gump **g)
 {
     const char *end;
@@ -464,24 +534,94 @@ static void gump(int offset, int length, int width, int height, ml_gump **g)
     file_unmap(p, end);
 }
 
+static int floor_div8(int v)
+{
+    return v >= 0 ? v / 8 : -((-v + 7) / 8);
+}
+
 static void parse_multi(const char *p, const char *end, ml_multi **m)
 {
     int num_bytes = (int)(end - p);
     int item_count = num_bytes / 16;
 
-    int multi_size = sizeof(ml_multi) + item_count * sizeof((*m)->items[0]);
+    // read the components in file order first
+    struct component_t
+    {
+        int item_id;
+        int x, y, z;
+        bool visible;
+    };
+    component_t *components = (component_t *)malloc((item_count > 0 ? item_count : 1) * sizeof(component_t));
+    int min_x = 0, min_y = 0, min_z = 0;
+    int max_x = 0, max_y = 0, max_z = 0;
+    for (int i = 0; i < item_count; i++)
+    {
+        components[i].item_id = read_uint16_le(&p, end);
+        components[i].x = read_sint16_le(&p, end);
+        components[i].y = read_sint16_le(&p, end);
+        components[i].z = read_sint16_le(&p, end);
+        components[i].visible = read_uint32_le(&p, end);
+        read_uint32_le(&p, end);
+
+        if (i == 0 || components[i].x < min_x) min_x = components[i].x;
+        if (i == 0 || components[i].y < min_y) min_y = components[i].y;
+        if (i == 0 || components[i].z < min_z) min_z = components[i].z;
+        if (i == 0 || components[i].x > max_x) max_x = components[i].x;
+        if (i == 0 || components[i].y > max_y) max_y = components[i].y;
+        if (i == 0 || components[i].z > max_z) max_z = components[i].z;
+    }
+
+    int bucket_x = floor_div8(min_x);
+    int bucket_y = floor_div8(min_y);
+    int bucket_width = floor_div8(max_x) - bucket_x + 1;
+    int bucket_height = floor_div8(max_y) - bucket_y + 1;
+    int bucket_count = bucket_width * bucket_height;
+
+    int items_size = sizeof(ml_multi) + item_count * sizeof((*m)->items[0]);
+    // keep the bucket table aligned
+    items_size = (items_size + sizeof(int) - 1) / sizeof(int) * sizeof(int);
+    int multi_size = items_size + (bucket_count + 1) * sizeof(int);
     *m = (ml_multi *)malloc(multi_size);
     (*m)->item_count = item_count;
-
+    (*m)->min_x = min_x;
+    (*m)->min_y = min_y;
+    (*m)->min_z = min_z;
+    (*m)->max_x = max_x;
+    (*m)->max_y = max_y;
+    (*m)->max_z = max_z;
+    (*m)->bucket_x = bucket_x;
+    (*m)->bucket_y = bucket_y;
+    (*m)->bucket_width = bucket_width;
+    (*m)->bucket_height = bucket_height;
+    (*m)->bucket_starts = (int *)((char *)*m + items_size);
+
+    // counting sort the components into their buckets, keeping file order within a bucket
+    int *starts = (*m)->bucket_starts;
+    memset(starts, 0, (bucket_count + 1) * sizeof(int));
     for (int i = 0; i < item_count; i++)
     {
-        (*m)->items[i].item_id = read_uint16_le(&p, end);
-        (*m)->items[i].x = read_sint16_le(&p, end);
-        (*m)->items[i].y = read_sint16_le(&p, end);
-        (*m)->items[i].z = read_sint16_le(&p, end);
-        (*m)->items[i].visible = read_uint32_le(&p, end);
-        read_uint32_le(&p, end);
+        int bucket = (floor_div8(components[i].x) - bucket_x) + (floor_div8(components[i].y) - bucket_y) * bucket_width;
+        starts[bucket + 1] += 1;
+    }
+    for (int i = 0; i < bucket_count; i++)
+    {
+        starts[i + 1] += starts[i];
     }
+    int *next = (int *)malloc((bucket_count + 1) * sizeof(int));
+    memcpy(next, starts, (bucket_count + 1) * sizeof(int));
+    for (int i = 0; i < item_count; i++)
+    {
+        int bucket = (floor_div8(components[i].x) - bucket_x) + (floor_div8(components[i].y) - bucket_y) * bucket_width;
+        int j = next[bucket]++;
+        (*m)->items[j].item_id = components[i].item_id;
+        (*m)->items[j].x = components[i].x;
+        (*m)->items[j].y = components[i].y;
+        (*m)->items[j].z = components[i].z;
+        (*m)->items[j].visible = components[i].visible;
+    }
+
+    free(next);
+    free(components);
 }
 
 static void multi(int offset, int length, ml_multi **m)
@@ -493,9 +633,6 @@ static void multi(int offset, int length, ml_multi **m)
     assert(length >= 0);
     assert(p + offset + length <= end);
 
-    printf("offset: %d, length: %d\n", offset, length);
-
-    // do stuff...
     parse_multi(p + offset, p + offset + length, m);
 
     file_unmap(p, end);
@@ -516,28 +653,16 @@ static void parse_land_block(const char *p, const char *end, ml_land_block **mb)
     }
 }
 
-static void land_block(int map, int offset, int length, ml_land_block **mb)
+static void land_block(ml_map_desc *desc, int offset, int length, ml_land_block **mb)
 {
-    assert(map == 0 || map == 1);
-
-    const char *end;
-    const char *p;
-
-    if (map == 0)
-    {
-        p = file_map("files/map0.mul", &end);
-    } else if (map == 1)
-    {
-        p = file_map("files/map1.mul", &end);
-    }
+    const char *p = desc->map_data;
+    const char *end = desc->map_end;
 
     assert(offset >= 0);
     assert(length >= 0);
     assert(p + offset + length <= end);
 
     parse_land_block(p + offset, p + offset + length, mb);
-
-    file_unmap(p, end);
 }
 
 static void parse_statics_block(const char *p, const char *end, ml_statics_block **sb)
@@ -583,28 +708,70 @@ static void parse_statics_block(const char *p, const char *end, ml_statics_block
     }
 }
 
-static void statics_block(int map, int offset, int length, ml_statics_block **sb)
+static void statics_block(ml_map_desc *desc, int offset, int length, ml_statics_block **sb)
 {
-    assert(map == 0 || map == 1);
-
-    const char *end;
-    const char *p;
-
-    if (map == 0)
-    {
-        p = file_map("files/statics0.mul", &end);
-    } else if (map == 1)
-    {
-        p = file_map("files/statics1.mul", &end);
-    }
+    const char *p = desc->statics_data;
+    const char *end = desc->statics_end;
 
     assert(offset >= 0);
     assert(length >= 0);
     assert(p + offset + length <= end);
 
     parse_statics_block(p + offset, p + offset + length, sb);
+}
 
-    file_unmap(p, end);
+static void index(const char *filename, ml_index **idx);
+
+// block heights of the known maps. widths differ between client versions
+// (map0/map1 are 768 or 896 blocks wide), so those are taken from the file size.
+static const int map_block_heights[ML_MAP_COUNT] = { 512, 512, 200, 256, 181, 512 };
+
+static void load_map_desc(int map, ml_map_desc *desc)
+{
+    char map_filename[64];
+    char statics_filename[64];
+    char staidx_filename[64];
+    sprintf(map_filename,     "files/map%d.mul",     map);
+    sprintf(statics_filename, "files/statics%d.mul", map);
+    sprintf(staidx_filename,  "files/staidx%d.mul",  map);
+
+    // empty files can't be mapped, and a map smaller than one column of blocks has no blocks
+    const int block_size = 4 + 8 * 8 * 3;
+    long map_size = file_size(map_filename);
+    desc->present = map_size >= (long)block_size * map_block_heights[map] &&
+                    file_size(statics_filename) > 0 &&
+                    file_size(staidx_filename) > 0;
+    if (!desc->present)
+    {
+        printf("[ML]: map %d not available\n", map);
+        return;
+    }
+
+    desc->map_data = file_map(map_filename, &desc->map_end);
+    desc->statics_data = file_map(statics_filename, &desc->statics_end);
+    index(staidx_filename, &desc->statics_idx);
+
+    desc->block_height = map_block_heights[map];
+    desc->block_width = (int)((desc->map_end - desc->map_data) / (block_size * desc->block_height));
+
+    printf("[ML]: loaded map %d: %dx%d blocks\n", map, desc->block_width, desc->block_height);
+}
+
+static ml_map_desc *get_map_desc(int map)
+{
+    assert(map >= 0 && map < ML_MAP_COUNT);
+
+    ml_map_desc *desc = &map_descs[map];
+
+    pthread_mutex_lock(&map_descs_mutex);
+    if (!desc->loaded)
+    {
+        load_map_desc(map, desc);
+        desc->loaded = true;
+    }
+    pthread_mutex_unlock(&map_descs_mutex);
+
+    return desc;
 }
 
 static void parse_unicode_font_metadata(const char *p, const char *end, ml_font_metadata *font_metadata)
@@ -838,89 +1005,60 @@ static void render_unicode_font_string(int font_id, std::wstring s, ml_art **res
     file_unmap(p, end);
 }
 
-/*static void parse_bodyconv(const char *p, const char *end)
+// remaps bodies to animations in anim2.mul to anim5.mul. each line holds a
+// body id followed by its animation id in anim2 to anim5, -1 where it has none.
+// the first of those whose file is there wins.
+static void parse_bodyconv(const char *p, const char *end, int remap_files[], int remap_ids[])
 {
     char line[128];
-    while (true)
+    while (p < end)
     {
         const char *lstart = p;
-        while (*p != '\n' && p < end)
+        while (p < end && *p != '\n')
         {
             p += 1;
         }
         const char *lend = p;
+        if (p < end)
+        {
+            p += 1;
+        }
 
         long line_length = lend - lstart;
-        assert(line_length < sizeof(line) - 1);
-
+        if (line_length >= (long)sizeof(line) || lstart[0] == '#')
+        {
+            continue;
+        }
         memcpy(line, lstart, line_length);
         line[line_length] = '\0';
 
-        //printf("line: %s\n", line);
-        
-        int anim1, anim2, anim3, anim4, anim5;
-        if (sscanf(line, "%d %d %d %d %d", &anim1, &anim2, &anim3, &anim4, &anim5) == 5) 
-        {
-            //printf("%d %d %d %d %d\n", anim1, anim2, anim3, anim4, anim5);
-
-            // only one of anim[2-5] is allowed to be != -1
-            assert(anim1 >= 0 && anim1 < 2048 && // anim1 in range
-                   ((anim2 == -1 && anim3 == -1 && anim4 == -1 && anim5 == -1) || // no remapping...
-                    (anim2 >= 0 && anim2 < 2048 && anim3 == -1 && anim4 == -1 && anim5 == -1) || // anim2 is the remapped one?
-                    (anim3 >= 0 && anim3 < 2048 && anim2 == -1 && anim4 == -1 && anim5 == -1) || // anim3 is the remapped one?
-                    (anim4 >= 0 && anim4 < 2048 && anim2 == -1 && anim3 == -1 && anim5 == -1) || // anim4 is the remapped one?
-                    (anim5 >= 0 && anim5 < 2048 && anim2 == -1 && anim3 == -1 && anim4 == -1))); // anim5 is the remapped one?
-            int anim_file = -1, anim_id = -1;
-            if (anim2 != -1)
-            {
-                anim_file = 2;
-                anim_id = anim2;
-            }
-            if (anim3 != -1)
-            {
-                anim_file = 3;
-                anim_id = anim3;
-            }
-            if (anim4 != -1)
-            {
-                anim_file = 4;
-                anim_id = anim4;
-            }
-            if (anim5 != -1)
-            {
-                anim_file = 5;
-                anim_id = anim5;
-            }
-            if (anim_file != -1)
-            {
-                anim_remap_table[anim1].anim_file = anim_file;
-                anim_remap_table[anim1].anim_id = anim_id;
-
-                //printf("remapping %d -> %d %d\n", anim1, anim_file, anim_id);
-            }
-        }
-
-        // reached end of file?
-        if (p == end)
+        int ids[ANIM_FILE_COUNT] = { -1, -1, -1, -1, -1 };
+        int n = sscanf(line, "%d %d %d %d %d", &ids[0], &ids[1], &ids[2], &ids[3], &ids[4]);
+        if (n < 2 || ids[0] < 0 || ids[0] >= ML_ANIM_BODY_COUNT)
         {
-            break;
+            continue;
         }
-        else
+        for (int i = 1; i < ANIM_FILE_COUNT; i++)
         {
-            p += 1;
+            if (ids[i] >= 0 && ids[i] < ML_ANIM_BODY_COUNT && anim_files[i].idx != NULL)
+            {
+                remap_files[ids[0]] = i;
+                remap_ids[ids[0]] = ids[i];
+                break;
+            }
         }
     }
 }
 
-static void bodyconv()
+static void bodyconv(int remap_files[], int remap_ids[])
 {
     const char *end;
     const char *p = file_map("files/Bodyconv.def", &end);
 
-    parse_bodyconv(p, end);
+    parse_bodyconv(p, end, remap_files, remap_ids);
 
     file_unmap(p, end);
-}*/
+}
 
 static void parse_index(const char *p, const char *end, ml_index **idx)
 {
@@ -1004,7 +1142,7 @@ static void parse_tiledata(const char *p, const char *end)
         }
         ml_tile_data_entry *tile_data = &tile_datas[i];
         tile_data->flags = read_uint64_le(&p, end);
-        tile_data->texture = read_uint16_le(&p, end); // hmm can this be used instead of the rotation of land gfx?
+        tile_data->texture = read_uint16_le(&p, end); // texmap for sloped tiles, see ml_read_texmap
         read_ascii_fixed(&p, end, tile_data->name, 20);
 
         //printf("%d: %08llx %d %s\n", i, (unsigned long long)flags, texture, name);
@@ -1204,55 +1342,68 @@ static void read_unicode_font_metadata()
 }
 
 
+// where a body's animations start in its anim file's index, and how many actions it has.
 // see https://github.com/fdsprod/OpenUO/blob/master/OpenUO.Ultima.PresentationFramework/Adapters/AnimationImageSourceStorageAdapter.cs
-static int calc_anim_id(int anim_file, int body_id, int action, int direction)
+static void anim_layout(int anim_file, int body_id, int *first_entry, int *action_count)
 {
-    int anim_id;
-    if (anim_file == 1) {
-        if      (body_id < 200) { anim_id = body_id * 110; }
-        else if (body_id < 400) { anim_id = 22000 + ((body_id - 200) * 65); }
-        else                    { anim_id = 35000 + ((body_id - 400) * 175); }
+    // monsters have 22 actions, animals 13 and humans 35, each in 5 directions.
+    // the files differ in which body ids are which.
+    if (anim_file == 0 || anim_file == 3) {
+        if      (body_id < 200) { *first_entry = body_id * 110;                   *action_count = 22; }
+        else if (body_id < 400) { *first_entry = 22000 + ((body_id - 200) * 65);  *action_count = 13; }
+        else                    { *first_entry = 35000 + ((body_id - 400) * 175); *action_count = 35; }
     }
-    else if (anim_file == 2) {
-        if (body_id < 200) { anim_id = body_id * 110; }
-        else               { anim_id = 22000 + ((body_id - 200) * 65); }
+    else if (anim_file == 1) {
+        if (body_id < 200) { *first_entry = body_id * 110;                  *action_count = 22; }
+        else               { *first_entry = 22000 + ((body_id - 200) * 65); *action_count = 13; }
     }
-    else if (anim_file == 3) {
-        if      (body_id < 300) { anim_id = body_id * 65; }
-        else if (body_id < 400) { anim_id = 33000 + ((body_id - 300) * 110); }
-        else                    { anim_id = 35000 + ((body_id - 400) * 175); }
-    }
-    else if (anim_file == 4) {
-        if      (body_id < 200) { anim_id = body_id * 110; }
-        else if (body_id < 400) { anim_id = 22000 + ((body_id - 200) * 65); }
-        else                    { anim_id = 35000 + ((body_id - 400) * 175); }
+    else if (anim_file == 2) {
+        if      (body_id < 300) { *first_entry = body_id * 65;                    *action_count = 13; }
+        else if (body_id < 400) { *first_entry = 33000 + ((body_id - 300) * 110); *action_count = 22; }
+        else                    { *first_entry = 35000 + ((body_id - 400) * 175); *action_count = 35; }
     }
     else {
-        if (body_id < 200 && body_id != 34) { anim_id = body_id * 110; }
-        else                                { anim_id = 35000 + ((body_id - 400) * 65); }
+        if (body_id < 200 && body_id != 34) { *first_entry = body_id * 110;                  *action_count = 22; }
+        else                                { *first_entry = 35000 + ((body_id - 400) * 65); *action_count = 13; }
     }
-
-    anim_id += action * 5;
-
-    // there are actually only 5 directions... the remaining 3 are generated by flipping along x axis
-    if (direction <= 4) { anim_id += direction; }
-    else { anim_id += direction - (direction - 4) * 2; }
-
-    bool flip = direction > 4;
-
-    return anim_id;
 }
 
+static void init_anim_bodies()
+{
+    static int remap_files[ML_ANIM_BODY_COUNT];
+    static int remap_ids[ML_ANIM_BODY_COUNT];
+    for (int i = 0; i < ML_ANIM_BODY_COUNT; i++)
+    {
+        remap_files[i] = 0;
+        remap_ids[i] = i;
+    }
+    if (file_exists("files/Bodyconv.def"))
+    {
+        bodyconv(remap_files, remap_ids);
+    }
 
-
-
-
-/*static struct {
-    int anim_file;
-    int anim_id;
-} anim_remap_table[2048];*/
+    for (int i = 0; i < ML_ANIM_BODY_COUNT; i++)
+    {
+        int anim_file = remap_files[i];
+        int first_entry, action_count;
+        anim_layout(anim_file, remap_ids[i], &first_entry, &action_count);
+        // bodies past the end of the index have nothing
+        if (first_entry < 0 || first_entry + action_count * 5 > anim_files[anim_file].idx->entry_count)
+        {
+            action_count = 0;
+        }
+        anim_bodies[i].anim_file = anim_file;
+        anim_bodies[i].first_entry = first_entry;
+        anim_bodies[i].action_count = action_count;
+    }
+}
 
 // exposed interface
+void ml_free_pixels(void *p)
+{
+    free(p);
+}
+
 void ml_init()
 {
     assert(!ml_inited);
@@ -1280,28 +1431,36 @@ void ml_init()
 
     printf("[ML]: Reading indexes...\n");
 
-    index("files/anim.idx"   , &anim_idx);
+    for (int i = 0; i < ANIM_FILE_COUNT; i++)
+    {
+        char idx_filename[64], mul_filename[64];
+        const char *suffix[ANIM_FILE_COUNT] = { "", "2", "3", "4", "5" };
+        snprintf(idx_filename, sizeof(idx_filename), "files/anim%s.idx", suffix[i]);
+        snprintf(mul_filename, sizeof(mul_filename), "files/anim%s.mul", suffix[i]);
+        // anim.mul has to be there, the others are optional
+        if (i == 0 || (file_exists(idx_filename) && file_exists(mul_filename)))
+        {
+            index(idx_filename, &anim_files[i].idx);
+            anim_files[i].data = file_map(mul_filename, &anim_files[i].end);
+        }
+    }
     index("files/artidx.mul" , &art_idx);
     index("files/Gumpidx.mul", &gump_idx);
     index("files/multi.idx", &multi_idx);
-    index("files/staidx0.mul", &statics0_blocks_idx);
-    index("files/staidx1.mul", &statics1_blocks_idx);
-    assert(anim_idx           != NULL);
+    if (file_exists("files/texidx.mul") && file_exists("files/texmaps.mul"))
+    {
+        index("files/texidx.mul", &texmap_idx);
+    }
+    assert(anim_files[0].idx  != NULL);
     assert(art_idx            != NULL);
-    assert(statics0_blocks_idx != NULL);
-    assert(statics1_blocks_idx != NULL);
+    // map/statics files are loaded on first use, see get_map_desc
 
-    //printf("anim entries:           %d\n", anim_idx->entry_count);
+    //printf("anim entries:           %d\n", anim_files[0].idx->entry_count);
     //printf("art entries:            %d\n", art_idx->entry_count);
     //printf("statics blocks entries: %d\n", statics_blocks_idx->entry_count);
 
-    //printf("[ML]: Initing bodyconv table...\n");
-    // init anim_remap_table
-    /*for (int i = 0; i < 2048; i++)
-    {
-        anim_remap_table[i].anim_file = 1;
-        anim_remap_table[i].anim_id = i;
-    }*/
+    printf("[ML]: Initing bodyconv table...\n");
+    init_anim_bodies();
 
     printf("[ML]: Init OK!\n");
 
@@ -1352,24 +1511,171 @@ static ml_anim *create_empty_animation()
 ml_anim *ml_read_anim(int body_id, int action, int direction)
 {
     assert(ml_inited);
-    // TODO: first remap body id according to bodyconv?
-    int anim_file = 1;
-    int anim_id = calc_anim_id(anim_file, body_id, action, direction);
+    assert(body_id >= 0 && body_id < ML_ANIM_BODY_COUNT);
+    assert(action >= 0 && direction >= 0 && direction < 5);
 
-    assert(anim_id >= 0 && anim_id < anim_idx->entry_count);
+    if (action >= anim_bodies[body_id].action_count)
+    {
+        return create_empty_animation();
+    }
+    int anim_file = anim_bodies[body_id].anim_file;
+    int anim_id = anim_bodies[body_id].first_entry + action * 5 + direction;
 
     ml_anim *animation;
-    int offset = anim_idx->entries[anim_id].offset;
-    int length = anim_idx->entries[anim_id].length;
+    int offset = anim_files[anim_file].idx->entries[anim_id].offset;
+    int length = anim_files[anim_file].idx->entries[anim_id].length;
     if (offset == -1 || length == -1)
     {
         return create_empty_animation();
     }
-    anim(offset, length, &animation);
+    anim(anim_file, offset, length, &animation);
 
     return animation;
 }
 
+// hues a pixel like blit.frag does: the red channel picks one of the hue's
+// colors, for every pixel or only for grey ones
+static uint16_t hue_pixel(uint16_t pixel, int hue_id)
+{
+    int hue = hue_id & 0x7fff;
+    // hues we don't know are left out, like the gpu does
+    if (hue == 0 || hue > 8*375 || (pixel & 0x8000) == 0)
+    {
+        return pixel;
+    }
+    int r = (pixel >> 10) & 0x1f;
+    int g = (pixel >>  5) & 0x1f;
+    int b = (pixel >>  0) & 0x1f;
+    bool only_grey = (hue_id & 0x8000) == 0;
+    if (only_grey && !(r == g && g == b))
+    {
+        return pixel;
+    }
+    return ml_get_hue(hue - 1)->colors[r] | 0x8000;
+}
+
+ml_anim *ml_compose_anim(ml_anim_composition *composition)
+{
+    assert(ml_inited);
+    assert(composition->layer_count >= 1 && composition->layer_count <= ML_MAX_COMPOSED_LAYERS);
+
+    ml_anim *layers[ML_MAX_COMPOSED_LAYERS];
+    for (int i = 0; i < composition->layer_count; i++)
+    {
+        layers[i] = ml_read_anim(composition->layers[i].body_id, composition->action, composition->direction);
+    }
+
+    // the composite has the body's frames, every frame as big as all layers' frames together.
+    // drawn layered, every layer shows frame t % its own frame count at time
+    // t. the composite's frame t % frame_count only has the same layer frames
+    // in it if each layer's frame count divides the body's, otherwise it is
+    // left to be drawn layered.
+    const int max_frames = 64;
+    int frame_count = layers[0]->frame_count;
+    bool composable = frame_count > 0 && frame_count <= max_frames;
+    for (int i = 1; i < composition->layer_count && composable; i++)
+    {
+        composable = layers[i]->frame_count == 0 || frame_count % layers[i]->frame_count == 0;
+    }
+    if (!composable)
+    {
+        for (int i = 0; i < composition->layer_count; i++)
+        {
+            free(layers[i]);
+        }
+        return NULL;
+    }
+
+    int min_xs[max_frames], min_ys[max_frames], max_xs[max_frames], max_ys[max_frames];
+    int total_frames_size = 0;
+    for (int f = 0; f < frame_count; f++)
+    {
+        min_xs[f] = min_ys[f] = 0x7fffffff;
+        max_xs[f] = max_ys[f] = -0x7fffffff;
+        for (int i = 0; i < composition->layer_count; i++)
+        {
+            if (layers[i]->frame_count == 0)
+            {
+                continue;
+            }
+            // frames are placed relative to the mobile's position on screen, see parse_anim
+            int j = f % layers[i]->frame_count;
+            int width = layers[i]->frames[j].width;
+            int height = layers[i]->frames[j].height;
+            if (width == 0 || height == 0)
+            {
+                continue;
+            }
+            int left = -layers[i]->frames[j].center_x;
+            int top = -layers[i]->frames[j].center_y - height;
+            min_xs[f] = std::min(min_xs[f], left);
+            min_ys[f] = std::min(min_ys[f], top);
+            max_xs[f] = std::max(max_xs[f], left + width);
+            max_ys[f] = std::max(max_ys[f], top + height);
+        }
+        if (min_xs[f] > max_xs[f])
+        {
+            min_xs[f] = max_xs[f] = min_ys[f] = max_ys[f] = 0;
+        }
+        total_frames_size += 2 * (max_xs[f] - min_xs[f]) * (max_ys[f] - min_ys[f]);
+    }
+
+    int anim_meta_data_size = sizeof(ml_anim) + frame_count * sizeof(layers[0]->frames[0]);
+    ml_anim *anim = (ml_anim *)malloc(anim_meta_data_size + total_frames_size);
+    anim->frame_count = frame_count;
+
+    char *frame_data_start = ((char *)anim) + anim_meta_data_size;
+    int offset_accum = 0;
+    for (int f = 0; f < frame_count; f++)
+    {
+        int width = max_xs[f] - min_xs[f];
+        int height = max_ys[f] - min_ys[f];
+        anim->frames[f].center_x = -min_xs[f];
+        anim->frames[f].center_y = -max_ys[f];
+        anim->frames[f].width = width;
+        anim->frames[f].height = height;
+        anim->frames[f].data = (uint16_t *)(frame_data_start + offset_accum);
+        offset_accum += 2 * width * height;
+
+        uint16_t *target_data = anim->frames[f].data;
+        memset(target_data, 0, 2 * width * height);
+
+        // bottom layer first, later layers cover it
+        for (int i = 0; i < composition->layer_count; i++)
+        {
+            if (layers[i]->frame_count == 0)
+            {
+                continue;
+            }
+            int j = f % layers[i]->frame_count;
+            int layer_width = layers[i]->frames[j].width;
+            int layer_height = layers[i]->frames[j].height;
+            int left = -layers[i]->frames[j].center_x - min_xs[f];
+            int top = -layers[i]->frames[j].center_y - layer_height - min_ys[f];
+            int hue_id = composition->layers[i].hue_id;
+            for (int y = 0; y < layer_height; y++)
+            {
+                uint16_t *src = &layers[i]->frames[j].data[y * layer_width];
+                uint16_t *dst = &target_data[(top + y) * width + left];
+                for (int x = 0; x < layer_width; x++)
+                {
+                    if (src[x] & 0x8000)
+                    {
+                        dst[x] = hue_pixel(src[x], hue_id);
+                    }
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < composition->layer_count; i++)
+    {
+        free(layers[i]);
+    }
+
+    return anim;
+}
+
 ml_art *ml_read_land_art(int land_id)
 {
     assert(ml_inited);
@@ -1385,6 +1691,31 @@ ml_art *ml_read_land_art(int land_id)
     return art;
 }
 
+ml_art *ml_read_texmap(int texture_id)
+{
+    assert(ml_inited);
+
+    if (texmap_idx == NULL || texture_id < 0 || texture_id >= texmap_idx->entry_count)
+    {
+        return NULL;
+    }
+
+    int offset = texmap_idx->entries[texture_id].offset;
+    int length = texmap_idx->entries[texture_id].length;
+    if (offset == -1 || length <= 0)
+    {
+        return NULL;
+    }
+
+    // the extra field says which size it is: 1 for 128x128, 0 for 64x64
+    int size = texmap_idx->entries[texture_id].extra == 1 ? 128 : 64;
+
+    ml_art *art = NULL;
+    texmap(offset, length, size, &art);
+
+    return art;
+}
+
 ml_art *ml_read_static_art(int item_id)
 {
     assert(ml_inited);
@@ -1401,6 +1732,22 @@ ml_art *ml_read_static_art(int item_id)
     return art;
 }
 
+bool ml_has_static_art(int item_id)
+{
+    assert(ml_inited);
+    int id = 0x4000 + item_id;
+    return item_id >= 0 && id < art_idx->entry_count &&
+           art_idx->entries[id].offset != -1 && art_idx->entries[id].length > 0;
+}
+
+bool ml_has_gump(int gump_id)
+{
+    assert(ml_inited);
+    return gump_id >= 0 && gump_id < gump_idx->entry_count &&
+           gump_idx->entries[gump_id].offset != -1 && gump_idx->entries[gump_id].length > 0 &&
+           gump_idx->entries[gump_id].extra != 0;
+}
+
 ml_gump *ml_read_gump(int gump_id)
 {
     assert(ml_inited);
@@ -1435,24 +1782,41 @@ ml_multi *ml_read_multi(int multi_id)
     return m;
 }
 
+bool ml_get_map_dimensions(int map, int *block_width, int *block_height)
+{
+    assert(ml_inited);
+
+    if (map < 0 || map >= ML_MAP_COUNT)
+    {
+        return false;
+    }
+
+    ml_map_desc *desc = get_map_desc(map);
+    if (!desc->present)
+    {
+        return false;
+    }
+
+    *block_width = desc->block_width;
+    *block_height = desc->block_height;
+    return true;
+}
+
 ml_land_block *ml_read_land_block(int map, int block_x, int block_y)
 {
     assert(ml_inited);
-    assert(map == 1);
-    assert(map == 0 || map == 1);
 
-    // size in number of blocks
-    int map_block_width = 768;//896;
-    int map_block_height = 512;//512;
+    ml_map_desc *desc = get_map_desc(map);
+    assert(desc->present);
 
-    assert(block_x >= 0 && block_x < map_block_width);
-    assert(block_y >= 0 && block_y < map_block_height);
+    assert(block_x >= 0 && block_x < desc->block_width);
+    assert(block_y >= 0 && block_y < desc->block_height);
 
     int length = 4 + 8 * 8 * 3;
-    int offset = (block_x * map_block_height + block_y) * length;
+    int offset = (block_x * desc->block_height + block_y) * length;
 
     ml_land_block *mb = NULL;
-    land_block(map, offset, length, &mb);
+    land_block(desc, offset, length, &mb);
 
     return mb;
 }
@@ -1472,34 +1836,19 @@ static ml_statics_block *create_empty_statics_block()
 ml_statics_block *ml_read_statics_block(int map, int block_x, int block_y)
 {
     assert(ml_inited);
-    assert(map == 1);
-    assert(map == 0 || map == 1);
-
-    // size in number of blocks
-    int map_block_width = 768;//896;
-    int map_block_height = 512;//512;
 
-    assert(block_x >= 0 && block_x < map_block_width);
-    assert(block_y >= 0 && block_y < map_block_height);
+    ml_map_desc *desc = get_map_desc(map);
+    assert(desc->present);
 
-    int block_num = block_x * map_block_height + block_y;
+    assert(block_x >= 0 && block_x < desc->block_width);
+    assert(block_y >= 0 && block_y < desc->block_height);
 
-    assert(map != 0 || (block_num >= 0 && block_num < statics0_blocks_idx->entry_count));
-    assert(map != 1 || (block_num >= 0 && block_num < statics1_blocks_idx->entry_count));
+    int block_num = block_x * desc->block_height + block_y;
 
-    int offset = -1;
-    int length = -1;
+    assert(block_num >= 0 && block_num < desc->statics_idx->entry_count);
 
-    if (map == 0)
-    {
-        offset = statics0_blocks_idx->entries[block_num].offset;
-        length = statics0_blocks_idx->entries[block_num].length;
-    }
-    else if (map == 1)
-    {
-        offset = statics1_blocks_idx->entries[block_num].offset;
-        length = statics1_blocks_idx->entries[block_num].length;
-    }
+    int offset = desc->statics_idx->entries[block_num].offset;
+    int length = desc->statics_idx->entries[block_num].length;
 
     if (offset == -1)
     {
@@ -1508,7 +1857,7 @@ ml_statics_block *ml_read_statics_block(int map, int block_x, int block_y)
     else
     {
         ml_statics_block *sb = NULL;
-        statics_block(map, offset, length, &sb);
+        statics_block(desc, offset, length, &sb);
 
         return sb;
     }
@@ -1564,6 +1913,20 @@ public:
 
     }
 
+    // safe to use with several consumers, unlike empty() followed by pop()
+    bool try_pop(T *item)
+    {
+        pthread_mutex_lock(&mutex);
+        bool res = !queue.empty();
+        if (res)
+        {
+            *item = queue.front();
+            queue.pop();
+        }
+        pthread_mutex_unlock(&mutex);
+        return res;
+    }
+
     std::queue<T> queue;
     pthread_mutex_t mutex;
 };
@@ -1572,8 +1935,11 @@ enum ml_type
 {
     ANIM,
     LAND_ART,
+    TEXMAP,
+    COMPOSED_ANIM,
     STATIC_ART,
     GUMP,
+    MULTI,
     LAND_BLOCK,
     STATICS_BLOCK,
     SHUTDOWN
@@ -1597,6 +1963,19 @@ struct async_req_t
             void (*callback)(int land_id, ml_art *l);
         } land_art;
         struct
+        {
+            int texture_id;
+            ml_art *res;
+            void (*callback)(int texture_id, ml_art *t);
+        } texmap;
+        struct
+        {
+            uint64_t key;
+            ml_anim_composition *composition; // a copy, freed after the callback
+            ml_anim *res;
+            void (*callback)(uint64_t key, ml_anim *a);
+        } composed_anim;
+        struct
         {
             int item_id;
             ml_art *res;
@@ -1609,6 +1988,12 @@ struct async_req_t
             void (*callback)(int gump_id, ml_gump *s);
         } gump;
         struct
+        {
+            int multi_id;
+            ml_multi *res;
+            void (*callback)(int multi_id, ml_multi *m);
+        } multi;
+        struct
         {
             int map, block_x, block_y;
             ml_land_block *res;
@@ -1624,24 +2009,57 @@ struct async_req_t
 };
 
 Queue<async_req_t> async_requests;
+// only worked on while async_requests is empty
+Queue<async_req_t> async_prefetch_requests;
 Queue<async_req_t> async_responses;
 
-static pthread_t worker_thread;
-static bool thread_running = false;
+// where the mlt_read_* functions put their requests, see mlt_begin_prefetch
+static Queue<async_req_t> *request_queue = &async_requests;
+
+// several workers, so that e.g. a facet change can load a whole new area in parallel
+static const int mlt_worker_count = 4;
+static pthread_t worker_threads[mlt_worker_count];
+static int running_workers = 0;
+
+static void prepare_art(ml_art *art)
+{
+    if (art != NULL)
+    {
+        art->prepared = pixel_prepare != NULL ? pixel_prepare(art->width, art->height, art->data) : NULL;
+    }
+}
+
+static void prepare_gump(ml_gump *gump)
+{
+    if (gump != NULL)
+    {
+        gump->prepared = pixel_prepare != NULL ? pixel_prepare(gump->width, gump->height, gump->data) : NULL;
+    }
+}
+
+static void prepare_anim(ml_anim *anim)
+{
+    if (anim != NULL)
+    {
+        for (int i = 0; i < anim->frame_count; i++)
+        {
+            anim->frames[i].prepared = pixel_prepare != NULL ? pixel_prepare(anim->frames[i].width, anim->frames[i].height, anim->frames[i].data) : NULL;
+        }
+    }
+}
 
 static void *mlt_worker_thread_main(void *)
 {
-    thread_running = true;
     while (true)
     {
         // wait for request
         //printf("slave: waiting...\n");
-        while (async_requests.empty())
+        async_req_t req;
+        while (!async_requests.try_pop(&req) && !async_prefetch_requests.try_pop(&req))
         {
             usleep(1000);
         }
         //printf("slave: req queue not empty!\n");
-        async_req_t req = async_requests.pop();
         
         /*printf("slave: got req: %s.\n", (req.type == ANIM) ? "anim" :
                             (req.type == LAND_ART) ? "land art" :
@@ -1653,18 +2071,36 @@ static void *mlt_worker_thread_main(void *)
         if (req.type == ANIM)
         {
             req.anim.res = ml_read_anim(req.anim.body_id, req.anim.action, req.anim.direction);
+            prepare_anim(req.anim.res);
         }
         else if (req.type == LAND_ART)
         {
             req.land_art.res = ml_read_land_art(req.land_art.land_id);
+            prepare_art(req.land_art.res);
+        }
+        else if (req.type == TEXMAP)
+        {
+            req.texmap.res = ml_read_texmap(req.texmap.texture_id);
+            prepare_art(req.texmap.res);
+        }
+        else if (req.type == COMPOSED_ANIM)
+        {
+            req.composed_anim.res = ml_compose_anim(req.composed_anim.composition);
+            prepare_anim(req.composed_anim.res);
         }
         else if (req.type == STATIC_ART)
         {
             req.static_art.res = ml_read_static_art(req.static_art.item_id);
+            prepare_art(req.static_art.res);
         }
         else if (req.type == GUMP)
         {
             req.gump.res = ml_read_gump(req.gump.gump_id);
+            prepare_gump(req.gump.res);
+        }
+        else if (req.type == MULTI)
+        {
+            req.multi.res = ml_read_multi(req.multi.multi_id);
         }
         else if (req.type == LAND_BLOCK)
         {
@@ -1689,7 +2125,7 @@ static void *mlt_worker_thread_main(void *)
         //printf("slave: sent response.\n");
     }
     printf("[MLT] slave thread: exiting.\n");
-    thread_running = false;
+    __sync_fetch_and_sub(&running_workers, 1);
     return NULL;
 }
 
@@ -1699,7 +2135,12 @@ void mlt_init()
     assert(ml_inited);
     assert(!mlt_inited);
 
-    pthread_create(&worker_thread, NULL, mlt_worker_thread_main, NULL);
+    // count workers as running up front, so mlt_still_working can't miss one that hasn't started yet
+    running_workers = mlt_worker_count;
+    for (int i = 0; i < mlt_worker_count; i++)
+    {
+        pthread_create(&worker_threads[i], NULL, mlt_worker_thread_main, NULL);
+    }
 
     printf("[ML]: Threaded part inited!\n");
 
@@ -1718,7 +2159,7 @@ void mlt_read_anim(int body_id, int action, int direction, void (*callback)(int
     req.anim.direction = direction;
     req.anim.callback  = callback;
 
-    async_requests.push(req);
+    request_queue->push(req);
 }
 
 void mlt_read_land_art(int land_id, void (*callback)(int land_id, ml_art *l))
@@ -1730,7 +2171,33 @@ void mlt_read_land_art(int land_id, void (*callback)(int land_id, ml_art *l))
     req.land_art.land_id  = land_id;
     req.land_art.callback = callback;
     
-    async_requests.push(req);
+    request_queue->push(req);
+}
+
+void mlt_read_texmap(int texture_id, void (*callback)(int texture_id, ml_art *t))
+{
+    assert(mlt_inited);
+
+    async_req_t req;
+    req.type = TEXMAP;
+    req.texmap.texture_id = texture_id;
+    req.texmap.callback   = callback;
+
+    request_queue->push(req);
+}
+
+void mlt_compose_anim(uint64_t key, ml_anim_composition *composition, void (*callback)(uint64_t key, ml_anim *a))
+{
+    assert(mlt_inited);
+
+    async_req_t req;
+    req.type = COMPOSED_ANIM;
+    req.composed_anim.key = key;
+    req.composed_anim.composition = (ml_anim_composition *)malloc(sizeof(ml_anim_composition));
+    memcpy(req.composed_anim.composition, composition, sizeof(ml_anim_composition));
+    req.composed_anim.callback = callback;
+
+    request_queue->push(req);
 }
 
 void mlt_read_static_art(int item_id, void (*callback)(int item_id, ml_art *s))
@@ -1742,7 +2209,7 @@ void mlt_read_static_art(int item_id, void (*callback)(int item_id, ml_art *s))
     req.static_art.item_id = item_id;
     req.static_art.callback  = callback;
     
-    async_requests.push(req);
+    request_queue->push(req);
 }
 
 void mlt_read_gump(int gump_id, void (*callback)(int gump_id, ml_gump *g))
@@ -1754,7 +2221,19 @@ void mlt_read_gump(int gump_id, void (*callback)(int gump_id, ml_gump *g))
     req.gump.gump_id = gump_id;
     req.gump.callback  = callback;
     
-    async_requests.push(req);
+    request_queue->push(req);
+}
+
+void mlt_read_multi(int multi_id, void (*callback)(int multi_id, ml_multi *m))
+{
+    assert(mlt_inited);
+
+    async_req_t req;
+    req.type = MULTI;
+    req.multi.multi_id = multi_id;
+    req.multi.callback = callback;
+    
+    request_queue->push(req);
 }
 
 void mlt_read_land_block(int map, int block_x, int block_y, void (*callback)(int map, int block_x, int block_y, ml_land_block *lb))
@@ -1768,7 +2247,7 @@ void mlt_read_land_block(int map, int block_x, int block_y, void (*callback)(int
     req.land_block.block_y  = block_y;
     req.land_block.callback = callback;
     
-    async_requests.push(req);
+    request_queue->push(req);
 }
 
 void mlt_read_statics_block(int map, int block_x, int block_y, void (*callback)(int map, int block_x, int block_y, ml_statics_block *sb))
@@ -1782,7 +2261,26 @@ void mlt_read_statics_block(int map, int block_x, int block_y, void (*callback)(
     req.statics_block.block_y  = block_y;
     req.statics_block.callback = callback;
     
-    async_requests.push(req);
+    request_queue->push(req);
+}
+
+void mlt_set_pixel_preparer(void *(*prepare)(int width, int height, uint16_t *data))
+{
+    pixel_prepare = prepare;
+}
+
+void mlt_begin_prefetch()
+{
+    assert(mlt_inited);
+    assert(request_queue == &async_requests);
+    request_queue = &async_prefetch_requests;
+}
+
+void mlt_end_prefetch()
+{
+    assert(mlt_inited);
+    assert(request_queue == &async_prefetch_requests);
+    request_queue = &async_requests;
 }
 
 void mlt_stop_worker_thread()
@@ -1791,15 +2289,19 @@ void mlt_stop_worker_thread()
 
     async_req_t req;
     req.type = SHUTDOWN;
-    
-    async_requests.push(req);
+
+    // one for each worker, every worker exits after consuming one
+    for (int i = 0; i < mlt_worker_count; i++)
+    {
+        async_requests.push(req);
+    }
 }
 
 bool mlt_still_working()
 {
     assert(mlt_inited);
 
-    return thread_running || !async_responses.empty();
+    return __sync_fetch_and_add(&running_workers, 0) > 0 || !async_responses.empty();
 }
 
 void mlt_process_callbacks()
@@ -1830,6 +2332,19 @@ void mlt_process_callbacks()
             ml_art *res = response.land_art.res;
             response.land_art.callback(land_id, res);
         }
+        else if (response.type == TEXMAP)
+        {
+            int texture_id = response.texmap.texture_id;
+            ml_art *res    = response.texmap.res;
+            response.texmap.callback(texture_id, res);
+        }
+        else if (response.type == COMPOSED_ANIM)
+        {
+            uint64_t key = response.composed_anim.key;
+            ml_anim *res = response.composed_anim.res;
+            free(response.composed_anim.composition);
+            response.composed_anim.callback(key, res);
+        }
         else if (response.type == STATIC_ART)
         {
             int item_id = response.static_art.item_id;
@@ -1842,6 +2357,12 @@ void mlt_process_callbacks()
             ml_gump *res = response.gump.res;
             response.gump.callback(gump_id, res);
         }
+        else if (response.type == MULTI)
+        {
+            int multi_id  = response.multi.multi_id;
+            ml_multi *res = response.multi.res;
+            response.multi.callback(multi_id, res);
+        }
         else if (response.type == LAND_BLOCK)
         {
             int map            = response.land_block.map;
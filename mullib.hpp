@@ -69,6 +69,7 @@ struct ml_anim
         int width;
         int height;
         uint16_t *data;
+        void *prepared; // see mlt_set_pixel_preparer
     } frames[];
 };
 
@@ -76,6 +77,7 @@ struct ml_art
 {
     int width;
     int height;
+    void *prepared; // see mlt_set_pixel_preparer
     uint16_t data[];
 };
 
@@ -83,12 +85,23 @@ struct ml_gump
 {
     int width;
     int height;
+    void *prepared; // see mlt_set_pixel_preparer
     uint16_t data[];
 };
 
+// components are sorted into buckets of 8x8 tiles (relative to the multi's
+// origin), so only the ones near the screen need to be looked at.
+// bucket (bx, by) holds items[bucket_starts[i]] up to items[bucket_starts[i + 1]],
+// where i = (bx - bucket_x) + (by - bucket_y) * bucket_width.
 struct ml_multi
 {
     int item_count;
+    // bounding box of all components, relative to the origin
+    int min_x, min_y, min_z;
+    int max_x, max_y, max_z;
+    int bucket_x, bucket_y;
+    int bucket_width, bucket_height;
+    int *bucket_starts; // points into the same allocation, after items
     struct
     {
         int item_id;
@@ -142,8 +155,33 @@ struct ml_font
     uint16_t map_data[];
 };
 
+const int ML_ANIM_BODY_COUNT = 2048;
+
+// animations drawn on top of each other, like a body and its equipment
+const int ML_MAX_COMPOSED_LAYERS = 33;
+struct ml_anim_composition
+{
+    int action;
+    int direction;
+    int layer_count;
+    struct
+    {
+        int body_id;
+        int hue_id;
+    } layers[ML_MAX_COMPOSED_LAYERS]; // bottom first
+};
+
+// number of maps (facets) known to the library
+const int ML_MAP_COUNT = 6;
+
 void ml_init();
 
+// frees an ml_art, ml_gump or ml_anim
+void ml_free_pixels(void *p);
+
+// size of a map in blocks. returns false if the map's files aren't available
+bool ml_get_map_dimensions(int map, int *block_width, int *block_height);
+
 void ml_get_font_string_dimensions(int font_id, std::wstring s, int *width, int *height);
 
 // these return instantly, so there are no asynchronous versions of them
@@ -154,11 +192,24 @@ ml_hue             *ml_get_hue(int hue_id);
 const char         *ml_get_cliloc(int cliloc_id);
 ml_font_metadata   *ml_get_unicode_font_metadata(int font_id);
 
-// it is the caller's responsibility to free the memory returned from these
+// it is the caller's responsibility to free the memory returned from these,
+// art, gumps and animations with ml_free_pixels
+// body ids are below this, and direction is one of the 5 stored ones.
+// bodies are remapped to anim2.mul to anim5.mul according to Bodyconv.def.
 ml_anim *ml_read_anim(int body_id, int action, int direction);
+// the layers' frames hued and flattened into one animation, with the first
+// layer's frame count. NULL if the layers' frames don't line up with the
+// first layer's, see the function.
+ml_anim *ml_compose_anim(ml_anim_composition *composition);
 ml_art *ml_read_land_art(int land_id);
+// the texture stretched over sloped land tiles, see ml_tile_data_entry.
+// NULL if there is none.
+ml_art *ml_read_texmap(int texture_id);
 ml_art *ml_read_static_art(int item_id);
 ml_gump *ml_read_gump(int gump_id);
+// whether the data files have it, any id may be asked about
+bool ml_has_static_art(int item_id);
+bool ml_has_gump(int gump_id);
 ml_multi *ml_read_multi(int multi_id);
 ml_land_block *ml_read_land_block(int map, int block_x, int block_y);
 ml_statics_block *ml_read_statics_block(int map, int block_x, int block_y);
@@ -170,13 +221,28 @@ ml_art *ml_render_string(int font_id, std::wstring s);
 // responses will then be dispached on the thread calling mlt_callbacks()
 void mlt_init();
 
+// the workers hand every image they decoded (art, gumps and animation frames)
+// to prepare, and store what it returns in the image's prepared field. for
+// work that is best done while the pixels are still in the worker's cache.
+// called from the worker threads, so it must be thread safe. set it before
+// anything is read, prepared is NULL without it.
+void mlt_set_pixel_preparer(void *(*prepare)(int width, int height, uint16_t *data));
+
 void mlt_read_anim(int body_id, int action, int direction, void (*callback)(int body_id, int action, int direction, ml_anim *a));
+void mlt_compose_anim(uint64_t key, ml_anim_composition *composition, void (*callback)(uint64_t key, ml_anim *a));
 void mlt_read_land_art(int land_id, void (*callback)(int land_id, ml_art *l));
+void mlt_read_texmap(int texture_id, void (*callback)(int texture_id, ml_art *t));
 void mlt_read_static_art(int item_id, void (*callback)(int item_id, ml_art *s));
 void mlt_read_gump(int gump_id, void (*callback)(int gump_id, ml_gump *g));
+void mlt_read_multi(int multi_id, void (*callback)(int multi_id, ml_multi *m));
 void mlt_read_land_block(int map, int block_x, int block_y, void (*callback)(int map, int block_x, int block_y, ml_land_block *lb));
 void mlt_read_statics_block(int map, int block_x, int block_y, void (*callback)(int map, int block_x, int block_y, ml_statics_block *sb));
 
+// requests made in between these two are only worked on when no other
+// requests are waiting, for loading things before they're needed
+void mlt_begin_prefetch();
+void mlt_end_prefetch();
+
 void mlt_stop_worker_thread();
 bool mlt_still_working();
 
@@ -1306,11 +1306,9 @@ void net_poll()
 
                     item_t *item = game_get_item(serial);
                     item->item_id = item_id;
-                    item->space = SPACETYPE_WORLD;
-                    item->loc.world.x = x;
-                    item->loc.world.y = y;
-                    item->loc.world.z = z;
                     item->hue_id = hue_id;
+                    game_place_item(item, x, y, z);
+                    game_prefetch_item(item_id);
 
                     //printf("0x1a: hue_id = %04x\n", hue_id);
 
@@ -1382,11 +1380,12 @@ void net_poll()
                     read_uint8(&p, end);
                     m->hue_id = read_uint16_be(&p, end);
                     m->flags = read_uint8(&p, end);
-                    m->x = read_uint16_be(&p, end);
-                    m->y = read_uint16_be(&p, end);
+                    int x = read_uint16_be(&p, end);
+                    int y = read_uint16_be(&p, end);
                     read_uint16_be(&p, end);
                     m->dir = read_uint8(&p, end);
-                    m->z = read_sint8(&p, end);
+                    int z = read_sint8(&p, end);
+                    game_place_mobile(m, x, y, z);
 
                     break;
                 }
@@ -1419,6 +1418,7 @@ void net_poll()
                     uint32_t item_serial = read_uint32_be(&p, end);
                     int gump_id = read_uint16_be(&p, end);
 
+                    game_prefetch_gump(gump_id);
                     game_show_container(item_serial, gump_id);
 
                     break;
@@ -1443,14 +1443,11 @@ void net_poll()
                     // item_id == 0 means just inited
                     printf("item_id: %d, space: %d\n", item->item_id, item->space);
                     assert(item->item_id == 0 || item->space == SPACETYPE_CONTAINER);
-                    item->space = SPACETYPE_CONTAINER;
-                    item->loc.container.container = container;
-                    item->loc.container.x = x;
-                    item->loc.container.y = y;
                     item->item_id = item_id;
                     item->hue_id = hue_id;
 
-                    container->container.items->push_back(item);
+                    game_container_add(container, item, x, y);
+                    game_prefetch_item(item_id);
 
                     printf("adding item to container: %08x\n", serial);
 
@@ -1482,11 +1479,14 @@ void net_poll()
                     mobile_t *m = game_get_mobile(mob_serial);
                     //printf("0x2e: hue_id = %04x\n", hue_id);
                     game_equip(m, serial, item_id, layer, hue_id);
+                    game_prefetch_mobile(m);
 
                     break;
                 }
                 case 0x3c: {
                     int item_count = read_uint16_be(&p, end);
+                    // avoid growing the item table over and over for big containers
+                    game_reserve_items(item_count);
 
                     for (int i = 0; i < item_count; i++)
                     {
@@ -1506,14 +1506,11 @@ void net_poll()
                         //item_id == 0 means just inited
                         printf("item_id: %d, space: %d\n", item->item_id, item->space);
                         assert(item->item_id == 0 || item->space == SPACETYPE_CONTAINER);
-                        item->space = SPACETYPE_CONTAINER;
-                        item->loc.container.container = container;
-                        item->loc.container.x = x;
-                        item->loc.container.y = y;
                         item->item_id = item_id;
                         item->hue_id = hue_id;
 
-                        container->container.items->push_back(item);
+                        game_container_add(container, item, x, y);
+                        game_prefetch_item(item_id);
 
                         printf("adding item to container: %08x\n", serial);
                     }
@@ -1540,9 +1537,10 @@ void net_poll()
                     mobile_t *m = game_get_mobile(mob_id);
 
                     m->body_id = read_uint16_be(&p, end);
-                    m->x = read_uint16_be(&p, end);
-                    m->y = read_uint16_be(&p, end);
-                    m->z = read_sint8(&p, end);
+                    int x = read_uint16_be(&p, end);
+                    int y = read_uint16_be(&p, end);
+                    int z = read_sint8(&p, end);
+                    game_place_mobile(m, x, y, z);
                     m->dir = read_uint8(&p, end);
                     m->hue_id = read_uint16_be(&p, end);
                     m->flags = read_uint8(&p, end);
@@ -1554,9 +1552,10 @@ void net_poll()
                     mobile_t *m = game_create_mobile(mob_serial);
 
                     m->body_id = read_uint16_be(&p, end);
-                    m->x = read_uint16_be(&p, end);
-                    m->y = read_uint16_be(&p, end);
-                    m->z = read_sint8(&p, end);
+                    int x = read_uint16_be(&p, end);
+                    int y = read_uint16_be(&p, end);
+                    int z = read_sint8(&p, end);
+                    game_place_mobile(m, x, y, z);
                     m->dir = read_uint8(&p, end);
                     m->hue_id = read_uint16_be(&p, end);
                     m->flags = read_uint8(&p, end);
@@ -1580,6 +1579,7 @@ void net_poll()
                         //printf("mob %x, equip %x %d %d %d\n", mob_id, id, item_id, layer, hue_id);
                         game_equip(m, serial, item_id, layer, hue_id);
                     }
+                    game_prefetch_mobile(m);
 
                     break;
                 }
@@ -1779,9 +1779,8 @@ void net_poll()
                     switch (cmd)
                     {
                         case 8: {
-                            // TODO: actually do something with this info
                             int map = read_uint8(&p, end);
-                            printf("ignoring instruction to switch to map %d\n", map);
+                            game_set_map(map);
                             break;
                         }
                         default:
@@ -1823,6 +1822,11 @@ void net_poll()
 
                     break;
                 }
+                case 0xc8: {
+                    int range = read_uint8(&p, end);
+                    game_set_update_range(range);
+                    break;
+                }
                 case 0xcc: {
                     uint32_t speaker_serial = read_uint32_be(&p, end);
                     int graphic_id = read_uint16_le(&p, end);
@@ -2099,6 +2103,7 @@ void net_poll()
                                 //assert(0 && "unhandled command");
                             }
                         }
+                        game_prefetch_generic_gump(gump);
                     }
 
                     break;
@@ -2134,20 +2139,16 @@ void net_poll()
                     {
                         item_t *item = game_get_item(serial);
                         item->item_id = graphic_id;
-                        item->space = SPACETYPE_WORLD;
-                        item->loc.world.x = x;
-                        item->loc.world.y = y;
-                        item->loc.world.z = z;
                         item->hue_id = hue_id;
+                        game_place_item(item, x, y, z);
+                        game_prefetch_item(graphic_id);
                     }
                     else
                     {
                         printf("OMGOGMOGMOGM MULTI?!?!\n");
                         multi_t *multi = game_get_multi(serial);
-                        multi->x = x;
-                        multi->y = y;
-                        multi->z = z;
                         multi->multi_id = graphic_id;
+                        game_place_multi(multi, x, y, z);
                     }
 
                     break;
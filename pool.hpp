@@ -0,0 +1,101 @@
+#ifndef _POOL_HPP
+#define _POOL_HPP
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+// hands out objects of type T from big slabs, so creating and deleting lots
+// of objects doesn't hit malloc for every one of them. slabs are never moved
+// or freed while the pool is alive, so a pointer to an object stays valid
+// (and can be used as a handle) until the object is given back.
+// objects are handed out zeroed, T must be a plain old data type.
+template <typename T>
+struct object_pool_t
+{
+    struct node_t
+    {
+        T object;
+        node_t *next_free;
+    };
+
+    struct slab_t
+    {
+        slab_t *next;
+        node_t nodes[];
+    };
+
+    int slab_size;
+    slab_t *slabs;
+    node_t *free_list;
+
+    // statistics
+    int live_count;
+    int slab_count;
+
+    void init(int objects_per_slab)
+    {
+        slab_size = objects_per_slab;
+        slabs = NULL;
+        free_list = NULL;
+        live_count = 0;
+        slab_count = 0;
+    }
+
+    void add_slab()
+    {
+        slab_t *slab = (slab_t *)malloc(sizeof(slab_t) + slab_size * sizeof(node_t));
+        slab->next = slabs;
+        slabs = slab;
+        slab_count += 1;
+
+        // push in reverse, so objects are handed out in address order
+        for (int i = slab_size - 1; i >= 0; i--)
+        {
+            slab->nodes[i].next_free = free_list;
+            free_list = &slab->nodes[i];
+        }
+    }
+
+    // make sure at least n more objects can be handed out without allocating
+    void reserve(int n)
+    {
+        int available = 0;
+        for (node_t *node = free_list; node != NULL && available < n; node = node->next_free)
+        {
+            available += 1;
+        }
+        while (available < n)
+        {
+            add_slab();
+            available += slab_size;
+        }
+    }
+
+    T *alloc()
+    {
+        if (free_list == NULL)
+        {
+            add_slab();
+        }
+        node_t *node = free_list;
+        free_list = node->next_free;
+        node->next_free = NULL;
+        memset(&node->object, 0, sizeof(T));
+        live_count += 1;
+        return &node->object;
+    }
+
+    void free(T *object)
+    {
+        // object is the first member, so the node starts at the same address
+        node_t *node = (node_t *)object;
+        node->next_free = free_list;
+        free_list = node;
+        live_count -= 1;
+        assert(live_count >= 0);
+    }
+};
+
+#endif
+
@@ -0,0 +1,28 @@
+#version 130
+
+uniform sampler2D tex;
+uniform sampler2D tex_hue;
+
+in vec2 tileCoord;
+flat in vec4 spriteRect;
+// x: row in the hue table, y: only hue grey pixels, z: hue at all
+in vec3 normal;
+
+void main()
+{
+    // the sprite is in an atlas, so wrap by hand instead of with GL_REPEAT
+    vec2 texCoord = spriteRect.xy + fract(tileCoord) * (spriteRect.zw - spriteRect.xy);
+    vec4 texColor = texture(tex, texCoord);
+    if (normal.z > 0.5)
+    {
+        vec3 base = texColor.rgb;
+        bool is_grey = base.r == base.g && base.g == base.b;
+        if (normal.y < 0.5 || is_grey)
+        {
+            // the red channel picks one of the hue's 32 colors
+            float lookup_x = mix(0.5 / 32.0, 31.5 / 32.0, base.r);
+            texColor.rgb = texture(tex_hue, vec2(lookup_x, normal.x)).rgb;
+        }
+    }
+    gl_FragColor = texColor;
+}
@@ -0,0 +1,60 @@
+#version 130
+
+// like blit.vert, but the sprite in tex_rect is repeated to fill the quad,
+// which must be an unflipped rectangle
+
+// per vertex: which corner of the sprite this is
+in float corner;
+
+// per instance, see sprite_instance_t
+in vec4 corners01;
+in vec4 corners23;
+in vec4 tex_rect;
+in float depth;
+in vec4 param;
+
+uniform vec2 screen_size;
+// meshes are drawn moved by xy, with their depths scaled by w and moved by z
+uniform vec4 offset;
+uniform sampler2D tex;
+
+// in sprites from the top left corner, the fraction is where in the sprite
+out vec2 tileCoord;
+flat out vec4 spriteRect;
+out vec3 normal;
+
+void main()
+{
+    // tex_rect is a tenth of a texel inside the sprite on every side
+    vec2 sprite_size = floor((tex_rect.zw - tex_rect.xy) * vec2(textureSize(tex, 0)) + 0.5);
+    vec2 tiles = vec2(corners01.z - corners01.x, corners23.w - corners01.y) / sprite_size;
+
+    vec2 pos;
+    if (corner < 0.5)
+    {
+        pos = corners01.xy;
+        tileCoord = vec2(0.0, 0.0);
+    }
+    else if (corner < 1.5)
+    {
+        pos = corners01.zw;
+        tileCoord = vec2(tiles.x, 0.0);
+    }
+    else if (corner < 2.5)
+    {
+        pos = corners23.xy;
+        tileCoord = tiles;
+    }
+    else
+    {
+        pos = corners23.zw;
+        tileCoord = vec2(0.0, tiles.y);
+    }
+    spriteRect = tex_rect;
+    normal = param.xyz;
+
+    // same mapping as glOrtho(0, width, height, 0, -1, 1)
+    pos += offset.xy;
+    float d = depth * offset.w + offset.z;
+    gl_Position = vec4(pos.x / screen_size.x * 2.0 - 1.0, 1.0 - pos.y / screen_size.y * 2.0, -d, 1.0);
+}